@@ -70,6 +70,13 @@ static int raw_discard(BlockDriverState *bs, int64_t sector_num, int nb_sectors)
     return bdrv_discard(bs->file, sector_num, nb_sectors);
 }
 
+static BlockDriverAIOCB *raw_aio_discard(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors,
+    BlockDriverCompletionFunc *cb, void *opaque)
+{
+    return bdrv_aio_discard(bs->file, sector_num, nb_sectors, cb, opaque);
+}
+
 static int raw_is_inserted(BlockDriverState *bs)
 {
     return bdrv_is_inserted(bs->file);
@@ -136,6 +143,7 @@ static BlockDriver bdrv_raw = {
     .bdrv_aio_writev    = raw_aio_writev,
     .bdrv_aio_flush     = raw_aio_flush,
     .bdrv_discard       = raw_discard,
+    .bdrv_aio_discard   = raw_aio_discard,
 
     .bdrv_is_inserted   = raw_is_inserted,
     .bdrv_eject         = raw_eject,
@@ -1315,6 +1315,8 @@ show dynamic compiler info
 show KVM information
 @item info numa
 show NUMA information
+@item info nvme
+show NVMe controller statistics
 @item info kvm
 show KVM information
 @item info usb
@@ -21,6 +21,9 @@
 #include "nvme.h"
 #include "nvme_debug.h"
 #include "range.h"
+#include "kvm.h"
+#include "host-utils.h"
+#include "trace.h"
 
 static const VMStateDescription vmstate_nvme = {
     .name = "nvme",
@@ -34,94 +37,295 @@ static void nvme_pci_write_config(PCIDevice *, uint32_t, uint32_t, int);
 static uint32_t nvme_pci_read_config(PCIDevice *, uint32_t, int);
 static inline uint8_t range_covers_reg(uint64_t, uint64_t, uint64_t,
     uint64_t);
-static void process_doorbell(NVMEState *, target_phys_addr_t, uint32_t);
 static void read_file(NVMEState *, uint8_t);
 static void sq_processing_timer_cb(void *);
+static void sq_processing_bh_cb(void *);
 
 /*********************************************************************
-    Function     :    process_doorbell
-    Description  :    Processing Doorbell and SQ commands
+    Function     :    sq_pending_entries
+    Description  :    Number of entries posted to a SQ but not yet
+                      fetched by the controller
+    Return Type  :    uint32_t : Number of pending entries
+    Arguments    :    NVMEIOSQueue * : Pointer to the SQ
+*********************************************************************/
+static uint32_t sq_pending_entries(NVMEIOSQueue *sq)
+{
+    if (sq->tail >= sq->head) {
+        return sq->tail - sq->head;
+    }
+    return (sq->size + 1) - sq->head + sq->tail;
+}
+
+/*********************************************************************
+    Function     :    kick_sq_processing
+    Description  :    Schedules a SQ processing pass. By default the
+                      pass runs from a bottom half as soon as the
+                      doorbell write returns; when batch_ns is set the
+                      pass is delayed to batch several doorbells
     Return Type  :    void
     Arguments    :    NVMEState * : Pointer to NVME device State
-                      target_phys_addr_t : Address (offset address)
-                      uint32_t : Value to be written
 *********************************************************************/
-static void process_doorbell(NVMEState *nvme_dev, target_phys_addr_t addr,
-    uint32_t val)
+static void kick_sq_processing(NVMEState *n)
 {
-    /* Used to get the SQ/CQ number to be written to */
-    uint32_t queue_id;
     int64_t deadline;
 
-    LOG_DBG("%s(): addr = 0x%08x, val = 0x%08x\n",
-        __func__, (unsigned)addr, val);
+    if (!n->batch_ns) {
+        qemu_bh_schedule(n->sq_processing_bh);
+        return;
+    }
 
+    /* Check if the SQ processing routine is already scheduled for
+     * execution. If it isn't, make it so
+     */
+    if (n->sq_processing_timer_target == 0) {
+        deadline = qemu_get_clock_ns(vm_clock) + n->batch_ns;
+        qemu_mod_timer(n->sq_processing_timer, deadline);
+        n->sq_processing_timer_target = deadline;
+    }
+}
 
-    /* Check if it is CQ or SQ doorbell */
-    queue_id = (addr - NVME_SQ0TDBL) / sizeof(uint32_t);
+/*********************************************************************
+    Function     :    kick_sq
+    Description  :    Hands a rung SQ to whoever serves it: its I/O
+                      thread or the main loop
+    Return Type  :    void
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      uint16_t : SQ ID
+*********************************************************************/
+static void kick_sq(NVMEState *n, uint16_t sq_id)
+{
+    if (nvme_sq_on_io_thread(n, sq_id)) {
+        nvme_io_thread_kick(n, n->sq[sq_id].cq_id);
+    } else {
+        kick_sq_processing(n);
+    }
+}
 
-    if (queue_id % 2) {
-        /* CQ */
-        queue_id = (addr - NVME_CQ0HDBL) / QUEUE_BASE_ADDRESS_WIDTH;
-        if (queue_id > NVME_MAX_QID) {
-            LOG_NORM("Wrong CQ ID: %d\n", queue_id);
-            return;
-        }
+/*********************************************************************
+    Function     :    nvme_db_writel
+    Description  :    Doorbell write. addr is the offset in the doorbell
+                      region, which starts at NVME_SQ0TDBL: the queue ID
+                      and the kind of doorbell come from the index of
+                      the stride addr falls in
+    Return Type  :    void
+    Arguments    :    void * : Pointer to NVME device State
+                      target_phys_addr_t : Offset in the doorbells
+                      uint32_t : Value to be written
+*********************************************************************/
+static void nvme_db_writel(void *opaque, target_phys_addr_t addr,
+    uint32_t val)
+{
+    NVMEState *n = opaque;
+    uint32_t db = addr >> (2 + n->dstrd);
+    uint16_t qid = db >> 1;
+    uint32_t i;
 
-        nvme_dev->cq[queue_id].head = val & 0xffff;
-    } else {
-        /* SQ */
-        queue_id = (addr - NVME_SQ0TDBL) / QUEUE_BASE_ADDRESS_WIDTH;
-        if (queue_id > NVME_MAX_QID) {
-            LOG_NORM("Wrong SQ ID: %d\n", queue_id);
-            return;
+    if ((addr & (NVME_DB_STRIDE(n->dstrd) - 1)) || qid >= NVME_MAX_QID) {
+        trace_nvme_err_doorbell(n, NVME_SQ0TDBL + addr, val);
+        return;
+    }
+
+    if (db & 1) {
+        trace_nvme_cq_doorbell(n, qid, val & 0xffff);
+        n->cq[qid].head = val & 0xffff;
+
+        /* Freeing CQ slots may unblock SQs that stalled on a full CQ */
+        for (i = 0; i < NVME_MAX_QID; i++) {
+            if (n->sq[i].cq_id == qid && n->sq[i].head != n->sq[i].tail) {
+                kick_sq(n, i);
+                break;
+            }
         }
-        nvme_dev->sq[queue_id].tail = val & 0xffff;
+    } else {
+        trace_nvme_sq_doorbell(n, qid, val & 0xffff);
+        n->sq[qid].tail = val & 0xffff;
+        nvme_sq_ready(n, qid);
+        kick_sq(n, qid);
+    }
+}
 
-        /* Check if the SQ processing routine is scheduled for
-         * execution within 5 uS.If it isn't, make it so
-         */
+/*********************************************************************
+    Function     :    nvme_db_write
+    Description  :    Doorbell writes of 1 or 2 Bytes, not supported
+    Return Type  :    void
+    Arguments    :    void * : Pointer to NVME device State
+                      target_phys_addr_t : Offset in the doorbells
+                      uint32_t : Value to be written
+*********************************************************************/
+static void nvme_db_write(void *opaque, target_phys_addr_t addr,
+    uint32_t val)
+{
+    LOG_NORM("Doorbell writes are 4 Bytes wide");
+}
 
+/*********************************************************************
+    Function     :    nvme_db_read
+    Description  :    Doorbell reads, of any width
+    Return Type  :    uint32_t : 0, the doorbells are write only
+    Arguments    :    void * : Pointer to NVME device State
+                      target_phys_addr_t : Offset in the doorbells
+*********************************************************************/
+static uint32_t nvme_db_read(void *opaque, target_phys_addr_t addr)
+{
+    LOG_NORM("Undefined operation of reading the doorbell registers");
+    return 0;
+}
 
-        deadline = qemu_get_clock_ns(vm_clock) + 5000;
+static CPUWriteMemoryFunc * const nvme_db_mmio_write[] = {
+    nvme_db_write,
+    nvme_db_write,
+    nvme_db_writel,
+};
 
-        if (nvme_dev->sq_processing_timer_target == 0) {
-            qemu_mod_timer(nvme_dev->sq_processing_timer, deadline);
-            nvme_dev->sq_processing_timer_target = deadline;
-        }
+static CPUReadMemoryFunc * const nvme_db_mmio_read[] = {
+    nvme_db_read,
+    nvme_db_read,
+    nvme_db_read,
+};
+
+/*********************************************************************
+    Function     :    process_sq_pass
+    Description  :    Drains the SQs served by the main loop, in the
+                      order chosen by the arbitration mechanism. The
+                      budget of a pass is the amount of work pending
+                      when the pass starts, bounded by
+                      NVME_SQ_BUDGET_MIN/MAX, so that a busy device
+                      does not starve the main loop while a burst of
+                      doorbells is still handled in one go. Work left
+                      over is picked up by another pass.
+    Return Type  :    void
+    Arguments    :    NVMEState * : Pointer to NVME device State
+*********************************************************************/
+static void process_sq_pass(NVMEState *n)
+{
+    uint64_t mask, m;
+    uint32_t budget = 0;
+    uint8_t more;
+
+    /* With I/O threads only the admin SQ is left to the main loop */
+    mask = n->nr_iothreads ? 1ULL << ASQ_ID : ~0ULL;
+    for (m = n->sq_ready & mask; m; m &= m - 1) {
+        budget += sq_pending_entries(&n->sq[ctz64(m)]);
     }
-    return;
+    budget = MIN(MAX(budget, NVME_SQ_BUDGET_MIN), NVME_SQ_BUDGET_MAX);
+
+    more = nvme_arbitrate(n, &n->arb, mask, budget);
+    if (n->uring) {
+        /* One system call for the I/O queued by the whole pass */
+        nvme_uring_submit(n->uring);
+    }
+    if (more) {
+        kick_sq_processing(n);
+    }
+}
+
+static void sq_processing_bh_cb(void *param)
+{
+    process_sq_pass((NVMEState *) param);
 }
 
 static void sq_processing_timer_cb(void *param)
 {
     NVMEState *n =  (NVMEState *) param;
-    int sq_id;
-    int entries_to_process = ENTRIES_TO_PROCESS;
-
-    /* Check SQs for work */
-
-    for (sq_id = 0; sq_id < NVME_MAX_QID; sq_id++) {
-        while (n->sq[sq_id].head != n->sq[sq_id].tail) {
-            /* Handle one SQ entry */
-            process_sq(n, sq_id);
-            entries_to_process--;
-            if (entries_to_process == 0) {
-                /* Check back in a short while : 5 uS */
-                n->sq_processing_timer_target = qemu_get_clock_ns(vm_clock)
-                    + 5000;
-                qemu_mod_timer(n->sq_processing_timer,
-                    n->sq_processing_timer_target);
-
-                /* We're done for now */
-                return;
-            }
+
+    /* Allow the pass to re-arm the timer if work is left over */
+    n->sq_processing_timer_target = 0;
+    process_sq_pass(n);
+}
+
+/*********************************************************************
+    Function     :    sq_notifier_read
+    Description  :    Handler for a SQ tail doorbell ioeventfd. KVM does
+                      not hand over the value the guest wrote, so the
+                      new tail is taken from the shadow doorbell of
+                      Doorbell Buffer Config, checked against the SQ
+                      size like every shadow read
+    Return Type  :    void
+    Arguments    :    void * : Pointer to the SQ notifier
+*********************************************************************/
+static void sq_notifier_read(void *opaque)
+{
+    NVMESQNotifier *sn = opaque;
+    NVMEState *n = sn->n;
+    NVMEIOSQueue *sq = &n->sq[sn->sq_id];
+
+    if (!event_notifier_test_and_clear(&sn->notifier) || !sq->tail_addr) {
+        return;
+    }
+    nvme_shadow_read(sq->tail_addr, sq->size, &sq->tail);
+    trace_nvme_sq_doorbell(n, sn->sq_id, sq->tail);
+    nvme_sq_ready(n, sn->sq_id);
+    kick_sq(n, sn->sq_id);
+}
+
+/*********************************************************************
+    Function     :    set_sq_ioeventfd
+    Description  :    Binds/unbinds an eventfd to the tail doorbell of a
+                      SQ at the current BAR0 address
+    Return Type  :    int : 0 on success, negative errno on failure
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      uint16_t : SQ ID
+                      bool : true to assign, false to deassign
+*********************************************************************/
+static int set_sq_ioeventfd(NVMEState *n, uint16_t sq_id, bool assign)
+{
+    NVMESQNotifier *sn = &n->sq_notifier[sq_id];
+    uint64_t addr = (uint64_t)(uintptr_t)n->bar0 +
+        NVME_SQyTDBL(sq_id, n->dstrd);
+    int fd, ret;
+
+    if (assign) {
+        ret = event_notifier_init(&sn->notifier, 0);
+        if (ret < 0) {
+            return ret;
+        }
+        fd = event_notifier_get_fd(&sn->notifier);
+        ret = kvm_set_ioeventfd_mmio_kick(fd, addr, true);
+        if (ret < 0) {
+            event_notifier_cleanup(&sn->notifier);
+            return ret;
         }
+        sn->n = n;
+        sn->sq_id = sq_id;
+        sn->assigned = 1;
+        qemu_set_fd_handler(fd, sq_notifier_read, NULL, sn);
+    } else {
+        fd = event_notifier_get_fd(&sn->notifier);
+        qemu_set_fd_handler(fd, NULL, NULL, NULL);
+        ret = kvm_set_ioeventfd_mmio_kick(fd, addr, false);
+        sn->assigned = 0;
+        /* Do not lose a kick that raced with the deassign */
+        sq_notifier_read(sn);
+        event_notifier_cleanup(&sn->notifier);
     }
+    return ret;
+}
 
-    /* There isn't anything left to do: temporarily disable the timer */
-    n->sq_processing_timer_target = 0;
-    qemu_del_timer(n->sq_processing_timer);
+/*********************************************************************
+    Function     :    nvme_update_ioeventfd
+    Description  :    Arms the SQ tail doorbell ioeventfd when enabled by
+                      the ioeventfd property and the SQ tail can be read
+                      from guest memory, disarms it otherwise
+    Return Type  :    void
+    Arguments    :    NVMEState * : Pointer to NVME device State
+                      uint16_t : SQ ID
+*********************************************************************/
+void nvme_update_ioeventfd(NVMEState *n, uint16_t sq_id)
+{
+    NVMESQNotifier *sn = &n->sq_notifier[sq_id];
+    bool want = (n->flags & NVME_FLAG_IOEVENTFD) && n->bar0 &&
+        n->sq[sq_id].dma_addr && n->sq[sq_id].tail_addr;
+
+    if (want == !!sn->assigned) {
+        return;
+    }
+    if (want && !kvm_has_many_ioeventfds()) {
+        return;
+    }
+    if (set_sq_ioeventfd(n, sq_id, want) < 0) {
+        LOG_ERR("Unable to %s ioeventfd for SQ %d, using MMIO doorbell",
+            want ? "assign" : "deassign", sq_id);
+    }
 }
 
 /*********************************************************************
@@ -217,7 +421,11 @@ static void nvme_mmio_writel(void *opaque, target_phys_addr_t addr,
                 /* Check if admin queues are ready to use and
                  * check enable bit CC.EN
                  */
-                if (nvme_dev->cq[ACQ_ID].dma_addr &&
+                /* CC.MPS has to be within CAP.MPSMIN and CAP.MPSMAX */
+                if (((val >> 7) & 0xf) < nvme_dev->ctrlcap->mpsmin ||
+                    ((val >> 7) & 0xf) > nvme_dev->ctrlcap->mpsmax) {
+                    LOG_ERR("CC.MPS %d not supported", (val >> 7) & 0xf);
+                } else if (nvme_dev->cq[ACQ_ID].dma_addr &&
                     nvme_dev->sq[ASQ_ID].dma_addr &&
                     (!nvme_open_storage_file(nvme_dev))) {
                     /* Update CSTS.RDY based on CC.EN and set the phase tag */
@@ -264,9 +472,6 @@ static void nvme_mmio_writel(void *opaque, target_phys_addr_t addr,
         default:
             break;
         }
-    } else if (addr >= NVME_SQ0TDBL && addr <= NVME_CQMAXHDBL) {
-        /* Process the Doorbell Writes and masking of higher word */
-        process_doorbell(nvme_dev, addr, val);
     }
     return;
 }
@@ -378,12 +583,8 @@ static uint32_t nvme_mmio_readb(void *opaque, target_phys_addr_t addr)
     /* Check if NVME controller Capabilities was written */
     if (addr < NVME_SQ0TDBL) {
         rd_val = nvme_cntrl_read_config(nvme_dev, addr, BYTE);
-    } else if (addr >= NVME_SQ0TDBL && addr <= NVME_CQMAXHDBL) {
-        LOG_NORM("Undefined operation of reading the doorbell registers");
-        rd_val = 0;
     } else {
         LOG_ERR("Undefined address read");
-        LOG_ERR("Qemu supports only 64 queues");
         rd_val = 0 ;
     }
     return rd_val;
@@ -407,12 +608,8 @@ static uint32_t nvme_mmio_readw(void *opaque, target_phys_addr_t addr)
     /* Check if NVME controller Capabilities was written */
     if (addr < NVME_SQ0TDBL) {
         rd_val = nvme_cntrl_read_config(nvme_dev, addr, WORD);
-    } else if (addr >= NVME_SQ0TDBL && addr <= NVME_CQMAXHDBL) {
-        LOG_NORM("Undefined operation of reading the doorbell registers");
-        rd_val = 0;
     } else {
         LOG_ERR("Undefined address read");
-        LOG_ERR("Qemu supports only 64 queues");
         rd_val = 0 ;
     }
     return rd_val;
@@ -434,12 +631,8 @@ static uint32_t nvme_mmio_readl(void *opaque, target_phys_addr_t addr)
     /* Check if NVME controller Capabilities was written */
     if (addr < NVME_SQ0TDBL) {
         rd_val = nvme_cntrl_read_config(nvme_dev, addr, DWORD);
-    } else if (addr >= NVME_SQ0TDBL && addr <= NVME_CQMAXHDBL) {
-        LOG_NORM("Undefined operation of reading the doorbell registers");
-        rd_val = 0;
     } else {
         LOG_ERR("Undefined address read");
-        LOG_ERR("Qemu supports only 64 queues");
         rd_val = 0 ;
     }
     return rd_val;
@@ -534,22 +727,41 @@ static void nvme_mmio_map(PCIDevice *pci_dev, int reg_num, pcibus_t addr,
                             pcibus_t size, int type)
 {
     NVMEState *n = DO_UPCAST(NVMEState, dev, pci_dev);
+    uint16_t i;
+    uint8_t assigned[NVME_MAX_QID];
 
     if (reg_num) {
         LOG_NORM("Only bar0 is allowed! reg_num: %d\n", reg_num);
     }
 
     /* Is this hacking? */
-    /* BAR 0 is shared: Registry, doorbells and MSI-X. Only
-     * registry and doorbell part of BAR0 should be handled
-     * by nvme mmio functions.
+    /* BAR 0 is shared: Registry, doorbells and MSI-X. The
+     * registry is handled by the nvme mmio functions, the
+     * doorbells have their own region and handlers so a
+     * doorbell write does not go through the register decode.
      * The MSI-X part of BAR0 should be mapped by MSI-X functions.
      * The msix_init function changes the bar size to add its
      * tables to it. */
 
-    cpu_register_physical_memory(addr, n->bar0_size, n->mmio_index);
+    /* Doorbell ioeventfds follow the BAR */
+    for (i = 0; i < NVME_MAX_QID; i++) {
+        assigned[i] = n->sq_notifier[i].assigned;
+        if (assigned[i]) {
+            set_sq_ioeventfd(n, i, false);
+        }
+    }
+
+    cpu_register_physical_memory(addr, NVME_SQ0TDBL, n->mmio_index);
+    cpu_register_physical_memory(addr + NVME_SQ0TDBL,
+        n->bar0_size - NVME_SQ0TDBL, n->db_mmio_index);
     n->bar0 = (void *) addr;
 
+    for (i = 0; i < NVME_MAX_QID; i++) {
+        if (assigned[i]) {
+            nvme_update_ioeventfd(n, i);
+        }
+    }
+
     /* Let the MSI-X part handle the MSI-X table.  */
     msix_mmio_map(pci_dev, reg_num, addr, size, type);
 }
@@ -598,8 +810,11 @@ static void clear_nvme_device(NVMEState *n)
     }
 
     /* Inflight Operations will not be processed */
+    nvme_io_thread_pause(n);
+    qemu_bh_cancel(n->sq_processing_bh);
     qemu_del_timer(n->sq_processing_timer);
     n->sq_processing_timer_target = 0;
+    nvme_irq_reset(n);
     nvme_close_storage_file(n);
 
     /* Saving the Admin Queue States before reset */
@@ -623,9 +838,16 @@ static void clear_nvme_device(NVMEState *n)
         (uint32_t) (n->aqstate.acqa >> 32), DWORD);
 
     for (i = 0; i < NVME_MAX_QID; i++) {
+        nvme_free_sq_requests(n, i);
         memset(&(n->sq[i]), 0, sizeof(NVMEIOSQueue));
         memset(&(n->cq[i]), 0, sizeof(NVMEIOCQueue));
+        nvme_update_ioeventfd(n, i);
     }
+    n->sq_ready = 0;
+    n->dbbuf_dbs = n->dbbuf_eis = 0;
+    memset(&n->arb, 0, sizeof(n->arb));
+    memset(n->cq_batch, 0, NVME_MAX_QID * sizeof(NVMECQBatch));
+    nvme_io_thread_resume(n);
 }
 
 /*********************************************************************
@@ -733,6 +955,11 @@ static void read_file(NVMEState *n, uint8_t space)
             fclose(config_file);
         }
     }
+    if (space == NVME_SPACE) {
+        nvme_cmb_set_registry(n);
+        /* CAP.DSTRD follows the db_stride property */
+        n->ctrlcap->dstrd = n->dstrd;
+    }
 }
 
 /*********************************************************************
@@ -750,12 +977,28 @@ static int pci_nvme_init(PCIDevice *pci_dev)
     uint32_t ret;
 
     /* TODO: pci_conf = n->dev.config; */
+    if (nvme_init_namespaces(n)) {
+        return -1;
+    }
+    if (n->ns[0].bs && n->nr_iothreads) {
+        /* The block layer may only be used from the main loop */
+        LOG_ERR("iothreads are not supported with a drive backend");
+        return -1;
+    }
+    if (n->dstrd > NVME_DSTRD_MAX) {
+        LOG_ERR("db_stride must be at most %d", NVME_DSTRD_MAX);
+        return -1;
+    }
     n->nvectors = NVME_MSIX_NVECTORS;
-    n->bar0_size = NVME_REG_SIZE;
 
     /* Reading the PCI space from the file */
     read_file(n, PCI_SPACE);
 
+    n->bar0_size = NVME_REG_SIZE;
+    while (n->bar0_size < NVME_SQ0TDBL + NVME_DB_SIZE(n->dstrd)) {
+        n->bar0_size <<= 1;
+    }
+
     ret = msix_init((struct PCIDevice *)&n->dev,
          n->nvectors, 0, n->bar0_size);
     if (ret) {
@@ -769,6 +1012,8 @@ static int pci_nvme_init(PCIDevice *pci_dev)
     /* NVMe is Little Endian. */
     n->mmio_index = cpu_register_io_memory(nvme_mmio_read, nvme_mmio_write,
         n,  DEVICE_LITTLE_ENDIAN);
+    n->db_mmio_index = cpu_register_io_memory(nvme_db_mmio_read,
+        nvme_db_mmio_write, n, DEVICE_LITTLE_ENDIAN);
 
     /* Register BAR 0 (and bar 1 as it is 64bit). */
     pci_register_bar((struct PCIDevice *)&n->dev,
@@ -777,6 +1022,9 @@ static int pci_nvme_init(PCIDevice *pci_dev)
         (PCI_BASE_ADDRESS_SPACE_MEMORY |
         PCI_BASE_ADDRESS_MEM_TYPE_64),
         nvme_mmio_map);
+    if (nvme_cmb_init(n)) {
+        return -1;
+    }
 
     /* Allocating space for NVME regspace & masks except the doorbells */
     n->cntrl_reg = qemu_mallocz(NVME_CNTRL_SIZE);
@@ -807,6 +1055,8 @@ static int pci_nvme_init(PCIDevice *pci_dev)
     /* Defaulting the number of Queues */
     n->feature.number_of_queues = ((NVME_MAX_QID - 1) << 16)
         | (NVME_MAX_QID - 1);
+    n->feature.arbitration = NVME_ARB_AB_DEFAULT;
+    n->feature.volatile_write_cache = NVME_VWC_WCE;
 
     for (ret = 0; ret < n->nvectors; ret++) {
         msix_vector_use(&n->dev, ret);
@@ -818,11 +1068,20 @@ static int pci_nvme_init(PCIDevice *pci_dev)
         memset(&(n->cq[ret]), 0, sizeof(NVMEIOCQueue));
     }
 
-    n->fd = -1;
-    n->mapping_addr = NULL;
+    QTAILQ_INIT(&n->requests);
+    n->cq_batch = qemu_mallocz(NVME_MAX_QID * sizeof(NVMECQBatch));
+    nvme_stats_init(n);
+    n->sq_processing_bh = qemu_bh_new(sq_processing_bh_cb, n);
     n->sq_processing_timer = qemu_new_timer_ns(vm_clock,
         sq_processing_timer_cb, n);
+    n->irq_timer = qemu_new_timer_ns(vm_clock, nvme_irq_timer_cb, n);
 
+    if ((n->flags & NVME_FLAG_URING) && nvme_uring_init(n)) {
+        return -1;
+    }
+    if (n->nr_iothreads && nvme_init_io_thread(n)) {
+        return -1;
+    }
 
     return 0;
 }
@@ -836,6 +1095,7 @@ static int pci_nvme_init(PCIDevice *pci_dev)
 static int pci_nvme_uninit(PCIDevice *pci_dev)
 {
     NVMEState *n = DO_UPCAST(NVMEState, dev, pci_dev);
+    uint16_t i;
 
     /* Freeing space allocated for NVME regspace masks except the doorbells */
     qemu_free(n->cntrl_reg);
@@ -852,9 +1112,33 @@ static int pci_nvme_uninit(PCIDevice *pci_dev)
         qemu_free_timer(n->sq_processing_timer);
         n->sq_processing_timer = NULL;
     }
+    if (n->irq_timer) {
+        nvme_irq_reset(n);
+        qemu_free_timer(n->irq_timer);
+        n->irq_timer = NULL;
+    }
+    if (n->sq_processing_bh) {
+        qemu_bh_delete(n->sq_processing_bh);
+        n->sq_processing_bh = NULL;
+    }
+
+    nvme_exit_io_thread(n);
+    nvme_uring_exit(n);
+
+    for (i = 0; i < NVME_MAX_QID; i++) {
+        if (n->sq_notifier[i].assigned) {
+            set_sq_ioeventfd(n, i, false);
+        }
+    }
 
     LOG_NORM("Freed NVME device memory");
     nvme_close_storage_file(n);
+    for (i = 0; i < NVME_MAX_QID; i++) {
+        nvme_free_sq_requests(n, i);
+    }
+    qemu_free(n->cq_batch);
+    nvme_stats_exit(n);
+    nvme_cmb_exit(n);
     return 0;
 }
 
@@ -869,6 +1153,26 @@ static PCIDeviceInfo nvme_info = {
     .init = pci_nvme_init,
     .exit = pci_nvme_uninit,
     .qdev.props = (Property[]) {
+        DEFINE_PROP_DRIVE("drive", NVMEState, ns[0].bs),
+        DEFINE_PROP_DRIVE("drive2", NVMEState, ns[1].bs),
+        DEFINE_PROP_DRIVE("drive3", NVMEState, ns[2].bs),
+        DEFINE_PROP_DRIVE("drive4", NVMEState, ns[3].bs),
+        DEFINE_PROP_UINT32("namespaces", NVMEState, nr_namespaces, 1),
+        DEFINE_PROP_STRING("ns_size", NVMEState, ns_size),
+        DEFINE_PROP_STRING("lba_size", NVMEState, lba_size),
+        DEFINE_PROP_UINT32("batch_ns", NVMEState, batch_ns, 0),
+        DEFINE_PROP_UINT32("cmb_size_mb", NVMEState, cmb_size_mb, 0),
+        DEFINE_PROP_UINT32("db_stride", NVMEState, dstrd, 0),
+        DEFINE_PROP_STRING("io_mode", NVMEState, io_mode),
+        DEFINE_PROP_BIT("ioeventfd", NVMEState, flags,
+                        NVME_FLAG_IOEVENTFD_BIT, false),
+        DEFINE_PROP_UINT32("iothreads", NVMEState, nr_iothreads, 0),
+        DEFINE_PROP_BIT("iothread_affinity", NVMEState, flags,
+                        NVME_FLAG_IOTHREAD_AFFINITY_BIT, false),
+        DEFINE_PROP_BIT("thin", NVMEState, flags, NVME_FLAG_THIN_BIT, false),
+        DEFINE_PROP_BIT("uring", NVMEState, flags, NVME_FLAG_URING_BIT, false),
+        DEFINE_PROP_BIT("sqpoll", NVMEState, flags, NVME_FLAG_URING_SQPOLL_BIT,
+            false),
         DEFINE_PROP_END_OF_LIST(),
     }
 };
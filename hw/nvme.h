@@ -7,6 +7,10 @@
 #include "loader.h"
 #include "sysemu.h"
 #include "msix.h"
+#include "event_notifier.h"
+#include "qemu-thread.h"
+#include "block.h"
+#include "dma.h"
 #include <pthread.h>
 #include <sched.h>
 
@@ -20,14 +24,13 @@
 #define NVME_DEV_ID 0x0111
 /* Maximum number of charachters on a line in any config file */
 #define MAX_CHAR_PER_LINE 250
-/* Width of SQ/CQ base address in bytes*/
-#define QUEUE_BASE_ADDRESS_WIDTH 8
 /* Length in bytes of registers in PCI space */
 #define PCI_ROM_ADDRESS_LEN 0x04
 #define PCI_BIST_LEN 0x01
 #define PCI_BASE_ADDRESS_2_LEN 0x04
-/* Defines the number of entries to process per execution */
-#define ENTRIES_TO_PROCESS 4
+/* Bounds on the number of SQ entries handled in one processing pass */
+#define NVME_SQ_BUDGET_MIN 4
+#define NVME_SQ_BUDGET_MAX 1024
 /* bytes,word and dword in bytes */
 #define BYTE 1
 #define WORD 2
@@ -48,7 +51,8 @@
 /* The spec requires giving the table structure
  * a 4K aligned region all by itself. */
 #define MSIX_PAGE_SIZE 0x1000
-/* Give 8kB for registers. Should be OK for 512 queues. */
+/* Smallest BAR 0: the registers and the doorbells of the default stride.
+ * It grows to a power of 2 that fits the doorbells of a larger stride. */
 #define NVME_REG_SIZE (1024 * 8)
 /* Size of NVME Controller Registers except the Doorbells */
 #define NVME_CNTRL_SIZE 0xfff
@@ -56,19 +60,34 @@
 #define NVME_MAX_QID 64
 
 #define NVME_MAX_QUEUE_SIZE 1024
+/* Pages of the largest non contiguous queue, 64 byte SQEs in 4KB pages */
+#define NVME_QUEUE_PRP_MAX (NVME_MAX_QUEUE_SIZE * 64 / 4096)
+/* Bounds on the SQEs fetched and the CQEs written back at once */
+#define NVME_SQE_BATCH 64
+#define NVME_CQE_BATCH 64
 
 /* Queue Limit.*/
 #define NVME_MSIX_NVECTORS 32
 
-/* Assume that block is 512 bytes */
-
 #define NVME_BUF_SIZE    4096
+/* Block layer sector size, LBAs are a multiple of it */
 #define NVME_BLOCK_SIZE        512
-#define NVME_STORAGE_FILE_SIZE    (1024 * 1024 * 1024)
-#define NVME_TOTAL_BLOCKS    (NVME_STORAGE_FILE_SIZE / NVME_BLOCK_SIZE)
+/* Default size of a namespace backed by a mmap'ed file, in MB */
+#define NVME_NS_SIZE_MB    1024
+#define NVME_MAX_NAMESPACES 4
+/* LBA formats reported by Identify Namespace: 512 and 4096 byte LBAs */
+#define NVME_NLBAF 2
 #define FAIL 0x1
 #define NVME_ABORT_COMMAND_LIMIT 10
 #define NVME_EMPTY 0xffffffff
+/* Command status is posted later, from a block layer completion */
+#define NVME_REQ_PENDING 0xff
+/* Largest data transfer of a command, reported as MDTS */
+#define NVME_MAX_XFER_SIZE (2 * 1024 * 1024)
+/* Reads and Writes to a drive are split in chunks of this size, all in
+ * flight together */
+#define NVME_IO_CHUNK_SIZE (256 * 1024)
+#define NVME_IO_CHUNKS (NVME_MAX_XFER_SIZE / NVME_IO_CHUNK_SIZE)
 
 /* NVMe Controller Registers */
 enum {
@@ -81,21 +100,37 @@ enum {
     NVME_AQA       = 0x0024, /* Admin Queue Attributes, 32bit*/
     NVME_ASQ       = 0x0028, /* Admin Submission Queue Base Address, 64b.*/
     NVME_ACQ       = 0x0030, /* Admin Completion Queue Base Address, 64b.*/
-    NVME_RESERVED  = 0x0038, /* Reserved */
+    NVME_CMBLOC    = 0x0038, /* Controller Memory Buffer Location */
+    NVME_CMBSZ     = 0x003C, /* Controller Memory Buffer Size */
     NVME_CMD_SS    = 0x0F00, /* Command Set Specific*/
     NVME_SQ0TDBL   = 0x1000, /* SQ 0 Tail Doorbell, 32bit (Admin) */
-    NVME_CQ0HDBL   = 0x1004, /* CQ 0 Head Doorbell, 32bit (Admin)*/
-    NVME_SQ1TDBL   = 0x1008, /* SQ 1 Tail Doorbell, 32bit */
-    NVME_CQ1HDBL   = 0x100c, /* CQ 1 Head Doorbell, 32bit */
-
-    NVME_SQMAXTDBL = (NVME_SQ0TDBL + 8*(NVME_MAX_QID - 1)),
-    NVME_CQMAXHDBL = (NVME_CQ0HDBL + 8*(NVME_MAX_QID - 1))
 };
 
+/* The doorbells follow the registers: the SQ tail and the CQ head doorbell
+ * of each queue ID, (4 << CAP.DSTRD) bytes apart. dstrd is set with the
+ * db_stride property, a stride of a page keeps each doorbell on its own. */
+#define NVME_DSTRD_MAX 10
+#define NVME_DB_STRIDE(dstrd) (4 << (dstrd))
+#define NVME_DB_SIZE(dstrd) (2 * NVME_MAX_QID * NVME_DB_STRIDE(dstrd))
 /* address for SQ ID. */
-#define NVME_SQyTDBL(id) (NVME_SQ0TDBL + 8*(id))
+#define NVME_SQyTDBL(id, dstrd) \
+    (NVME_SQ0TDBL + (2 * (id)) * NVME_DB_STRIDE(dstrd))
 /* address for CQ ID. */
-#define NVME_CQyTDBL(id) (NVME_CQ0TDBL + 8*(id))
+#define NVME_CQyHDBL(id, dstrd) \
+    (NVME_SQ0TDBL + (2 * (id) + 1) * NVME_DB_STRIDE(dstrd))
+/* Offsets of the shadows of the doorbells of queue ID id in the buffers of
+ * Doorbell Buffer Config, laid out like the doorbell registers */
+#define NVME_DBBUF_SQ(id, dstrd) (NVME_SQyTDBL(id, dstrd) - NVME_SQ0TDBL)
+#define NVME_DBBUF_CQ(id, dstrd) (NVME_CQyHDBL(id, dstrd) - NVME_SQ0TDBL)
+
+/* Controller Memory Buffer: BAR 2, BARs 0 and 1 hold the 64 bit register
+ * BAR. It may hold SQs and PRP lists, its size is in MB units. */
+#define NVME_CMB_BIR 2
+#define NVME_CMB_MAX_MB 1024
+#define NVME_CMBSZ_SQS (1 << 0)
+#define NVME_CMBSZ_LISTS (1 << 2)
+#define NVME_CMBSZ_SZU_1M (2 << 8)
+#define NVME_CMBSZ_SZ(sz) ((sz) << 12)
 
 #define ASQ_ID 0    /* Admin submition queue ID == 0 */
 #define ACQ_ID 0    /* Admin complition queue ID == 0 */
@@ -127,7 +162,8 @@ typedef struct NVMECtrlCap {
     uint16_t ams:2;
     uint16_t res0:5;
     uint16_t to:8;
-    uint16_t res1:5;
+    uint16_t dstrd:4;
+    uint16_t res1:1;
     uint16_t css:4;
     uint16_t res2:7;
     uint16_t mpsmin:4;
@@ -178,10 +214,39 @@ typedef struct NVMEIOSQueue {
     uint16_t phys_contig;
     uint16_t size;
     uint64_t dma_addr; /* DMA Address */
-    /*FIXME: Add support for PRP List. */
+    /* Guest address holding a copy of the tail doorbell, 0 if the tail
+     * is only written through MMIO. Set by Doorbell Buffer Config, along
+     * with the EventIdx the controller publishes for the tail. */
+    uint64_t tail_addr;
+    uint64_t ei_addr;
+    /* Page list of a non contiguous queue, read once at creation */
+    uint64_t prp_list[NVME_QUEUE_PRP_MAX];
     uint32_t abort_cmd_id[NVME_ABORT_COMMAND_LIMIT];
+    uint8_t fused; /* Outcome of the first command of a fused operation */
+    /* LBA range of that first command, the second must match it */
+    uint32_t fused_nsid;
+    uint16_t fused_nlb;
+    uint64_t fused_slba;
+    /* Contexts of the commands fetched from the SQ, see
+     * nvme_init_sq_requests(). Each is either free or in flight. */
+    struct NVMERequest *reqs;
+    uint16_t nr_reqs;
+    QTAILQ_HEAD(, NVMERequest) free_reqs;
+    /* In flight, hashed on the command identifier for Abort */
+    QTAILQ_HEAD(NVMERequestBucket, NVMERequest) *busy_reqs;
+    uint16_t busy_mask;
 } NVMEIOSQueue;
 
+/* NVMEIOSQueue.fused */
+enum {
+    NVME_FUSED_NONE,
+    NVME_FUSED_PASSED,
+    NVME_FUSED_FAILED,
+    /* The Compare is in the block layer, the SQ is held until it
+     * completes */
+    NVME_FUSED_PENDING,
+};
+
 struct NVMECQE;
 typedef struct NVMEIOCQueue {
     uint16_t id;
@@ -194,9 +259,15 @@ typedef struct NVMEIOCQueue {
     uint16_t size;
     uint64_t dma_addr; /* DMA Address */
     uint8_t phase_tag; /* check spec for Phase Tag details*/
+    uint16_t inflight; /* CQ entries reserved by commands in flight */
+    /* Shadow of the head doorbell and its EventIdx, see tail_addr */
+    uint64_t head_addr;
+    uint64_t ei_addr;
+    /* Page list of a non contiguous queue, read once at creation */
+    uint64_t prp_list[NVME_QUEUE_PRP_MAX];
 } NVMEIOCQueue;
 
-/* FIXME*/
+/* I/O thread states */
 enum {
     TH_NOT_STARTED = 0,
     TH_STARTED,
@@ -204,6 +275,49 @@ enum {
     TH_EXIT,
 };
 
+/* Create I/O SQ QPRIO values, the arbitration classes of the I/O SQs */
+enum {
+    NVME_QPRIO_URGENT = 0,
+    NVME_QPRIO_HIGH   = 1,
+    NVME_QPRIO_MEDIUM = 2,
+    NVME_QPRIO_LOW    = 3,
+    NVME_QPRIO_NR,
+};
+
+/* CC.AMS values */
+#define NVME_CC_AMS_RR 0
+#define NVME_CC_AMS_WRR 1
+
+/* Arbitration feature: burst of 2^AB commands, 7 means no limit */
+#define NVME_ARB_AB_NOLIMIT 7
+#define NVME_ARB_AB_DEFAULT 3
+
+/* Arbitration state of a SQ scheduler, the main loop or an I/O thread */
+typedef struct NVMEArbiter {
+    uint16_t last[NVME_QPRIO_NR]; /* SQ served last in each class */
+    uint16_t credit[NVME_QPRIO_NR]; /* WRR credits left in this round */
+} NVMEArbiter;
+
+/* io_uring instance of a context serving I/O queues, see nvme_uring.c */
+typedef struct NVMEUring NVMEUring;
+
+/* Host thread serving the I/O queue pairs whose CQ maps to it */
+struct NVMEState;
+typedef struct NVMEIOThread {
+    QemuThread thread;
+    QemuMutex lock;
+    QemuCond cond;
+    struct NVMEState *n;
+    uint16_t index;
+    uint8_t state;
+    uint8_t kicked; /* doorbell rung since the last drain */
+    uint8_t paused; /* main loop needs the queues for itself */
+    uint8_t busy; /* draining queues, guest memory in use */
+    uint8_t waiting; /* sleeping in its ring, kicked through it */
+    NVMEArbiter arb;
+    NVMEUring *uring;
+} NVMEIOThread;
+
 struct abort_command {
     uint16_t sq_id;
     uint16_t cmd_id;
@@ -235,7 +349,6 @@ struct nvme_features {
     uint32_t volatile_write_cache;
     uint32_t number_of_queues;
     uint32_t interrupt_coalescing;
-    uint32_t interrupt_vector_configuration;
     uint32_t write_atomicity;
     uint32_t asynchronous_event_configuration;
     uint32_t software_progress_marker;
@@ -266,11 +379,145 @@ typedef struct NVMEAdmCmdFeaturs {
 } NVMEAdmCmdFeatures;
 
 
+/* ioeventfd bound to a SQ tail doorbell */
+typedef struct NVMESQNotifier {
+    EventNotifier notifier;
+    struct NVMEState *n;
+    uint16_t sq_id;
+    uint8_t assigned;
+} NVMESQNotifier;
+
+#define NVME_FLAG_IOEVENTFD_BIT 0
+#define NVME_FLAG_IOEVENTFD (1 << NVME_FLAG_IOEVENTFD_BIT)
+#define NVME_FLAG_IOTHREAD_AFFINITY_BIT 1
+#define NVME_FLAG_IOTHREAD_AFFINITY (1 << NVME_FLAG_IOTHREAD_AFFINITY_BIT)
+#define NVME_FLAG_THIN_BIT 2
+#define NVME_FLAG_THIN (1 << NVME_FLAG_THIN_BIT)
+#define NVME_FLAG_URING_BIT 3
+#define NVME_FLAG_URING (1 << NVME_FLAG_URING_BIT)
+#define NVME_FLAG_URING_SQPOLL_BIT 4
+#define NVME_FLAG_URING_SQPOLL (1 << NVME_FLAG_URING_SQPOLL_BIT)
+
+/* Interrupt Coalescing feature: THR is 0's based, TIME in 100us units */
+#define NVME_IC_THR(ic) (((ic) & 0xff) + 1)
+#define NVME_IC_TIME_NS(ic) ((int64_t)(((ic) >> 8) & 0xff) * 100000)
+/* Interrupt Vector Configuration feature */
+#define NVME_IVC_IV(ivc) ((ivc) & 0xffff)
+#define NVME_IVC_CD (1 << 16)
+
+/* MSI-X vector state for interrupt coalescing */
+typedef struct NVMEVector {
+    uint32_t cqes; /* completions posted since the last interrupt */
+    uint8_t coalescing_disabled;
+} NVMEVector;
+
+/* How a file backed namespace reaches its file */
+enum {
+    NVME_IO_MMAP     = 0, /* shared mapping, data copied by the CPU */
+    NVME_IO_BUFFERED = 1, /* pread/pwrite through the host page cache */
+    NVME_IO_DIRECT   = 2, /* O_DIRECT, aligned buffers */
+};
+
+/* A namespace, backed by a block device or else by its own file */
+typedef struct NVMENamespace {
+    BlockDriverState *bs;
+    int fd;
+    uint8_t io_mode;
+    uint32_t dio_align; /* O_DIRECT alignment the host file requires */
+    uint8_t *mapping_addr; /* mmap mode only */
+    size_t mapping_size;
+    /* Thin provisioned backing file: bitmap of the 4KB blocks written */
+    unsigned long *alloc_map;
+    uint64_t nr_alloc;
+    uint64_t nsze; /* in LBAs */
+    uint8_t lba_shift;
+    uint8_t flbas; /* index of the LBA format in use */
+    uint64_t dirty; /* bytes written since the last destage */
+} NVMENamespace;
+
+struct NVMERequest;
+struct NVMECQBatch;
+
+/* Latency histogram of an opcode. Bucket 0 counts the commands completing
+ * within 1us, bucket b those within [2^(b-1), 2^b) us, the last bucket
+ * everything slower. */
+#define NVME_STATS_LAT_BUCKETS 24
+/* Opcodes below this get a histogram, admin and I/O ones apart */
+#define NVME_STATS_OPCODES 16
+
+typedef struct NVMELatHist {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t bucket[NVME_STATS_LAT_BUCKETS];
+} NVMELatHist;
+
+/* Counters of a queue pair ID, kept across queue deletion. Only the context
+ * serving the queues updates them. */
+typedef struct NVMEQueueStats {
+    /* SQ side */
+    uint64_t commands;      /* SQEs fetched */
+    uint64_t errors;        /* completed with a non zero status */
+    uint64_t read_bytes;    /* Read and Compare data */
+    uint64_t write_bytes;
+    uint32_t max_depth;     /* most SQEs seen pending in the SQ */
+    /* CQ side */
+    uint64_t completions;   /* CQEs posted */
+    uint64_t cq_full;       /* SQ processing stopped for lack of CQ room */
+    uint32_t max_inflight;  /* most commands holding a CQ entry */
+    NVMELatHist lat[NVME_STATS_OPCODES];
+    /* SMART / Health information, I/O SQs only */
+    uint64_t read_cmds;     /* Read and Compare completed */
+    uint64_t write_cmds;
+    uint64_t media_errors;
+    uint32_t outstanding;   /* commands fetched and not completed yet */
+    int64_t busy_start;     /* when outstanding last went from 0 to 1 */
+    uint64_t busy_ns;       /* time with commands outstanding */
+} NVMEQueueStats;
+
+/* Entries of the Error Information log page, most recent first */
+#define NVME_ERROR_LOG_ENTRIES 16
+/* Composite temperature reported by the SMART / Health log, in Kelvin */
+#define NVME_TEMPERATURE 0x143
+/* Identify Controller FR, also the revision of firmware slot 1 */
+#define NVME_FIRMWARE_REVISION "012345"
+
+/* Volatile Write Cache feature, CDW11 */
+#define NVME_VWC_WCE 1
+
+/* The destage thread starts the write back of the file backed namespaces
+ * this often, or as soon as this much got written */
+#define NVME_DESTAGE_INTERVAL_MS 100
+#define NVME_DESTAGE_BYTES (64 << 20)
+
+/* Write cache of the file backed namespaces: the page cache of the
+ * backing files, written back by a destage thread */
+typedef struct NVMECache {
+    QemuThread thread;
+    QemuMutex lock;
+    QemuCond cond;
+    uint8_t state;
+    uint8_t kicked; /* flush queued or dirty threshold reached */
+    QTAILQ_HEAD(NVMERequestList, NVMERequest) flushes; /* waiting for a sync */
+    struct NVMERequestList syncing; /* covered by the sync in progress */
+    struct NVMERequestList done; /* synced, posted from the main loop */
+    EventNotifier notifier;
+} NVMECache;
+
 typedef struct NVMEState {
     PCIDevice dev;
     int mmio_index;
+    int db_mmio_index; /* the doorbells, BAR 0 from NVME_SQ0TDBL on */
+    uint32_t dstrd; /* CAP.DSTRD */
     void *bar0;
     int bar0_size;
+    /* Controller Memory Buffer, guest RAM behind BAR NVME_CMB_BIR.
+     * cmb_addr is 0 while the BAR is not mapped. */
+    uint32_t cmb_size_mb;
+    uint64_t cmb_size;
+    ram_addr_t cmb_offset;
+    uint8_t *cmb_buf;
+    uint64_t cmb_addr;
     uint8_t nvectors;
 
     /* Space for NVME Ctrl Space except doorbells */
@@ -287,9 +534,16 @@ typedef struct NVMEState {
     NVMEIOCQueue cq[NVME_MAX_QID];
     NVMEIOSQueue sq[NVME_MAX_QID];
 
-    int    fd;
-    uint8_t *mapping_addr;
-    size_t mapping_size;
+    /* Namespace IDs are 1 based, namespace nsid is ns[nsid - 1] */
+    NVMENamespace ns[NVME_MAX_NAMESPACES];
+    uint32_t nr_namespaces;
+    /* Per namespace properties: ':' separated, one item per namespace, the
+     * last one standing for the namespaces left */
+    char *ns_size; /* size of the file backed namespaces, in MB */
+    char *lba_size; /* 512 or 4096 */
+    char *io_mode; /* mode of the file backed namespaces */
+    QTAILQ_HEAD(, NVMERequest) requests;
+    NVMECache cache;
 
     /* Used to store the AQA,ASQ,ACQ between resets */
     struct AQState aqstate;
@@ -310,8 +564,52 @@ typedef struct NVMEState {
     NVMECtrlStatus *cstatus; /* Ctrl status */
     NVMEAQA *admqattrs; /* Admin queues attributes. */
 
+    /* SQ processing is kicked from the doorbell through a bottom half,
+     * or through a vm_clock timer when batch_ns is non zero */
+    QEMUBH *sq_processing_bh;
     QEMUTimer *sq_processing_timer;
     int64_t sq_processing_timer_target;
+    uint32_t batch_ns;
+    /* SQs with entries left to fetch, bit n for SQ ID n. Updated with
+     * atomic operations since the I/O threads clear bits */
+    uint64_t sq_ready;
+    NVMEArbiter arb;
+    /* CQEs posted during a processing pass, one batch per CQ */
+    struct NVMECQBatch *cq_batch;
+
+    uint32_t flags;
+    NVMESQNotifier sq_notifier[NVME_MAX_QID];
+    /* Shadow doorbell and EventIdx buffers of Doorbell Buffer Config, 0
+     * until the command is issued */
+    uint64_t dbbuf_dbs;
+    uint64_t dbbuf_eis;
+
+    /* I/O queue pairs served by dedicated host threads. Interrupts they
+     * raise are delivered from the main loop */
+    uint32_t nr_iothreads;
+    NVMEIOThread *iothreads;
+    QemuMutex irq_lock;
+    uint32_t pending_irqs; /* bitmap of MSI-X vectors */
+    uint32_t pending_cqes[NVME_MSIX_NVECTORS];
+    EventNotifier irq_notifier;
+
+    /* io_uring of the main loop, when it serves the I/O queues */
+    NVMEUring *uring;
+
+    /* Statistics for "info nvme", indexed by queue ID */
+    NVMEQueueStats *stats;
+    QTAILQ_ENTRY(NVMEState) stats_entry;
+    int64_t start_time;
+    /* Error Information log, a ring of the last errors */
+    QemuMutex error_lock;
+    uint64_t error_count;
+    struct NVMEErrorLogEntry *error_log;
+
+    /* Interrupts held back by coalescing are raised when the aggregation
+     * threshold is reached or when irq_timer fires */
+    NVMEVector vectors[NVME_MSIX_NVECTORS];
+    QEMUTimer *irq_timer;
+    int64_t irq_timer_target;
     /* Used for PIN based and MSI interrupts */
     uint32_t intr_vect;
 } NVMEState;
@@ -332,7 +630,7 @@ static const struct NVMEReg nvme_reg[] = {
 {
     .offset = NVME_CAP,
     .len = 0x04,
-    .reset = 0x0f0103FF,
+    .reset = 0x0f0303FF,
     .rw_mask = 0x00,
     .rwc_mask = 0x00,
     .rws_mask = 0x00,
@@ -341,7 +639,7 @@ static const struct NVMEReg nvme_reg[] = {
 {
     .offset = NVME_CAP + 4,
     .len = 0x04,
-    .reset = 0x00000020,
+    .reset = 0x00400020,
     .rw_mask = 0x00,
     .rwc_mask = 0x00,
     .rws_mask = 0x00,
@@ -457,6 +755,7 @@ enum {
     NVME_ADM_CMD_ASYNC_EV_REQ  = 0x0c,
     NVME_ADM_CMD_ACTIVATE_FW   = 0x10,
     NVME_ADM_CMD_DOWNLOAD_FW   = 0x11,
+    NVME_ADM_CMD_DBBUF_CONFIG  = 0x7c,
     NVME_ADM_CMD_FORMAT_NVM    = 0x80,
     NVME_ADM_CMD_SECURITY_SEND = 0x81,
     NVME_ADM_CMD_SECURITY_RECV = 0x82,
@@ -468,9 +767,43 @@ enum {
     NVME_CMD_FLUSH = 0x00,
     NVME_CMD_WRITE = 0x01,
     NVME_CMD_READ  = 0x02,
+    NVME_CMD_COMPARE = 0x05,
+    NVME_CMD_WRITE_ZEROES = 0x08,
+    NVME_CMD_DSM   = 0x09,
     NVME_CMD_LAST,
 };
 
+/* Optional admin commands supported, OACS in Identify Controller */
+#define NVME_OACS_DBBUF_CONFIG (1 << 8)
+
+/* Optional NVM commands supported, ONCS in Identify Controller */
+#define NVME_ONCS_COMPARE (1 << 0)
+#define NVME_ONCS_DSM (1 << 2)
+#define NVME_ONCS_WRITE_ZEROES (1 << 3)
+
+/* Fused operations supported, FUSES in Identify Controller */
+#define NVME_FUSES_COMPARE_WRITE (1 << 0)
+
+/* Fused Operation, CDW0[8-9] */
+enum {
+    NVME_FUSE_NONE   = 0,
+    NVME_FUSE_FIRST  = 1,
+    NVME_FUSE_SECOND = 2,
+};
+#define NVME_FUSE(fuse) ((fuse) & 0x3)
+
+/* PRP or SGL for Data Transfer, CDW0[14-15] */
+enum {
+    NVME_PSDT_PRP      = 0,
+    NVME_PSDT_SGL      = 1, /* MPTR is the metadata address */
+    NVME_PSDT_SGL_MPTR = 2, /* MPTR points to a metadata SGL segment */
+};
+#define NVME_PSDT(fuse) (((fuse) >> 6) & 0x3)
+
+/* SGL support, SGLS in Identify Controller */
+#define NVME_SGLS_SUPPORTED (1 << 0)
+#define NVME_SGLS_BIT_BUCKET (1 << 16)
+
 typedef struct NVMEAdmCmdDeleteSQ {
     uint32_t opcode:8;
     uint32_t fuse:2;
@@ -532,6 +865,53 @@ typedef struct NVMEAdmCmdGetLogPage {
     uint32_t cdw15;
 } NVMEAdmCmdGetLogPage;
 
+/* Log Page Identifiers */
+enum {
+    NVME_LOG_ERROR_INFO = 0x01,
+    NVME_LOG_SMART_INFO = 0x02,
+    NVME_LOG_FW_SLOT_INFO = 0x03,
+};
+
+typedef struct NVMEErrorLogEntry {
+    uint64_t error_count;
+    uint16_t sqid;
+    uint16_t cid;
+    uint16_t status; /* [0] Phase Tag, [15-1] Status Field */
+    uint16_t param_error_location;
+    uint64_t lba;
+    uint32_t nsid;
+    uint8_t vs;
+    uint8_t res[35];
+} NVMEErrorLogEntry;
+
+/* Counters of the SMART / Health log are 128 bit, the high half stays 0 */
+typedef struct NVMESmartLog {
+    uint8_t critical_warning;
+    uint8_t temperature[2];
+    uint8_t available_spare;
+    uint8_t available_spare_threshold;
+    uint8_t percentage_used;
+    uint8_t res1[26];
+    uint64_t data_units_read[2]; /* thousands of 512 bytes units */
+    uint64_t data_units_written[2];
+    uint64_t host_read_commands[2];
+    uint64_t host_write_commands[2];
+    uint64_t controller_busy_time[2]; /* minutes */
+    uint64_t power_cycles[2];
+    uint64_t power_on_hours[2];
+    uint64_t unsafe_shutdowns[2];
+    uint64_t media_errors[2];
+    uint64_t number_of_error_info_log_entries[2];
+    uint8_t res2[320];
+} NVMESmartLog;
+
+typedef struct NVMEFwSlotLog {
+    uint8_t afi; /* [2-0] Active Firmware Slot */
+    uint8_t res1[7];
+    uint8_t frs[7][8]; /* Firmware Revision of slots 1 to 7 */
+    uint8_t res2[448];
+} NVMEFwSlotLog;
+
 typedef struct NVMEAdmCmdDeleteCQ {
     uint32_t opcode:8;
     uint32_t fuse:2;
@@ -642,11 +1022,78 @@ struct NVME_rw {
     uint64_t prp2;
     uint64_t slba;
     uint32_t nlb:16;
+    uint32_t res2:10;
+    uint32_t prinfo:4;
+    uint32_t fua:1; /* Force Unit Access */
+    uint32_t lr:1;
+    uint32_t cdw13;
+    uint32_t cdw14;
+    uint32_t cdw15;
+};
+
+/* SGL descriptor. With PSDT set to a SGL, the descriptor of a command
+ * takes the place of PRP1 and PRP2. */
+typedef struct NVMESglDesc {
+    uint64_t addr;
+    uint32_t len;
+    uint8_t rsvd[3];
+    uint8_t type; /* [4-7] Descriptor Type, [0-3] Sub Type */
+} NVMESglDesc;
+
+/* SGL Descriptor Types */
+enum {
+    NVME_SGL_DATA_BLOCK   = 0,
+    NVME_SGL_BIT_BUCKET   = 1,
+    NVME_SGL_SEGMENT      = 2,
+    NVME_SGL_LAST_SEGMENT = 3,
+};
+#define NVME_SGL_TYPE(type) ((type) >> 4)
+#define NVME_SGL_SUBTYPE(type) ((type) & 0xf)
+
+/* Dataset Management */
+struct NVME_dsm {
+    uint8_t  opcode;
+    uint8_t  fuse;
+    uint16_t cid;
+    uint32_t nsid;
+    uint64_t res1;
+    uint64_t mptr;
+    uint64_t prp1;
+    uint64_t prp2;
+    uint32_t nr:8; /* CDW10[0-7] Number of Ranges, 0's based */
+    uint32_t res2:24;
+    uint32_t attributes; /* CDW11 */
+    uint32_t cdw12;
     uint32_t cdw13;
     uint32_t cdw14;
     uint32_t cdw15;
 };
 
+#define NVME_DSM_IDR (1 << 0) /* Integral Dataset for Read */
+#define NVME_DSM_IDW (1 << 1) /* Integral Dataset for Write */
+#define NVME_DSM_AD  (1 << 2) /* Deallocate */
+#define NVME_DSM_MAX_RANGES 256
+
+/* Dataset Management range, 16 bytes each in the data buffer */
+typedef struct NVMEDsmRange {
+    uint32_t cattr; /* Context Attributes */
+    uint32_t nlb;
+    uint64_t slba;
+} NVMEDsmRange;
+
+/* Context Attributes of a range */
+#define NVME_DSM_AF(cattr) ((cattr) & 0xf) /* Access Frequency */
+#define NVME_DSM_AL(cattr) (((cattr) >> 4) & 0x3) /* Access Latency */
+#define NVME_DSM_SR (1 << 6) /* Sequential Read Range */
+#define NVME_DSM_SW (1 << 7) /* Sequential Write Range */
+enum {
+    NVME_DSM_AF_INFREQUENT = 2, /* infrequent writes and reads */
+    NVME_DSM_AF_FREQ_READ  = 3, /* infrequent writes, frequent reads */
+    NVME_DSM_AF_ONE_TIME   = 6, /* one time read */
+    NVME_DSM_AF_SPEC_READ  = 7, /* speculative read */
+};
+#define NVME_DSM_AL_LOW 3
+
 typedef struct NVMECmd {
     uint8_t  opcode;
     uint8_t  fuse;
@@ -746,6 +1193,11 @@ enum {
     NVME_SC_FUSED_FAIL        = 0x9,
     NVME_SC_FUSED_MISSING     = 0xa,
     NVME_SC_INVALID_NAMESPACE = 0xb,
+    NVME_SC_SGL_SEG_DESC_INVALID  = 0xd,
+    NVME_SC_SGL_NR_DESC_INVALID   = 0xe,
+    NVME_SC_SGL_DATA_LEN_INVALID  = 0xf,
+    NVME_SC_SGL_DESC_TYPE_INVALID = 0x11,
+    NVME_SC_INVALID_CMB_USE   = 0x12,
     NVME_SC_LBA_RANGE         = 0x80,
     NVME_SC_CAP_EXCEEDED      = 0x81,
     NVME_SC_NS_NOT_READY      = 0x82,
@@ -768,6 +1220,13 @@ enum {
     NVME_CMD_NVM_ERR_CONFLICT       = 0x80,
 };
 
+/* Figure 19: Status Code - Media Errors Values */
+enum {
+    NVME_SC_WRITE_FAULT    = 0x80,
+    NVME_SC_READ_ERROR     = 0x81,
+    NVME_SC_COMPARE_FAILED = 0x85,
+};
+
 
 /* 4.5 Completion Queue Entry */
 typedef struct NVMECQE {
@@ -779,6 +1238,16 @@ typedef struct NVMECQE {
     uint16_t status; /* DW3[16] Phase Tag & DW3[17-31] Status Field */
 } NVMECQE;
 
+/* CQEs held back until the end of a processing pass, so that they reach the
+ * CQ in a few writes and raise a single interrupt */
+typedef struct NVMECQBatch {
+    uint8_t open;
+    uint16_t len; /* CQEs in cqe[], for adjacent CQ slots from addr */
+    uint32_t nr_cqes; /* CQEs posted since the batch was opened */
+    target_phys_addr_t addr;
+    NVMECQE cqe[NVME_CQE_BATCH];
+} NVMECQBatch;
+
 
 /* CNS bit in Identify command */
 enum {
@@ -820,7 +1289,9 @@ typedef struct NVMEIdentifyController {
     uint8_t vwc;
     uint16_t awun;
     uint16_t awupf;
-    uint8_t rsvd703[174];
+    uint8_t rsvd535[6];
+    uint32_t sgls;
+    uint8_t rsvd703[164];
     uint8_t rsvd2047[1344];
     uint8_t psd0[32];
     uint8_t psdx[992];
@@ -877,12 +1348,42 @@ typedef struct NVMEIdentifyNamespace {
     uint8_t dpc;    /* [28] End2end Data Protection Capabilities */
     uint8_t dps;    /* [29] End2end Data Protection Type Settings */
     uint8_t res0[98];    /* [30-127] Reserved */
-    struct NVMELBAFormat lbaf0;    /* [128-131] LBA Format 0 Support. */
-    uint8_t lbafx[60];    /* [132-191] LBA Format 1-15 Support */
+    struct NVMELBAFormat lbaf[16];    /* [128-191] LBA Format 0-15 Support */
     uint8_t res1[192];    /* [192-383] Reserved */
     uint8_t vs[3712];    /* [384-4095] Vendor Specific */
 } NVMEIdentifyNamespace;
 
+/* Part of a Read or Write in flight in the block layer on its own */
+typedef struct NVMEChunk {
+    struct NVMERequest *req;
+    BlockDriverAIOCB *aiocb; /* NULL once completed */
+    QEMUIOVector qiov;  /* Slice of the request qiov */
+    uint64_t off;       /* Offset in the transfer */
+} NVMEChunk;
+
+/* I/O command in flight in the block layer */
+typedef struct NVMERequest {
+    NVMEState *n;
+    NVMENamespace *ns;
+    BlockDriverAIOCB *aiocb;
+    NVMEChunk chunks[NVME_IO_CHUNKS];
+    uint8_t nr_chunks;  /* 0 when the transfer goes as a single request */
+    uint8_t pending;    /* chunks in flight */
+    int ret;            /* first chunk error */
+    uint16_t sq_id;
+    NVMECmd cmd;
+    NVMECQE cqe;
+    QEMUSGList qsg;     /* Guest pages described by the PRPs or SGL */
+    QEMUIOVector qiov;  /* Host view of qsg, or of buf when bouncing */
+    uint8_t *buf;       /* Bounce buffer, for guest pages that aren't RAM */
+    uint8_t to_guest;
+    uint8_t synced;     /* write through: flush issued after the write */
+    NVMEUring *uring;   /* Ring the request is queued on, if any */
+    int64_t start;      /* get_clock() on submission */
+    QTAILQ_ENTRY(NVMERequest) entry;
+    QTAILQ_ENTRY(NVMERequest) sq_entry; /* Free list or busy bucket */
+} NVMERequest;
+
 /* Config File Read Strucutre */
 typedef struct FILERead {
     uint32_t offset;
@@ -897,22 +1398,136 @@ typedef struct FILERead {
 
 enum {PCI_SPACE = 0, NVME_SPACE = 1};
 
-/* Initialize IO thread */
+/* I/O threads */
 int nvme_init_io_thread(NVMEState *n);
+void nvme_exit_io_thread(NVMEState *n);
+void nvme_io_thread_kick(NVMEState *n, uint16_t cq_id);
+void nvme_io_thread_pause(NVMEState *n);
+void nvme_io_thread_resume(NVMEState *n);
+void nvme_io_thread_notify(NVMEState *n, uint32_t vector, uint32_t nr_cqes);
+int nvme_in_io_thread(void);
+
+/* io_uring engine */
+NVMEUring *nvme_uring_new(NVMEState *n, int thread);
+void nvme_uring_free(NVMEUring *r);
+int nvme_uring_init(NVMEState *n);
+void nvme_uring_exit(NVMEState *n);
+void nvme_uring_update_files(NVMEState *n);
+int nvme_uring_queue_rw(NVMEUring *r, int write, uint32_t ns_index,
+    struct iovec *iov, int niov, uint64_t off, int dsync, void *opaque);
+void nvme_uring_submit(NVMEUring *r);
+int nvme_uring_ready(NVMEUring *r);
+uint32_t nvme_uring_inflight(NVMEUring *r);
+int nvme_uring_next(NVMEUring *r, void **opaque, int *res);
+void nvme_uring_wait(NVMEUring *r);
+void nvme_uring_kick(NVMEUring *r);
+NVMEUring *nvme_sq_uring(NVMEState *n, uint16_t sq_id);
+void nvme_uring_complete(NVMEState *n, NVMEUring *r);
+void nvme_uring_cancel(NVMEState *n, NVMEUring *r, uint16_t sq_id);
+
+/* Statistics */
+void nvme_stats_init(NVMEState *n);
+void nvme_stats_exit(NVMEState *n);
+void nvme_stats_smart(NVMEState *n, NVMESmartLog *smart);
+void nvme_stats_cancel(NVMEState *n, uint16_t sq_id);
+void nvme_stats_done(NVMEState *n, uint16_t sq_id, NVMECmd *sqe,
+    NVMECQE *cqe, int64_t start);
+
+/* Controller Memory Buffer */
+int nvme_cmb_init(NVMEState *n);
+void nvme_cmb_exit(NVMEState *n);
+void nvme_cmb_set_registry(NVMEState *n);
+void nvme_addr_read(NVMEState *n, target_phys_addr_t addr, uint8_t *buf,
+    int len);
+
+/* Whether a guest range lies in the Controller Memory Buffer */
+static inline int nvme_addr_is_cmb(NVMEState *n, target_phys_addr_t addr,
+    uint64_t len)
+{
+    return n->cmb_addr && addr >= n->cmb_addr &&
+        addr - n->cmb_addr < n->cmb_size &&
+        len <= n->cmb_size - (addr - n->cmb_addr);
+}
+
+/* Write cache */
+int nvme_cache_start(NVMEState *n);
+void nvme_cache_stop(NVMEState *n);
+void nvme_cache_write(NVMEState *n, NVMENamespace *ns, uint64_t off,
+    uint64_t len, int fua);
+uint8_t nvme_cache_flush(NVMEState *n, NVMENamespace *ns, NVMECmd *sqe,
+    NVMECQE *cqe);
+void nvme_cache_cancel(NVMEState *n, uint16_t sq_id);
+uint8_t nvme_cache_abort(NVMEState *n, NVMERequest *req);
+
+/* Whether writes may complete before reaching stable storage */
+static inline int nvme_vwc_enabled(NVMEState *n)
+{
+    return n->feature.volatile_write_cache & NVME_VWC_WCE;
+}
+
+/* Interrupt coalescing, main loop only */
+void nvme_irq_notify(NVMEState *n, uint32_t vector, uint32_t nr_cqes);
+void nvme_irq_timer_cb(void *opaque);
+void nvme_irq_reset(NVMEState *n);
+
+/* Memory page size set by CC.MPS */
+static inline uint32_t nvme_page_size(NVMEState *n)
+{
+    uint32_t cc;
+
+    memcpy(&cc, &n->cntrl_reg[NVME_CC], DWORD);
+    return 1 << (12 + ((cc >> 7) & 0xf));
+}
+
+/* Namespace of a NSID, NULL for an invalid NSID */
+static inline NVMENamespace *nvme_ns(NVMEState *n, uint32_t nsid)
+{
+    if (nsid == 0 || nsid > n->nr_namespaces) {
+        return NULL;
+    }
+    return &n->ns[nsid - 1];
+}
+
+/* Whether a SQ is served by an I/O thread rather than the main loop */
+static inline int nvme_sq_on_io_thread(NVMEState *n, uint16_t sq_id)
+{
+    return n->nr_iothreads && sq_id != ASQ_ID;
+}
 
 /* Admin command processing */
 uint8_t nvme_admin_command(NVMEState *n, NVMECmd *sqe, NVMECQE *cqe);
 
 /* IO command processing */
 uint8_t nvme_io_command(NVMEState *n, NVMECmd *sqe, NVMECQE *cqe);
+void nvme_cancel_requests(NVMEState *n, uint16_t sq_id);
+void nvme_init_sq_requests(NVMEState *n, uint16_t sq_id, uint16_t nr);
+void nvme_free_sq_requests(NVMEState *n, uint16_t sq_id);
+NVMERequest *nvme_get_request(NVMEState *n, NVMENamespace *ns, NVMECmd *sqe,
+    NVMECQE *cqe);
+void nvme_free_request(NVMERequest *req);
+NVMERequest *nvme_find_request(NVMEState *n, uint16_t sq_id, uint16_t cid);
+uint8_t nvme_abort_request(NVMEState *n, NVMERequest *req);
 
 /* Storage file */
+int nvme_init_namespaces(NVMEState *n);
+uint64_t nvme_ns_nuse(NVMENamespace *ns);
 int nvme_open_storage_file(NVMEState *n);
 int nvme_close_storage_file(NVMEState *n);
 
 void nvme_dma_mem_read(target_phys_addr_t addr, uint8_t *buf, int len);
 void nvme_dma_mem_write(target_phys_addr_t addr, uint8_t *buf, int len);
-void process_sq(NVMEState *n, uint16_t sq_id);
+int nvme_addr_is_ram(target_phys_addr_t addr, target_phys_addr_t len);
+uint8_t nvme_dma_write_prp(NVMEState *n, uint64_t prp1, uint64_t prp2,
+    uint8_t *buf, uint32_t len);
+void nvme_sq_ready(NVMEState *n, uint16_t sq_id);
+void nvme_shadow_read(uint64_t addr, uint16_t size, uint16_t *val);
+uint8_t nvme_arbitrate(NVMEState *n, NVMEArbiter *arb, uint64_t mask,
+    uint32_t budget);
+void nvme_post_cqe(NVMEState *n, uint16_t sq_id, NVMECQE *cqe);
+void nvme_cq_batch_flush(NVMEState *n, uint64_t cq_mask);
+
+/* Arm or disarm the ioeventfd of a SQ tail doorbell to match the SQ state */
+void nvme_update_ioeventfd(NVMEState *n, uint16_t sq_id);
 
 /* Config file read functions */
 int read_config_file(FILE *, NVMEState *, uint8_t);
@@ -20,6 +20,8 @@
 
 #include "nvme.h"
 #include "nvme_debug.h"
+#include "host-utils.h"
+#include "trace.h"
 
 static uint32_t adm_cmd_del_sq(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe);
 static uint32_t adm_cmd_alloc_sq(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe);
@@ -31,6 +33,7 @@ static uint32_t adm_cmd_abort(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe);
 static uint32_t adm_cmd_set_features(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe);
 static uint32_t adm_cmd_get_features(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe);
 static uint32_t adm_cmd_async_ev_req(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe);
+static uint32_t adm_cmd_dbbuf_config(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe);
 
 typedef uint32_t adm_command_func(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe);
 
@@ -45,6 +48,7 @@ static adm_command_func * const adm_cmds_funcs[] = {
     [NVME_ADM_CMD_SET_FEATURES] = adm_cmd_set_features,
     [NVME_ADM_CMD_GET_FEATURES] = adm_cmd_get_features,
     [NVME_ADM_CMD_ASYNC_EV_REQ] = adm_cmd_async_ev_req,
+    [NVME_ADM_CMD_DBBUF_CONFIG] = adm_cmd_dbbuf_config,
     [NVME_ADM_CMD_LAST] = NULL,
 };
 
@@ -71,7 +75,6 @@ static uint32_t adm_check_cqid(NVMEState *n, uint16_t cqid)
     if (!n) {
         return FAIL;
     }
-    LOG_NORM("kw q: check if exists cqid %d\n", cqid);
     /* If queue is allocated dma_addr!=NULL and has the same ID */
     for (i = 0; i < NVME_MAX_QID; i++) {
         if (n->cq[i].dma_addr && n->cq[i].id == cqid) {
@@ -155,6 +158,60 @@ static uint16_t adm_get_free_sq(NVMEState *n)
 }
 
 /* FIXME: For now allow only empty queue. */
+/* Read the page list of a non contiguous queue, once for the queue life.
+ * With I/O threads every page must be guest RAM. */
+static uint8_t adm_load_queue_prps(NVMEState *n, uint64_t prp1,
+    uint16_t qsize, uint32_t esize, uint64_t *prp_list)
+{
+    uint32_t pg_size = nvme_page_size(n);
+    uint32_t nr_pages = ((qsize + 1) * esize + pg_size - 1) / pg_size;
+    uint32_t i;
+
+    nvme_addr_read(n, prp1, (uint8_t *)prp_list,
+        nr_pages * sizeof(*prp_list));
+    for (i = 0; n->nr_iothreads && i < nr_pages; i++) {
+        if (!nvme_addr_is_ram(prp_list[i], pg_size)) {
+            return FAIL;
+        }
+    }
+    return 0;
+}
+
+static void adm_write_dword(uint64_t addr, uint32_t val)
+{
+    val = cpu_to_le32(val);
+    nvme_dma_mem_write(addr, (uint8_t *)&val, sizeof(val));
+}
+
+/* Point an I/O SQ at its shadow doorbell once Doorbell Buffer Config was
+ * issued. The shadow and the EventIdx start at the current tail. */
+static void adm_dbbuf_sq(NVMEState *n, uint16_t i)
+{
+    NVMEIOSQueue *sq = &n->sq[i];
+
+    if (!n->dbbuf_dbs) {
+        return;
+    }
+    sq->tail_addr = n->dbbuf_dbs + NVME_DBBUF_SQ(sq->id, n->dstrd);
+    sq->ei_addr = n->dbbuf_eis + NVME_DBBUF_SQ(sq->id, n->dstrd);
+    adm_write_dword(sq->tail_addr, sq->tail);
+    adm_write_dword(sq->ei_addr, sq->tail);
+}
+
+/* Same for the head doorbell of an I/O CQ */
+static void adm_dbbuf_cq(NVMEState *n, uint16_t i)
+{
+    NVMEIOCQueue *cq = &n->cq[i];
+
+    if (!n->dbbuf_dbs) {
+        return;
+    }
+    cq->head_addr = n->dbbuf_dbs + NVME_DBBUF_CQ(cq->id, n->dstrd);
+    cq->ei_addr = n->dbbuf_eis + NVME_DBBUF_CQ(cq->id, n->dstrd);
+    adm_write_dword(cq->head_addr, cq->head);
+    adm_write_dword(cq->ei_addr, cq->head);
+}
+
 static uint32_t adm_cmd_del_sq(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
 {
     /* If something is in the queue then abort all pending messages.
@@ -166,8 +223,6 @@ static uint32_t adm_cmd_del_sq(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
     NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
     sf->sc = NVME_SC_SUCCESS;
 
-    LOG_NORM("%s(): called with QID:%d", __func__, c->qid);
-
     if (cmd->opcode != NVME_ADM_CMD_DELETE_SQ) {
         LOG_NORM("%s(): Invalid opcode %d\n", __func__, cmd->opcode);
         sf->sc = NVME_SC_INVALID_OPCODE;
@@ -186,11 +241,15 @@ static uint32_t adm_cmd_del_sq(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
         sf->sc = NVME_INVALID_QUEUE_IDENTIFIER;
         return FAIL;
     }
+    trace_nvme_delete_sq(n, c->qid);
 
     sq = &n->sq[i];
     if (sq->tail != sq->head) {
         /* Queue not empty */
     }
+    /* Commands still in the block layer are dropped with the queue */
+    nvme_cancel_requests(n, i);
+    nvme_free_sq_requests(n, i);
 
     if (sq->cq_id != NVME_MAX_QID) {
         i = adm_get_sq(n, sq->cq_id);
@@ -221,6 +280,9 @@ static uint32_t adm_cmd_del_sq(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
     sq->prio = 0;
     sq->phys_contig = 0;
     sq->dma_addr = 0;
+    sq->tail_addr = sq->ei_addr = 0;
+    sq->fused = NVME_FUSED_NONE;
+    nvme_update_ioeventfd(n, sq - n->sq);
 
     return 0;
 }
@@ -229,12 +291,11 @@ static uint32_t adm_cmd_alloc_sq(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
 {
     NVMEAdmCmdCreateSQ *c = (NVMEAdmCmdCreateSQ *)cmd;
     NVMEIOSQueue *sq;
+    NVMEIOCQueue *cq;
     uint16_t id, *mqes;
     NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
     sf->sc = NVME_SC_SUCCESS;
 
-    LOG_NORM("%s(): called\n", __func__);
-
     if (cmd->opcode != NVME_ADM_CMD_CREATE_SQ) {
         LOG_NORM("%s(): Invalid opcode %d\n", __func__, cmd->opcode);
         sf->sc = NVME_SC_INVALID_OPCODE;
@@ -255,7 +316,7 @@ static uint32_t adm_cmd_alloc_sq(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
     }
 
     /* Corresponding CQ exists?  if not return error */
-    if (adm_check_cqid(n, c->cqid)) {
+    if (c->cqid == ACQ_ID || adm_check_cqid(n, c->cqid)) {
         cqe->status = NVME_SC_INVALID_FIELD << 1;
         sf->sct = NVME_SCT_CMD_SPEC_ERR;
         sf->sc = NVME_COMPLETION_QUEUE_INVALID;
@@ -263,8 +324,8 @@ static uint32_t adm_cmd_alloc_sq(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
     }
     mqes = (uint16_t *) n->cntrl_reg;
 
-    /* Queue Size */
-    if (c->qsize > *mqes) {
+    /* Queue Size, zero based and at least 2 entries */
+    if (!c->qsize || c->qsize > *mqes) {
         sf->sct = NVME_SCT_CMD_SPEC_ERR;
         sf->sc = NVME_MAX_QUEUE_SIZE_EXCEEDED;
         return FAIL;
@@ -283,6 +344,12 @@ static uint32_t adm_cmd_alloc_sq(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
         sf->sc = NVME_SC_INVALID_FIELD;
         return FAIL;
     }
+    /* The I/O threads only access guest RAM */
+    if (n->nr_iothreads && c->pc &&
+        !nvme_addr_is_ram(c->prp1, (c->qsize + 1) * sizeof(NVMECmd))) {
+        sf->sc = NVME_SC_INVALID_FIELD;
+        return FAIL;
+    }
 
     id = adm_get_free_sq(n);
     if (id == NVME_MAX_QID) {
@@ -300,13 +367,23 @@ static uint32_t adm_cmd_alloc_sq(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
     sq->cq_id = c->cqid;
     sq->prio = c->qprio;
     sq->dma_addr = c->prp1;
+    if (!sq->phys_contig && adm_load_queue_prps(n, c->prp1, c->qsize,
+        sizeof(NVMECmd), sq->prp_list) == FAIL) {
+        sq->dma_addr = 0;
+        sf->sc = NVME_SC_INVALID_FIELD;
+        return FAIL;
+    }
 
-    LOG_NORM("sq->id %d, sq->dma_addr 0x%x, %lu\n",
-        sq->id, (unsigned int)sq->dma_addr,
-        (unsigned long int)sq->dma_addr);
+    trace_nvme_create_sq(n, sq->id, sq->cq_id, sq->size, sq->dma_addr,
+        sq->prio);
 
     /* Mark CQ as used by this queue. */
-    n->cq[adm_get_cq(n, c->cqid)].usage_cnt++;
+    cq = &n->cq[adm_get_cq(n, c->cqid)];
+    cq->usage_cnt++;
+    nvme_init_sq_requests(n, id, cq->size);
+
+    adm_dbbuf_sq(n, id);
+    nvme_update_ioeventfd(n, id);
 
     return 0;
 }
@@ -319,8 +396,6 @@ static uint32_t adm_cmd_del_cq(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
     NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
     sf->sc = NVME_SC_SUCCESS;
 
-    LOG_NORM("%s(): called\n", __func__);
-
     if (cmd->opcode != NVME_ADM_CMD_DELETE_CQ) {
         LOG_NORM("%s(): Invalid opcode %d\n", __func__, cmd->opcode);
         sf->sc = NVME_SC_INVALID_OPCODE;
@@ -347,6 +422,7 @@ static uint32_t adm_cmd_del_cq(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
         /* Queue not empty */
         /* error */
     }
+    trace_nvme_delete_cq(n, c->qid);
 
     /* Do not allow to delete CQ when some SQ is pointing on it. */
     if (cq->usage_cnt) {
@@ -361,6 +437,7 @@ static uint32_t adm_cmd_del_cq(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
     cq->irq_enabled = 0;
     cq->vector = 0;
     cq->phys_contig = 0;
+    cq->head_addr = cq->ei_addr = 0;
 
     return 0;
 }
@@ -373,8 +450,6 @@ static uint32_t adm_cmd_alloc_cq(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
     NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
     sf->sc = NVME_SC_SUCCESS;
 
-    LOG_NORM("%s(): called\n", __func__);
-
     if (cmd->opcode != NVME_ADM_CMD_CREATE_CQ) {
         LOG_NORM("%s(): Invalid opcode %d\n", __func__, cmd->opcode);
         sf->sc = NVME_SC_INVALID_OPCODE;
@@ -398,8 +473,8 @@ static uint32_t adm_cmd_alloc_cq(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
 
     mqes = (uint16_t *) n->cntrl_reg;
 
-    /* Queue Size */
-    if (c->qsize > *mqes) {
+    /* Queue Size, zero based and at least 2 entries */
+    if (!c->qsize || c->qsize > *mqes) {
         LOG_NORM("c->qsize %d, CAP.MQES %d\n",
             c->qsize, *mqes);
         sf->sct = NVME_SCT_CMD_SPEC_ERR;
@@ -419,9 +494,19 @@ static uint32_t adm_cmd_alloc_cq(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
         sf->sc = NVME_SC_INVALID_FIELD;
         return FAIL;
     }
+    if (n->nr_iothreads && c->pc &&
+        !nvme_addr_is_ram(c->prp1, (c->qsize + 1) * sizeof(NVMECQE))) {
+        sf->sc = NVME_SC_INVALID_FIELD;
+        return FAIL;
+    }
+    /* CMBSZ.CQS is clear: CQs stay in guest memory */
+    if (nvme_addr_is_cmb(n, c->prp1, 1)) {
+        sf->sc = NVME_SC_INVALID_CMB_USE;
+        return FAIL;
+    }
 
-    if (c->iv > n->dev.msix_entries_nr - 1 && IS_MSIX(n)) {
-        /* TODO : checks for MSI too */
+    /* iv indexes the per vector state whether MSI-X is enabled or not */
+    if (c->iv >= n->nvectors) {
         sf->sct = NVME_SCT_CMD_SPEC_ERR;
         sf->sc = NVME_INVALID_INTERRUPT_VECTOR;
         return FAIL;
@@ -441,18 +526,59 @@ static uint32_t adm_cmd_alloc_cq(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
     cq->vector = c->iv;
     cq->phase_tag = 1;
 
-    LOG_NORM("kw q: cq[%d] phase_tag   %d\n", cq->id, cq->phase_tag);
-    LOG_NORM("kw q: msix vector. cq[%d] vector %d irq_enabled %d\n",
-                     cq->id, cq->vector, cq->irq_enabled);
     cq->size = c->qsize;
+    trace_nvme_create_cq(n, cq->id, cq->vector, cq->size, cq->dma_addr,
+        cq->irq_enabled);
     cq->phys_contig = c->pc;
+    if (!cq->phys_contig && adm_load_queue_prps(n, c->prp1, c->qsize,
+        sizeof(NVMECQE), cq->prp_list) == FAIL) {
+        cq->dma_addr = 0;
+        sf->sc = NVME_SC_INVALID_FIELD;
+        return FAIL;
+    }
+    adm_dbbuf_cq(n, id);
 
     return 0;
 }
 
+/* Error Information log, the most recent entry first */
+static void adm_log_error_info(NVMEState *n, NVMEErrorLogEntry *log)
+{
+    uint64_t count;
+    uint32_t i;
+
+    qemu_mutex_lock(&n->error_lock);
+    count = MIN(n->error_count, NVME_ERROR_LOG_ENTRIES);
+    for (i = 0; i < count; i++) {
+        log[i] = n->error_log[(n->error_count - 1 - i) %
+            NVME_ERROR_LOG_ENTRIES];
+    }
+    qemu_mutex_unlock(&n->error_lock);
+}
+
+static void adm_log_smart_info(NVMEState *n, NVMESmartLog *smart)
+{
+    smart->temperature[0] = NVME_TEMPERATURE & 0xff;
+    smart->temperature[1] = NVME_TEMPERATURE >> 8;
+    smart->available_spare = 100;
+    smart->available_spare_threshold = 10;
+    nvme_stats_smart(n, smart);
+}
+
+static void adm_log_fw_slot_info(NVMEState *n, NVMEFwSlotLog *fw)
+{
+    fw->afi = 1;
+    pstrcpy((char *)fw->frs[0], sizeof(fw->frs[0]), NVME_FIRMWARE_REVISION);
+}
+
+/* Log pages are built into a zeroed buffer of the size asked by the host,
+ * longer ones are truncated */
 static uint32_t adm_cmd_get_log_page(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
 {
+    NVMEAdmCmdGetLogPage *c = (NVMEAdmCmdGetLogPage *)cmd;
     NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
+    uint32_t len = (c->numd + 1) * 4, size;
+    uint8_t *buf;
     sf->sc = NVME_SC_SUCCESS;
 
     if (cmd->opcode != NVME_ADM_CMD_GET_LOG_PAGE) {
@@ -461,9 +587,48 @@ static uint32_t adm_cmd_get_log_page(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
         return FAIL;
     }
 
-    LOG_NORM("%s(): called\n", __func__);
+    trace_nvme_get_log_page(n, c->lid, len);
 
-    return 0;
+    switch (c->lid) {
+    case NVME_LOG_ERROR_INFO:
+        size = NVME_ERROR_LOG_ENTRIES * sizeof(NVMEErrorLogEntry);
+        break;
+    case NVME_LOG_SMART_INFO:
+        /* The health information is only kept for the whole controller */
+        if (c->nsid != 0 && c->nsid != 0xffffffff) {
+            sf->sc = NVME_SC_INVALID_FIELD;
+            return FAIL;
+        }
+        size = sizeof(NVMESmartLog);
+        break;
+    case NVME_LOG_FW_SLOT_INFO:
+        size = sizeof(NVMEFwSlotLog);
+        break;
+    default:
+        LOG_NORM("%s(): Invalid log page %u\n", __func__, c->lid);
+        sf->sct = NVME_SCT_CMD_SPEC_ERR;
+        sf->sc = NVME_INVALID_LOG_PAGE;
+        return FAIL;
+    }
+
+    buf = qemu_mallocz(MAX(len, size));
+    switch (c->lid) {
+    case NVME_LOG_ERROR_INFO:
+        adm_log_error_info(n, (NVMEErrorLogEntry *)buf);
+        break;
+    case NVME_LOG_SMART_INFO:
+        adm_log_smart_info(n, (NVMESmartLog *)buf);
+        break;
+    case NVME_LOG_FW_SLOT_INFO:
+        adm_log_fw_slot_info(n, (NVMEFwSlotLog *)buf);
+        break;
+    }
+
+    if (nvme_dma_write_prp(n, c->prp1, c->prp2, buf, len)) {
+        sf->sc = NVME_SC_INVALID_FIELD;
+    }
+    qemu_free(buf);
+    return sf->sc ? FAIL : 0;
 }
 
 static uint32_t adm_cmd_id_ctrl(NVMEState *n, NVMECmd *cmd)
@@ -471,8 +636,6 @@ static uint32_t adm_cmd_id_ctrl(NVMEState *n, NVMECmd *cmd)
     NVMEIdentifyController *ctrl;
     struct power_state_description *power;
 
-    LOG_NORM("%s(): called\n", __func__);
-
     ctrl = qemu_mallocz(sizeof(*ctrl));
 
     if (!ctrl) {
@@ -480,7 +643,7 @@ static uint32_t adm_cmd_id_ctrl(NVMEState *n, NVMECmd *cmd)
     }
     pstrcpy((char *)ctrl->mn, sizeof(ctrl->mn), "Qemu NVMe Driver 0xabcd");
     pstrcpy((char *)ctrl->sn, sizeof(ctrl->sn), "NVMeQx1000");
-    pstrcpy((char *)ctrl->fr, sizeof(ctrl->fr), "012345");
+    pstrcpy((char *)ctrl->fr, sizeof(ctrl->fr), NVME_FIRMWARE_REVISION);
 
     /* TODO: fix this hardcoded values !!!
     check identify command for details: spec chapter 5.11 bytes 512 and 513
@@ -493,10 +656,18 @@ static uint32_t adm_cmd_id_ctrl(NVMEState *n, NVMECmd *cmd)
 
     ctrl->vid = 0x8086;
     ctrl->ssvid = 0x0111;
-    ctrl->nn = 1;   /* number of supported name spaces bytes [516:519] */
+    ctrl->nn = n->nr_namespaces; /* number of name spaces bytes [516:519] */
+    ctrl->oacs = NVME_OACS_DBBUF_CONFIG;
+    ctrl->oncs = NVME_ONCS_COMPARE | NVME_ONCS_DSM | NVME_ONCS_WRITE_ZEROES;
+    ctrl->fuses = NVME_FUSES_COMPARE_WRITE;
+    ctrl->sgls = NVME_SGLS_SUPPORTED | NVME_SGLS_BIT_BUCKET;
+    /* MDTS is in units of the minimum memory page size */
+    ctrl->mdts = ctz32(NVME_MAX_XFER_SIZE) - 12 - n->ctrlcap->mpsmin;
+    ctrl->vwc = 1; /* Volatile Write Cache present */
     ctrl->acl = NVME_ABORT_COMMAND_LIMIT;
     ctrl->aerl = 4;
     ctrl->frmw = 1 << 1 | 0;
+    ctrl->elpe = NVME_ERROR_LOG_ENTRIES - 1; /* 0's based */
     ctrl->npss = 2; /* 0 based */
     ctrl->awun = 0xff;
 
@@ -513,42 +684,36 @@ static uint32_t adm_cmd_id_ctrl(NVMEState *n, NVMECmd *cmd)
     /* LOG_NORM("psdx[32] %x, psdx[33] %x\n", ctrl->psdx[32],
      * ctrl->psdx[33]); */
 
-    LOG_NORM("%s(): copying %lu data into addr %lu\n",
-        __func__, sizeof(*ctrl), cmd->prp1);
-
     nvme_dma_mem_write(cmd->prp1, (uint8_t *)ctrl, sizeof(*ctrl));
 
     qemu_free(ctrl);
     return 0;
 }
 
-/* Needs to be checked if this namespace exists. */
 static uint32_t adm_cmd_id_ns(NVMEState *n, NVMECmd *cmd)
 {
     NVMEIdentifyNamespace *ns;
-
-    LOG_NORM("%s(): called\n", __func__);
+    NVMENamespace *nvme_ns = &n->ns[cmd->nsid - 1];
 
     ns = qemu_mallocz(sizeof(*ns));
     if (!ns) {
         return FAIL;
     }
-    LOG_NORM("%s(): copying %lu data into addr %lu\n",
-        __func__, sizeof(*ns), cmd->prp1);
-
-
-
-    ns->nsze = NVME_TOTAL_BLOCKS;
-    ns->ncap = NVME_TOTAL_BLOCKS;
-    ns->nuse = NVME_TOTAL_BLOCKS;
+    ns->nsze = nvme_ns->nsze;
+    ns->ncap = nvme_ns->nsze;
+    ns->nuse = nvme_ns_nuse(nvme_ns);
+    if (nvme_ns->alloc_map) {
+        ns->nsfeat |= 1; /* Thin provisioning */
+    }
 
     /* The value is reported in terms of a power of two (2^n).
-     * LBA data size=2^9=512
+     * LBA data size=2^9=512 for format 0, 2^12=4096 for format 1
      */
-    ns->lbaf0.lbads = 9;
+    ns->nlbaf = NVME_NLBAF - 1; /* 0's based */
+    ns->lbaf[0].lbads = 9;
+    ns->lbaf[1].lbads = 12;
 
-    ns->flbas = 0;    /* [26] Formatted LBA Size */
-    LOG_NORM("kw q: ns->ncap: %lu\n", ns->ncap);
+    ns->flbas = nvme_ns->flbas;    /* [26] Formatted LBA Size */
 
 
     nvme_dma_mem_write(cmd->prp1, (void *)ns, sizeof(*ns));
@@ -566,18 +731,11 @@ static uint32_t adm_cmd_identify(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
     NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
     sf->sc = NVME_SC_SUCCESS;
 
-    LOG_NORM("%s(): called\n", __func__);
-
     if (cmd->opcode != NVME_ADM_CMD_IDENTIFY) {
         LOG_NORM("%s(): Invalid opcode %d\n", __func__, cmd->opcode);
         sf->sc = NVME_SC_INVALID_OPCODE;
         return FAIL;
     }
-    if (c->prp2) {
-        /* Don't like it! */
-        LOG_NORM("%s(): prp2 is set\n", __func__);
-    }
-
     if (c->prp1 == 0) {
         /* Error!*/
         LOG_NORM("%s(): prp1 is not set\n", __func__);
@@ -585,6 +743,8 @@ static uint32_t adm_cmd_identify(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
         return FAIL;
     }
 
+    trace_nvme_identify(n, c->cns, c->nsid);
+
     /* TODO: controller = c->cns; */
     /* TODO: addr = c->prp1; */
 
@@ -592,6 +752,11 @@ static uint32_t adm_cmd_identify(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
     if (c->cns == NVME_IDENTIFY_CONTROLLER) {
         ret = adm_cmd_id_ctrl(n, cmd);
     } else {
+        if (!nvme_ns(n, c->nsid)) {
+            LOG_NORM("%s(): invalid namespace %u\n", __func__, c->nsid);
+            sf->sc = NVME_SC_INVALID_NAMESPACE;
+            return FAIL;
+        }
         ret = adm_cmd_id_ns(n, cmd);
     }
     if (ret) {
@@ -616,20 +781,20 @@ static uint32_t adm_cmd_abort(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
 {
     NVMEAdmCmdAbort *c = (NVMEAdmCmdAbort *)cmd;
     NVMEIOSQueue *sq;
+    NVMERequest *req;
     uint16_t i, tmp;
     target_phys_addr_t addr;
     NVMECmd sqe;
     NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
     sf->sc = NVME_SC_SUCCESS;
 
-    LOG_NORM("%s(): called\n", __func__);
-
     if (cmd->opcode != NVME_ADM_CMD_ABORT) {
         LOG_NORM("%s(): Invalid opcode %d\n", __func__, cmd->opcode);
         sf->sc = NVME_SC_INVALID_OPCODE;
         return FAIL;
     }
 
+    trace_nvme_abort(n, c->sqid, c->cmdid);
     if (c->sqid >= NVME_MAX_QID) {
         sf->sc = NVME_SC_INVALID_FIELD;
         return FAIL;
@@ -652,6 +817,15 @@ static uint32_t adm_cmd_abort(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
         return FAIL;
     }
 
+    /* A command in flight is stopped right away, if it still can be.
+     * Dword 0 bit 0 tells the host when it couldn't. */
+    req = nvme_find_request(n, i, c->cmdid);
+    if (req) {
+        cqe->cmd_specific = (nvme_abort_request(n, req) == FAIL);
+        return 0;
+    }
+
+    /* Else it may still be in the SQ, it's aborted once fetched */
     if (n->abort == NVME_ABORT_COMMAND_LIMIT) {
         sf->sct = NVME_SCT_CMD_SPEC_ERR;
         sf->sc = NVME_ABORT_CMD_LIMIT_EXCEEDED;
@@ -706,6 +880,7 @@ static uint32_t do_features(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
     NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
     sf->sc = NVME_SC_SUCCESS;
 
+    trace_nvme_features(n, sqe->opcode, sqe->fid, sqe->cdw11);
     switch (sqe->fid) {
     case NVME_FEATURE_ARBITRATION:
         if (sqe->opcode == NVME_ADM_CMD_SET_FEATURES) {
@@ -745,7 +920,7 @@ static uint32_t do_features(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
 
     case NVME_FEATURE_VOLATILE_WRITE_CACHE:
         if (sqe->opcode == NVME_ADM_CMD_SET_FEATURES) {
-            n->feature.volatile_write_cache = sqe->cdw11;
+            n->feature.volatile_write_cache = sqe->cdw11 & NVME_VWC_WCE;
         } else {
             cqe->cmd_specific = n->feature.volatile_write_cache;
         }
@@ -768,11 +943,21 @@ static uint32_t do_features(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
         break;
 
     case NVME_FEATURE_INTERRUPT_VECTOR_CONF:
+        /* Per vector: CDW11 selects the vector for Get Features too */
+        if (NVME_IVC_IV(sqe->cdw11) >= n->nvectors) {
+            LOG_NORM("Invalid interrupt vector %d\n",
+                NVME_IVC_IV(sqe->cdw11));
+            sf->sc = NVME_SC_INVALID_FIELD;
+            break;
+        }
         if (sqe->opcode == NVME_ADM_CMD_SET_FEATURES) {
-            n->feature.interrupt_vector_configuration = sqe->cdw11;
+            n->vectors[NVME_IVC_IV(sqe->cdw11)].coalescing_disabled =
+                !!(sqe->cdw11 & NVME_IVC_CD);
         } else {
-            cqe->cmd_specific =
-                n->feature.interrupt_vector_configuration;
+            cqe->cmd_specific = NVME_IVC_IV(sqe->cdw11);
+            if (n->vectors[NVME_IVC_IV(sqe->cdw11)].coalescing_disabled) {
+                cqe->cmd_specific |= NVME_IVC_CD;
+            }
         }
         break;
 
@@ -823,7 +1008,6 @@ static uint32_t adm_cmd_set_features(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
 
     res = do_features(n, cmd, cqe);
 
-    LOG_NORM("%s(): called\n", __func__);
     return res;
 }
 
@@ -840,7 +1024,6 @@ static uint32_t adm_cmd_get_features(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
 
     res = do_features(n, cmd, cqe);
 
-    LOG_NORM("%s(): called\n", __func__);
     return res;
 }
 
@@ -856,6 +1039,50 @@ static uint32_t adm_cmd_async_ev_req(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
         return FAIL;
     }
 
-    LOG_NORM("%s(): called\n", __func__);
+    return 0;
+}
+
+/* Doorbell Buffer Config: the guest keeps a copy of the I/O queue doorbells
+ * in the page at PRP1 and only writes the doorbell registers once the
+ * values pass the EventIdx the controller publishes in the page at PRP2.
+ * The admin queues keep using the doorbell registers. */
+static uint32_t adm_cmd_dbbuf_config(NVMEState *n, NVMECmd *cmd, NVMECQE *cqe)
+{
+    NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
+    uint64_t mask = nvme_page_size(n) - 1;
+    uint16_t i;
+
+    sf->sc = NVME_SC_SUCCESS;
+
+    if (cmd->opcode != NVME_ADM_CMD_DBBUF_CONFIG) {
+        LOG_NORM("%s(): Invalid opcode %d\n", __func__, cmd->opcode);
+        sf->sc = NVME_SC_INVALID_OPCODE;
+        return FAIL;
+    }
+
+    if (!cmd->prp1 || !cmd->prp2 || (cmd->prp1 & mask) ||
+        (cmd->prp2 & mask)) {
+        sf->sc = NVME_SC_INVALID_FIELD;
+        return FAIL;
+    }
+    /* The I/O threads read the shadow doorbells, from guest RAM only */
+    if (n->nr_iothreads && (!nvme_addr_is_ram(cmd->prp1, mask + 1) ||
+        !nvme_addr_is_ram(cmd->prp2, mask + 1))) {
+        sf->sc = NVME_SC_INVALID_FIELD;
+        return FAIL;
+    }
+    trace_nvme_dbbuf_config(n, cmd->prp1, cmd->prp2);
+
+    n->dbbuf_dbs = cmd->prp1;
+    n->dbbuf_eis = cmd->prp2;
+    for (i = 0; i < NVME_MAX_QID; i++) {
+        if (n->sq[i].dma_addr && n->sq[i].id != ASQ_ID) {
+            adm_dbbuf_sq(n, i);
+            nvme_update_ioeventfd(n, i);
+        }
+        if (n->cq[i].dma_addr && n->cq[i].id != ACQ_ID) {
+            adm_dbbuf_cq(n, i);
+        }
+    }
     return 0;
 }
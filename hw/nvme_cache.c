@@ -0,0 +1,311 @@
+/*
+ * Copyright (c) 2011 Intel Corporation
+ *
+ * by Patrick Porlan <patrick.porlan@intel.com>
+ *    Nisheeth Bhat <nisheeth.bhat@intel.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ *
+ * This file deals with the volatile write cache of the file backed
+ * namespaces. Writes land in the host page cache, through the mapping of
+ * the backing file or pwrite(), and complete from there; with direct I/O
+ * they only may sit in the cache of the host disk. A destage thread
+ * starts the write back of the dirty pages in the background and serves
+ * the Flush commands: all the flushes queued while it syncs are covered by
+ * the next fdatasync() of their namespace. Their completions are posted
+ * from the main loop, with the I/O threads paused.
+ * With the write cache disabled, writes reach stable storage before they
+ * complete.
+ */
+
+#include "nvme.h"
+#include "nvme_debug.h"
+#include <sys/mman.h>
+
+#define PAGE_SIZE 4096
+
+/* Start the write back of the dirty pages of a namespace, without waiting
+ * for it */
+static void cache_destage(NVMENamespace *ns)
+{
+#ifdef CONFIG_SYNC_FILE_RANGE
+    sync_file_range(ns->fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+#else
+    if (ns->mapping_addr) {
+        msync(ns->mapping_addr, ns->mapping_size, MS_ASYNC);
+    }
+#endif
+}
+
+/* Sync the namespaces of the flush mask, once each, and start the write
+ * back of the other namespaces with dirty data. Returns the mask of the
+ * namespaces that failed to sync. */
+static uint32_t cache_sync(NVMEState *n, uint32_t flush)
+{
+    uint32_t failed = 0, i;
+    NVMENamespace *ns;
+
+    for (i = 0; i < n->nr_namespaces; i++) {
+        ns = &n->ns[i];
+        if (ns->fd == -1) {
+            continue;
+        }
+        if (flush & (1 << i)) {
+            __sync_lock_test_and_set(&ns->dirty, 0);
+            if (qemu_fdatasync(ns->fd)) {
+                LOG_ERR("Unable to sync namespace %u: %s", i + 1,
+                    strerror(errno));
+                failed |= 1 << i;
+            }
+        } else if (ns->dirty) {
+            __sync_lock_test_and_set(&ns->dirty, 0);
+            cache_destage(ns);
+        }
+    }
+    return failed;
+}
+
+/* The flushes are only touched with the lock held: one cancelled while
+ * its namespace syncs is just gone from the syncing list afterwards */
+static void *cache_run(void *opaque)
+{
+    NVMEState *n = opaque;
+    NVMECache *c = &n->cache;
+    NVMERequest *req;
+    NVMEStatusField *sf;
+    uint32_t flush, failed;
+
+    qemu_mutex_lock(&c->lock);
+    while (c->state == TH_STARTED) {
+        if (!c->kicked) {
+            qemu_cond_timedwait(&c->cond, &c->lock, NVME_DESTAGE_INTERVAL_MS);
+            if (c->state != TH_STARTED) {
+                break;
+            }
+        }
+        c->kicked = 0;
+        flush = 0;
+        while ((req = QTAILQ_FIRST(&c->flushes))) {
+            QTAILQ_REMOVE(&c->flushes, req, entry);
+            QTAILQ_INSERT_TAIL(&c->syncing, req, entry);
+            flush |= 1 << (req->ns - n->ns);
+        }
+        qemu_mutex_unlock(&c->lock);
+
+        failed = cache_sync(n, flush);
+
+        qemu_mutex_lock(&c->lock);
+        if (!QTAILQ_EMPTY(&c->syncing)) {
+            while ((req = QTAILQ_FIRST(&c->syncing))) {
+                QTAILQ_REMOVE(&c->syncing, req, entry);
+                if (failed & (1 << (req->ns - n->ns))) {
+                    sf = (NVMEStatusField *)&req->cqe.status;
+                    sf->sc = NVME_SC_INTERNAL;
+                }
+                QTAILQ_INSERT_TAIL(&c->done, req, entry);
+            }
+            event_notifier_set(&c->notifier);
+        }
+    }
+    c->state = TH_EXIT;
+    qemu_mutex_unlock(&c->lock);
+    return NULL;
+}
+
+/* Post the completions of the synced flushes */
+static void cache_done_read(void *opaque)
+{
+    NVMEState *n = opaque;
+    NVMECache *c = &n->cache;
+    struct NVMERequestList done;
+    NVMERequest *req;
+
+    event_notifier_test_and_clear(&c->notifier);
+
+    QTAILQ_INIT(&done);
+    qemu_mutex_lock(&c->lock);
+    while ((req = QTAILQ_FIRST(&c->done))) {
+        QTAILQ_REMOVE(&c->done, req, entry);
+        QTAILQ_INSERT_TAIL(&done, req, entry);
+    }
+    qemu_mutex_unlock(&c->lock);
+    if (QTAILQ_EMPTY(&done)) {
+        return;
+    }
+
+    /* The CQs may belong to I/O threads */
+    nvme_io_thread_pause(n);
+    while ((req = QTAILQ_FIRST(&done))) {
+        QTAILQ_REMOVE(&done, req, entry);
+        nvme_stats_done(n, req->sq_id, &req->cmd, &req->cqe, req->start);
+        nvme_post_cqe(n, req->sq_id, &req->cqe);
+        nvme_free_request(req);
+    }
+    nvme_io_thread_resume(n);
+}
+
+/* Account a write to a file backed namespace. It is done once the data is
+ * in the page cache, or on the device for direct I/O, unless the write
+ * cache is off or the write has FUA set. */
+void nvme_cache_write(NVMEState *n, NVMENamespace *ns, uint64_t off,
+    uint64_t len, int fua)
+{
+    NVMECache *c = &n->cache;
+    uint64_t start, dirty;
+
+    if (fua || !nvme_vwc_enabled(n)) {
+        if (!ns->mapping_addr) {
+            qemu_fdatasync(ns->fd);
+            return;
+        }
+        start = off & ~(uint64_t)(PAGE_SIZE - 1);
+        msync(ns->mapping_addr + start, off + len - start, MS_SYNC);
+        return;
+    }
+
+    dirty = __sync_fetch_and_add(&ns->dirty, len);
+    if (dirty < NVME_DESTAGE_BYTES && dirty + len >= NVME_DESTAGE_BYTES) {
+        qemu_mutex_lock(&c->lock);
+        c->kicked = 1;
+        qemu_cond_signal(&c->cond);
+        qemu_mutex_unlock(&c->lock);
+    }
+}
+
+/* Queue a Flush for the destage thread, it completes once the namespace
+ * got synced */
+uint8_t nvme_cache_flush(NVMEState *n, NVMENamespace *ns, NVMECmd *sqe,
+    NVMECQE *cqe)
+{
+    NVMECache *c = &n->cache;
+    NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
+    NVMERequest *req;
+
+    req = nvme_get_request(n, ns, sqe, cqe);
+    if (!req) {
+        sf->sc = NVME_SC_INTERNAL;
+        return FAIL;
+    }
+
+    qemu_mutex_lock(&c->lock);
+    QTAILQ_INSERT_TAIL(&c->flushes, req, entry);
+    c->kicked = 1;
+    qemu_cond_signal(&c->cond);
+    qemu_mutex_unlock(&c->lock);
+    return NVME_REQ_PENDING;
+}
+
+static void cache_cancel_list(NVMEState *n, uint16_t sq_id,
+    struct NVMERequestList *list)
+{
+    NVMERequest *req, *next;
+
+    QTAILQ_FOREACH_SAFE(req, list, entry, next) {
+        if (sq_id != NVME_MAX_QID && req->sq_id != sq_id) {
+            continue;
+        }
+        QTAILQ_REMOVE(list, req, entry);
+        n->cq[n->sq[req->sq_id].cq_id].inflight--;
+        nvme_free_request(req);
+    }
+}
+
+/* Drop the flushes of a SQ, or of all SQs when sq_id is NVME_MAX_QID. No
+ * completion is posted for them, not even for those being synced: the
+ * sync goes on without them. */
+void nvme_cache_cancel(NVMEState *n, uint16_t sq_id)
+{
+    NVMECache *c = &n->cache;
+
+    if (c->state != TH_STARTED) {
+        return;
+    }
+    qemu_mutex_lock(&c->lock);
+    cache_cancel_list(n, sq_id, &c->flushes);
+    cache_cancel_list(n, sq_id, &c->syncing);
+    cache_cancel_list(n, sq_id, &c->done);
+    qemu_mutex_unlock(&c->lock);
+}
+
+/* Drop a flush the destage thread hasn't picked up yet, the caller
+ * completes it. FAIL once the namespaces are being synced for it. */
+uint8_t nvme_cache_abort(NVMEState *n, NVMERequest *req)
+{
+    NVMECache *c = &n->cache;
+    NVMERequest *r;
+    uint8_t ret = FAIL;
+
+    if (c->state != TH_STARTED) {
+        return FAIL;
+    }
+    qemu_mutex_lock(&c->lock);
+    QTAILQ_FOREACH(r, &c->flushes, entry) {
+        if (r == req) {
+            QTAILQ_REMOVE(&c->flushes, req, entry);
+            ret = 0;
+            break;
+        }
+    }
+    qemu_mutex_unlock(&c->lock);
+    return ret;
+}
+
+/* Start the destage thread, once the backing files are open */
+int nvme_cache_start(NVMEState *n)
+{
+    NVMECache *c = &n->cache;
+    int ret;
+
+    ret = event_notifier_init(&c->notifier, 0);
+    if (ret < 0) {
+        LOG_ERR("Unable to create the destage notifier: %d", ret);
+        return FAIL;
+    }
+    qemu_set_fd_handler(event_notifier_get_fd(&c->notifier),
+        cache_done_read, NULL, n);
+
+    QTAILQ_INIT(&c->flushes);
+    QTAILQ_INIT(&c->syncing);
+    QTAILQ_INIT(&c->done);
+    c->kicked = 0;
+    c->state = TH_STARTED;
+    qemu_mutex_init(&c->lock);
+    qemu_cond_init(&c->cond);
+    qemu_thread_create(&c->thread, cache_run, n);
+    return 0;
+}
+
+/* Stop the destage thread before the backing files get closed. Pending
+ * flushes are dropped, the data stays in the page cache. */
+void nvme_cache_stop(NVMEState *n)
+{
+    NVMECache *c = &n->cache;
+
+    if (c->state != TH_STARTED) {
+        return;
+    }
+    nvme_cache_cancel(n, NVME_MAX_QID);
+
+    qemu_mutex_lock(&c->lock);
+    c->state = TH_STOP;
+    qemu_cond_broadcast(&c->cond);
+    qemu_mutex_unlock(&c->lock);
+    qemu_thread_join(&c->thread);
+    qemu_cond_destroy(&c->cond);
+    qemu_mutex_destroy(&c->lock);
+    c->state = TH_NOT_STARTED;
+
+    qemu_set_fd_handler(event_notifier_get_fd(&c->notifier),
+        NULL, NULL, NULL);
+    event_notifier_cleanup(&c->notifier);
+}
@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2011 Intel Corporation
+ *
+ * by Patrick Porlan <patrick.porlan@intel.com>
+ *    Nisheeth Bhat <nisheeth.bhat@intel.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ *
+ * This file deals with the Controller Memory Buffer. The buffer is RAM
+ * behind its own prefetchable BAR: the guest fills the SQs and PRP lists
+ * it places there without exits, and the controller reads them from the
+ * buffer rather than through the guest physical memory map.
+ */
+
+#include "nvme.h"
+#include "nvme_debug.h"
+
+static void cmb_map(PCIDevice *pci_dev, int reg_num, pcibus_t addr,
+    pcibus_t size, int type)
+{
+    NVMEState *n = DO_UPCAST(NVMEState, dev, pci_dev);
+
+    cpu_register_physical_memory(addr, size, n->cmb_offset | IO_MEM_RAM);
+    n->cmb_addr = addr;
+}
+
+/* Allocate the buffer and register its BAR, when the cmb_size_mb property
+ * asks for one */
+int nvme_cmb_init(NVMEState *n)
+{
+    if (!n->cmb_size_mb) {
+        return 0;
+    }
+    if (n->cmb_size_mb > NVME_CMB_MAX_MB ||
+        (n->cmb_size_mb & (n->cmb_size_mb - 1))) {
+        LOG_ERR("cmb_size_mb must be a power of 2 up to %d",
+            NVME_CMB_MAX_MB);
+        return FAIL;
+    }
+
+    n->cmb_size = (uint64_t)n->cmb_size_mb << 20;
+    n->cmb_offset = qemu_ram_alloc(&n->dev.qdev, "nvme.cmb", n->cmb_size);
+    n->cmb_buf = qemu_get_ram_ptr(n->cmb_offset);
+    n->cmb_addr = 0;
+    pci_register_bar(&n->dev, NVME_CMB_BIR, n->cmb_size,
+        PCI_BASE_ADDRESS_SPACE_MEMORY | PCI_BASE_ADDRESS_MEM_TYPE_64 |
+        PCI_BASE_ADDRESS_MEM_PREFETCH, cmb_map);
+    return 0;
+}
+
+void nvme_cmb_exit(NVMEState *n)
+{
+    if (!n->cmb_buf) {
+        return;
+    }
+    qemu_ram_free(n->cmb_offset);
+    n->cmb_buf = NULL;
+    n->cmb_addr = 0;
+}
+
+/* CMBLOC and CMBSZ, read only. Both stay 0 without a buffer. */
+void nvme_cmb_set_registry(NVMEState *n)
+{
+    uint32_t loc = 0, sz = 0;
+
+    if (n->cmb_buf) {
+        /* The buffer starts at offset 0 of its BAR */
+        loc = NVME_CMB_BIR;
+        sz = NVME_CMBSZ_SQS | NVME_CMBSZ_LISTS | NVME_CMBSZ_SZU_1M |
+            NVME_CMBSZ_SZ(n->cmb_size_mb);
+    }
+    loc = cpu_to_le32(loc);
+    sz = cpu_to_le32(sz);
+    memcpy(&n->cntrl_reg[NVME_CMBLOC], &loc, DWORD);
+    memcpy(&n->cntrl_reg[NVME_CMBSZ], &sz, DWORD);
+}
+
+/* Read guest memory, from the buffer itself for ranges in the CMB */
+void nvme_addr_read(NVMEState *n, target_phys_addr_t addr, uint8_t *buf,
+    int len)
+{
+    if (nvme_addr_is_cmb(n, addr, len)) {
+        memcpy(buf, n->cmb_buf + (addr - n->cmb_addr), len);
+        return;
+    }
+    nvme_dma_mem_read(addr, buf, len);
+}
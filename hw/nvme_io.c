@@ -19,18 +19,66 @@
 
 #include "nvme.h"
 #include "nvme_debug.h"
+#include "host-utils.h"
+#include "trace.h"
 
 
-/* queue is full if tail is just behind head. */
+/* Read a shadow doorbell of Doorbell Buffer Config. Values beyond the end
+ * of the queue are ignored. */
+void nvme_shadow_read(uint64_t addr, uint16_t size, uint16_t *val)
+{
+    uint32_t db;
+
+    nvme_dma_mem_read(addr, (uint8_t *)&db, sizeof(db));
+    db = le32_to_cpu(db);
+    if (db <= size) {
+        *val = db;
+    }
+    /* Entries are read after the doorbell that covers them */
+    __sync_synchronize();
+}
+
+/* Publish an EventIdx: the guest writes the doorbell register again once
+ * its doorbell value moves past val */
+static void eventidx_write(uint64_t addr, uint16_t val)
+{
+    uint32_t ei = cpu_to_le32(val);
+
+    nvme_dma_mem_write(addr, (uint8_t *)&ei, sizeof(ei));
+    /* The shadow doorbell is read again after the EventIdx is visible */
+    __sync_synchronize();
+}
 
-static uint8_t is_cq_full(NVMEState *n, uint16_t qid)
+static uint32_t cq_used(NVMEIOCQueue *cq)
 {
-    return (n->cq[qid].tail + 1) % (n->cq[qid].size + 1) == n->cq[qid].head;
+    return (cq->tail + cq->size + 1 - cq->head) % (cq->size + 1);
 }
 
-static void incr_sq_head(NVMEIOSQueue *q)
+/* Free CQ entries, not counting the entries reserved by commands still in
+ * flight. A CQ is full when its tail is just behind its head. */
+static uint16_t cq_free(NVMEState *n, uint16_t qid)
 {
-    q->head = (q->head + 1) % (q->size + 1);
+    NVMEIOCQueue *cq = &n->cq[qid];
+    uint32_t used = cq_used(cq);
+
+    if (used + cq->inflight >= cq->size && cq->head_addr) {
+        /* The guest consumes entries without writing the doorbell
+         * register: look at the shadow head, and ask for a doorbell write
+         * if the CQ is still full */
+        nvme_shadow_read(cq->head_addr, cq->size, &cq->head);
+        eventidx_write(cq->ei_addr, cq->head);
+        nvme_shadow_read(cq->head_addr, cq->size, &cq->head);
+        used = cq_used(cq);
+    }
+    if (used + cq->inflight >= cq->size) {
+        return 0;
+    }
+    return cq->size - used - cq->inflight;
+}
+
+static uint16_t sq_pending(NVMEIOSQueue *sq)
+{
+    return (sq->tail + sq->size + 1 - sq->head) % (sq->size + 1);
 }
 
 static void incr_cq_tail(NVMEIOCQueue *q)
@@ -42,12 +90,52 @@ static void incr_cq_tail(NVMEIOCQueue *q)
     }
 }
 
+/* Guest address of entry idx of a queue with entries of esize bytes. Sets
+ * *run to the number of entries from idx that are physically adjacent,
+ * up to the end of the queue. */
+static target_phys_addr_t queue_entry_addr(NVMEState *n, uint64_t dma_addr,
+    int contig, uint64_t *prp_list, uint16_t size, uint16_t idx,
+    uint32_t esize, uint16_t *run)
+{
+    uint32_t entr_per_pg;
+
+    if (contig) {
+        *run = size + 1 - idx;
+        return dma_addr + idx * esize;
+    }
+    entr_per_pg = nvme_page_size(n) / esize;
+    *run = MIN(entr_per_pg - idx % entr_per_pg, size + 1 - idx);
+    return prp_list[idx / entr_per_pg] + (idx % entr_per_pg) * esize;
+}
+
+/* Fetch nr SQEs from the head of a SQ, in one read per physically
+ * contiguous run of entries */
+static void sq_fetch(NVMEState *n, uint16_t sq_id, NVMECmd *sqes, uint16_t nr)
+{
+    NVMEIOSQueue *sq = &n->sq[sq_id];
+    target_phys_addr_t addr;
+    uint16_t run;
+
+    while (nr) {
+        addr = queue_entry_addr(n, sq->dma_addr,
+            sq_id == ASQ_ID || sq->phys_contig, sq->prp_list, sq->size,
+            sq->head, sizeof(*sqes), &run);
+        run = MIN(run, nr);
+        trace_nvme_sq_fetch(n, sq_id, sq->head, run);
+        nvme_addr_read(n, addr, (uint8_t *)sqes, run * sizeof(*sqes));
+        sq->head = (sq->head + run) % (sq->size + 1);
+        sqes += run;
+        nr -= run;
+    }
+}
+
 static uint8_t abort_command(NVMEState *n, uint16_t sq_id, NVMECmd *sqe)
 {
     uint16_t i;
 
     for (i = 0; i < NVME_ABORT_COMMAND_LIMIT; i++) {
         if (n->sq[sq_id].abort_cmd_id[i] == sqe->cid) {
+            trace_nvme_cmd_aborted(n, sq_id, sqe->cid);
             n->sq[sq_id].abort_cmd_id[i] = NVME_EMPTY;
             n->abort--;
             return 1;
@@ -56,100 +144,405 @@ static uint8_t abort_command(NVMEState *n, uint16_t sq_id, NVMECmd *sqe)
     return 0;
 }
 
-void process_sq(NVMEState *n, uint16_t sq_id)
+/* Execute a SQE fetched from a SQ. The caller made sure the CQ has room
+ * for its completion. */
+static void process_sqe(NVMEState *n, uint16_t sq_id, NVMECmd *sqe)
 {
-    target_phys_addr_t addr, pg_addr;
-    uint16_t cq_id;
-    NVMECmd sqe;
+    uint16_t cq_id = n->sq[sq_id].cq_id;
+    NVMEQueueStats *st = &n->stats[cq_id];
     NVMECQE cqe;
-    /* TODO: uint32_t ret = NVME_SC_DATA_XFER_ERROR; */
+    uint8_t ret;
     NVMEStatusField *sf = (NVMEStatusField *) &cqe.status;
-    uint16_t mps;
-    uint32_t pg_no, entr_per_pg;
+    int64_t start;
 
-    cq_id = n->sq[sq_id].cq_id;
+    memset(&cqe, 0, sizeof(cqe));
 
-    if (is_cq_full(n, cq_id)) {
-        return;
+    start = get_clock();
+    trace_nvme_cmd_start(n, sq_id, sqe->cid, sqe->opcode, sqe->nsid);
+    n->stats[sq_id].commands++;
+    if (sq_id != ASQ_ID && !n->stats[sq_id].outstanding++) {
+        n->stats[sq_id].busy_start = start;
     }
-    memset(&cqe, 0, sizeof(cqe));
+    /* The CQ entry is reserved until the command completes */
+    n->cq[cq_id].inflight++;
+    if (n->cq[cq_id].inflight > st->max_inflight) {
+        st->max_inflight = n->cq[cq_id].inflight;
+    }
+    cqe.sq_id = sq_id;
+    cqe.command_id = sqe->cid;
 
-    /* Process SQE */
-    if (sq_id == ASQ_ID || n->sq[sq_id].phys_contig) {
-        addr = n->sq[sq_id].dma_addr + n->sq[sq_id].head * sizeof(sqe);
+    if (n->abort && abort_command(n, sq_id, sqe)) {
+        /* Aborted before it got to run */
+        sf->sc = NVME_SC_ABORT_REQ;
+    } else if (sq_id == ASQ_ID) {
+        /* Admin commands may change the I/O queues under the I/O threads */
+        nvme_io_thread_pause(n);
+        nvme_admin_command(n, sqe, &cqe);
+        nvme_io_thread_resume(n);
     } else {
-        /* PRP implementation */
-        memcpy(&mps, &n->cntrl_reg[NVME_CC], WORD);
-        LOG_DBG("Mask: %x", MASK(4, 7));
-        mps &= (uint16_t) MASK(4, 7);
-        mps >>= 7;
-        LOG_DBG("CC.MPS:%x", mps);
-        entr_per_pg = (uint32_t) ((1 << (12 + mps))/sizeof(sqe));
-        pg_no = (uint32_t) (n->sq[sq_id].head / entr_per_pg);
-        nvme_dma_mem_read(n->sq[sq_id].dma_addr + (pg_no * QWORD),
-            (uint8_t *)&pg_addr, QWORD);
-        addr = pg_addr + (n->sq[sq_id].head % entr_per_pg) * sizeof(sqe);
-    }
-    nvme_dma_mem_read(addr, (uint8_t *)&sqe, sizeof(sqe));
-
-    if (n->abort) {
-        if (abort_command(n, sq_id, &sqe)) {
-            incr_sq_head(&n->sq[sq_id]);
+        ret = nvme_io_command(n, sqe, &cqe);
+        if (ret == NVME_REQ_PENDING) {
             return;
         }
     }
-
-    if (sq_id == ASQ_ID) {
-        nvme_admin_command(n, &sqe, &cqe);
-    } else {
-        nvme_io_command(n, &sqe, &cqe);
-    }
-    cqe.sq_id = sq_id;
-    cqe.sq_head = n->sq[sq_id].head;
-    cqe.command_id = sqe.cid;
-
-    sf->p = n->cq[cq_id].phase_tag;
     sf->m = 0;
     sf->dnr = 0; /* TODO add support for dnr */
 
-    /* write cqe to completion queue */
-    if (cq_id == ACQ_ID || n->cq[cq_id].phys_contig) {
-        addr = n->cq[cq_id].dma_addr + n->cq[cq_id].tail * sizeof(cqe);
-    } else {
-        /* PRP implementation */
-        memcpy(&mps, &n->cntrl_reg[NVME_CC], WORD);
-        LOG_DBG("Mask: %x", MASK(4, 7));
-        mps &= (uint16_t) MASK(4, 7);
-        mps >>= 7;
-        LOG_DBG("CC.MPS:%x", mps);
-        entr_per_pg = (uint32_t) ((1 << (12 + mps))/sizeof(cqe));
-        pg_no = (uint32_t) (n->cq[cq_id].tail / entr_per_pg);
-        nvme_dma_mem_read(n->cq[cq_id].dma_addr + (pg_no * QWORD),
-            (uint8_t *)&pg_addr, QWORD);
-        addr = pg_addr + (n->cq[cq_id].tail % entr_per_pg) * sizeof(cqe);
-    }
-    nvme_dma_mem_write(addr, (uint8_t *)&cqe, sizeof(cqe));
-
-    incr_sq_head(&n->sq[sq_id]);
-    incr_cq_tail(&n->cq[cq_id]);
+    nvme_stats_done(n, sq_id, sqe, &cqe, start);
+    nvme_post_cqe(n, sq_id, &cqe);
+}
+
+/* Raise the interrupt of a CQ for nr_cqes new completions */
+static void cq_notify(NVMEState *n, uint16_t cq_id, uint32_t nr_cqes)
+{
+    NVMEIOCQueue *cq = &n->cq[cq_id];
 
     if (cq_id == ACQ_ID) {
         /*
          3.1.9 says: "This queue is always associated
                  with interrupt vector 0"
+         Admin completions are never coalesced; the interrupt also covers
+         the I/O completions held back on vector 0.
         */
+        n->vectors[0].cqes = 0;
+        trace_nvme_irq_msix(n, 0, nr_cqes);
         msix_notify(&(n->dev), 0);
         return;
     }
 
-    if (n->cq[cq_id].irq_enabled) {
-        msix_notify(&(n->dev), n->cq[cq_id].vector);
+    if (cq->irq_enabled) {
+        if (n->nr_iothreads) {
+            nvme_io_thread_notify(n, cq->vector, nr_cqes);
+        } else {
+            nvme_irq_notify(n, cq->vector, nr_cqes);
+        }
     } else {
-        LOG_NORM("kw q: IRQ not enabled for CQ: %d;\n", cq_id);
+        trace_nvme_cq_irq_disabled(n, cq_id, nr_cqes);
     }
+}
+
+static void cq_batch_write(NVMECQBatch *b)
+{
+    nvme_dma_mem_write(b->addr, (uint8_t *)b->cqe, b->len * sizeof(*b->cqe));
+    b->len = 0;
+}
+
+/* Write a completion to the CQ of a SQ and raise its interrupt. While a
+ * processing pass holds the CQ batch open, the CQE is only queued. */
+void nvme_post_cqe(NVMEState *n, uint16_t sq_id, NVMECQE *cqe)
+{
+    uint16_t cq_id = n->sq[sq_id].cq_id;
+    NVMEIOCQueue *cq = &n->cq[cq_id];
+    NVMECQBatch *b = &n->cq_batch[cq_id];
+    NVMEStatusField *sf = (NVMEStatusField *) &cqe->status;
+    target_phys_addr_t addr;
+    uint16_t run;
+
+    cqe->sq_head = n->sq[sq_id].head;
+    sf->p = cq->phase_tag;
+
+    addr = queue_entry_addr(n, cq->dma_addr,
+        cq_id == ACQ_ID || cq->phys_contig, cq->prp_list, cq->size,
+        cq->tail, sizeof(*cqe), &run);
+    trace_nvme_cqe_post(n, cq_id, sq_id, cqe->command_id, cqe->status,
+        cq->tail);
+    incr_cq_tail(cq);
+    cq->inflight--;
+    n->stats[cq_id].completions++;
 
+    if (!b->open) {
+        nvme_dma_mem_write(addr, (uint8_t *)cqe, sizeof(*cqe));
+        cq_notify(n, cq_id, 1);
+        return;
+    }
 
+    if (b->len == NVME_CQE_BATCH ||
+        (b->len && addr != b->addr + b->len * sizeof(*cqe))) {
+        cq_batch_write(b);
+    }
+    if (!b->len) {
+        b->addr = addr;
+    }
+    b->cqe[b->len++] = *cqe;
+    b->nr_cqes++;
 }
 
+/* The vectors of a pass are a bitmap, CQ vectors are below nvectors */
+QEMU_BUILD_BUG_ON(NVME_MSIX_NVECTORS > 32);
+
+/* Write back the CQEs batched on the CQs of cq_mask during a processing
+ * pass, then raise one interrupt per vector */
+void nvme_cq_batch_flush(NVMEState *n, uint64_t cq_mask)
+{
+    uint32_t nr_cqes[NVME_MSIX_NVECTORS] = { 0 };
+    uint32_t vectors = 0, vector;
+    uint16_t cq_id;
+    NVMECQBatch *b;
+
+    for (; cq_mask; cq_mask &= cq_mask - 1) {
+        cq_id = ctz64(cq_mask);
+        b = &n->cq_batch[cq_id];
+        if (b->len) {
+            cq_batch_write(b);
+        }
+        b->open = 0;
+        if (!b->nr_cqes) {
+            continue;
+        }
+        if (cq_id == ACQ_ID || !n->cq[cq_id].irq_enabled) {
+            cq_notify(n, cq_id, b->nr_cqes);
+        } else {
+            vector = n->cq[cq_id].vector;
+            assert(vector < NVME_MSIX_NVECTORS);
+            nr_cqes[vector] += b->nr_cqes;
+            vectors |= 1 << vector;
+        }
+        b->nr_cqes = 0;
+    }
 
+    for (vector = 0; vectors; vector++, vectors >>= 1) {
+        if (!(vectors & 1)) {
+            continue;
+        }
+        if (n->nr_iothreads) {
+            nvme_io_thread_notify(n, vector, nr_cqes[vector]);
+        } else {
+            nvme_irq_notify(n, vector, nr_cqes[vector]);
+        }
+    }
+}
 
+/* Account nr_cqes new I/O completions on a vector and raise its interrupt
+ * once the aggregation threshold of the Interrupt Coalescing feature is
+ * reached. Below the threshold the interrupt is delayed by at most the
+ * aggregation time; a zero time or a vector with coalescing disabled
+ * gets an interrupt right away. */
+void nvme_irq_notify(NVMEState *n, uint32_t vector, uint32_t nr_cqes)
+{
+    NVMEVector *v = &n->vectors[vector];
+    uint32_t ic = n->feature.interrupt_coalescing;
+    int64_t time = NVME_IC_TIME_NS(ic);
+
+    /* Create I/O CQ only takes vectors below nvectors */
+    assert(vector < NVME_MSIX_NVECTORS);
+    v->cqes += nr_cqes;
+    if (v->coalescing_disabled || time == 0 || v->cqes >= NVME_IC_THR(ic)) {
+        trace_nvme_irq_msix(n, vector, v->cqes);
+        v->cqes = 0;
+        msix_notify(&n->dev, vector);
+        return;
+    }
+    trace_nvme_irq_coalesce(n, vector, v->cqes);
+
+    if (n->irq_timer_target == 0) {
+        n->irq_timer_target = qemu_get_clock_ns(vm_clock) + time;
+        qemu_mod_timer(n->irq_timer, n->irq_timer_target);
+    }
+}
+
+/* Aggregation time elapsed: raise the interrupts still held back */
+void nvme_irq_timer_cb(void *opaque)
+{
+    NVMEState *n = opaque;
+    uint32_t vector;
+
+    n->irq_timer_target = 0;
+    for (vector = 0; vector < n->nvectors; vector++) {
+        if (n->vectors[vector].cqes) {
+            trace_nvme_irq_msix(n, vector, n->vectors[vector].cqes);
+            n->vectors[vector].cqes = 0;
+            msix_notify(&n->dev, vector);
+        }
+    }
+}
+
+/* Drop the held back interrupts and the per vector configuration */
+void nvme_irq_reset(NVMEState *n)
+{
+    qemu_del_timer(n->irq_timer);
+    n->irq_timer_target = 0;
+    memset(n->vectors, 0, sizeof(n->vectors));
+}
+
+/* Flag a SQ as having entries to fetch */
+void nvme_sq_ready(NVMEState *n, uint16_t sq_id)
+{
+    __sync_fetch_and_or(&n->sq_ready, 1ULL << sq_id);
+}
+
+/* Clear the ready flag of a drained SQ. A doorbell may have moved the tail
+ * meanwhile, so check again once the flag is clear. With a shadow
+ * doorbell, the EventIdx asks for a doorbell write on the next entry. */
+static void sq_idle(NVMEState *n, uint16_t sq_id)
+{
+    NVMEIOSQueue *sq = &n->sq[sq_id];
+
+    __sync_fetch_and_and(&n->sq_ready, ~(1ULL << sq_id));
+    if (sq->tail_addr) {
+        eventidx_write(sq->ei_addr, sq->tail);
+        nvme_shadow_read(sq->tail_addr, sq->size, &sq->tail);
+    }
+    if (sq->dma_addr && sq->head != sq->tail) {
+        nvme_sq_ready(n, sq_id);
+    }
+}
+
+/* Round robin: the first SQ of mask after the one served last */
+static uint16_t arb_rr(uint64_t mask, uint16_t *last)
+{
+    uint64_t after = 0;
+
+    if (*last < 63) {
+        after = mask & (~0ULL << (*last + 1));
+    }
+    *last = ctz64(after ? after : mask);
+    return *last;
+}
+
+/* Pick the next SQ to fetch from among the non empty SQs of mask. The admin
+ * SQ always comes first. With CC.AMS set to weighted round robin, urgent
+ * SQs come next, then high, medium and low priority SQs share the
+ * controller according to the weights of the Arbitration feature. Else
+ * all I/O SQs are served round robin. */
+static uint16_t arb_select(NVMEState *n, NVMEArbiter *arb, uint64_t mask)
+{
+    uint64_t class_mask[NVME_QPRIO_NR] = { 0 }, m;
+    uint32_t cc, arbitration = n->feature.arbitration;
+    uint16_t weight[NVME_QPRIO_NR];
+    int sq_id, c, round;
+
+    if (mask & (1ULL << ASQ_ID)) {
+        return ASQ_ID;
+    }
+
+    memcpy(&cc, &n->cntrl_reg[NVME_CC], DWORD);
+    if (((cc >> 11) & 0x7) != NVME_CC_AMS_WRR) {
+        return arb_rr(mask, &arb->last[0]);
+    }
+
+    for (m = mask; m; m &= m - 1) {
+        sq_id = ctz64(m);
+        class_mask[n->sq[sq_id].prio & 0x3] |= 1ULL << sq_id;
+    }
+    if (class_mask[NVME_QPRIO_URGENT]) {
+        return arb_rr(class_mask[NVME_QPRIO_URGENT],
+            &arb->last[NVME_QPRIO_URGENT]);
+    }
+
+    /* Weights are 0's based */
+    weight[NVME_QPRIO_HIGH] = ((arbitration >> 24) & 0xff) + 1;
+    weight[NVME_QPRIO_MEDIUM] = ((arbitration >> 16) & 0xff) + 1;
+    weight[NVME_QPRIO_LOW] = ((arbitration >> 8) & 0xff) + 1;
+    for (round = 0; round < 2; round++) {
+        for (c = NVME_QPRIO_HIGH; c <= NVME_QPRIO_LOW; c++) {
+            if (class_mask[c] && arb->credit[c]) {
+                arb->credit[c]--;
+                return arb_rr(class_mask[c], &arb->last[c]);
+            }
+        }
+        /* Every class with work has used its weight: start a new round */
+        for (c = NVME_QPRIO_HIGH; c <= NVME_QPRIO_LOW; c++) {
+            arb->credit[c] = weight[c];
+        }
+    }
+    return arb_rr(mask, &arb->last[0]);
+}
+
+/* Fetch and process the entries of the ready SQs of mask, at most budget of
+ * them, an arbitration burst at a time. SQs blocked on a full CQ are left
+ * flagged, the CQ head doorbell kicks them again. The CQs written to are
+ * added to *cq_mask. Returns 1 when the budget ran out with work left. */
+static uint8_t arbitrate(NVMEState *n, NVMEArbiter *arb, uint64_t mask,
+    uint32_t budget, uint64_t *cq_mask)
+{
+    NVMECmd sqes[NVME_SQE_BATCH];
+    uint64_t stalled = 0, ready;
+    uint32_t ab = n->feature.arbitration & 0x7;
+    uint32_t burst, i, nr, j;
+    uint16_t sq_id, pending;
+    NVMEIOSQueue *sq;
+
+    burst = (ab == NVME_ARB_AB_NOLIMIT) ? UINT32_MAX : 1 << ab;
+    for (;;) {
+        ready = n->sq_ready & mask & ~stalled;
+        if (!ready) {
+            return 0;
+        }
+        if (!budget) {
+            return 1;
+        }
+
+        sq_id = arb_select(n, arb, ready);
+        sq = &n->sq[sq_id];
+        if (sq->fused == NVME_FUSED_PENDING) {
+            /* The Compare completion kicks it again */
+            stalled |= 1ULL << sq_id;
+            continue;
+        }
+        if (sq->tail_addr) {
+            /* Entries posted without a doorbell write */
+            nvme_shadow_read(sq->tail_addr, sq->size, &sq->tail);
+        }
+        if (!sq->dma_addr || sq->head == sq->tail) {
+            sq_idle(n, sq_id);
+            continue;
+        }
+        n->cq_batch[sq->cq_id].open = 1;
+        *cq_mask |= 1ULL << sq->cq_id;
+        pending = sq_pending(sq);
+        if (pending > n->stats[sq_id].max_depth) {
+            n->stats[sq_id].max_depth = pending;
+        }
+
+        for (i = 0; i < burst && budget; i += nr) {
+            /* Only fetch the commands the CQ has room for */
+            nr = MIN(MIN(burst - i, budget), NVME_SQE_BATCH);
+            nr = MIN(nr, sq_pending(sq));
+            nr = MIN(nr, cq_free(n, sq->cq_id));
+            if (!nr) {
+                /* Only a full CQ stops a SQ with entries and budget */
+                trace_nvme_cq_full(n, sq_id, sq->cq_id);
+                n->stats[sq->cq_id].cq_full++;
+                stalled |= 1ULL << sq_id;
+                break;
+            }
+            sq_fetch(n, sq_id, sqes, nr);
+            /* The first command of a fused operation ends the batch: the
+             * SQ may be held until it completes. The entries after it are
+             * fetched again, no completion has reported them consumed. */
+            for (j = 0; j + 1 < nr; j++) {
+                if (NVME_FUSE(sqes[j].fuse) == NVME_FUSE_FIRST) {
+                    sq->head = (sq->head + sq->size + j + 2 - nr) %
+                        (sq->size + 1);
+                    nr = j + 1;
+                    break;
+                }
+            }
+            for (j = 0; j < nr; j++) {
+                process_sqe(n, sq_id, &sqes[j]);
+            }
+            budget -= nr;
+            if (sq->fused == NVME_FUSED_PENDING) {
+                stalled |= 1ULL << sq_id;
+                break;
+            }
+            if (!sq->dma_addr || sq->head == sq->tail) {
+                /* Drained, or deleted by an admin command just run */
+                sq_idle(n, sq_id);
+                break;
+            }
+        }
+    }
+}
+
+/* Run arbitrate() with the CQEs of the pass written back as a batch */
+uint8_t nvme_arbitrate(NVMEState *n, NVMEArbiter *arb, uint64_t mask,
+    uint32_t budget)
+{
+    uint64_t cq_mask = 0;
+    uint8_t ret;
+
+    ret = arbitrate(n, arb, mask, budget, &cq_mask);
+    nvme_cq_batch_flush(n, cq_mask);
+    return ret;
+}
@@ -0,0 +1,287 @@
+/*
+ * Copyright (c) 2011 Intel Corporation
+ *
+ * by Patrick Porlan <patrick.porlan@intel.com>
+ *    Nisheeth Bhat <nisheeth.bhat@intel.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ *
+ * This file deals with the host threads serving the I/O queue pairs.
+ * The I/O queues are spread over the threads by CQ ID, so all SQs feeding
+ * a CQ are served by the same thread and no queue is shared between
+ * threads. The admin queue stays with the main loop, which pauses the
+ * threads while it processes admin commands or resets the controller.
+ * With the io_uring engine each thread has its own ring and sleeps in it
+ * rather than on its condition variable.
+ */
+
+#include "nvme.h"
+#include "nvme_debug.h"
+#include "host-utils.h"
+
+/* Set in the I/O threads, which run without the global mutex */
+static __thread int in_io_thread;
+
+static uint16_t cq_io_thread(NVMEState *n, uint16_t cq_id)
+{
+    return (uint16_t)(cq_id - 1) % n->nr_iothreads;
+}
+
+/* Process the SQs owned by the thread until they are empty or blocked on
+ * a full CQ. */
+static void io_thread_drain(NVMEIOThread *t)
+{
+    NVMEState *n = t->n;
+    uint64_t mask, m;
+    uint16_t sq_id;
+
+    do {
+        mask = 0;
+        for (m = n->sq_ready & ~(1ULL << ASQ_ID); m; m &= m - 1) {
+            sq_id = ctz64(m);
+            if (cq_io_thread(n, n->sq[sq_id].cq_id) == t->index) {
+                mask |= 1ULL << sq_id;
+            }
+        }
+    } while (mask && nvme_arbitrate(n, &t->arb, mask, NVME_SQ_BUDGET_MAX));
+}
+
+static void *io_thread_run(void *opaque)
+{
+    NVMEIOThread *t = opaque;
+    NVMEState *n = t->n;
+    cpu_set_t cpus;
+    long nr_cpus;
+
+    in_io_thread = 1;
+    if (n->flags & NVME_FLAG_IOTHREAD_AFFINITY) {
+        nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        if (nr_cpus > 0) {
+            CPU_ZERO(&cpus);
+            CPU_SET(t->index % nr_cpus, &cpus);
+            if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus)) {
+                LOG_ERR("Unable to pin I/O thread %d", t->index);
+            }
+        }
+    }
+
+    qemu_mutex_lock(&t->lock);
+    while (t->state == TH_STARTED) {
+        if (t->paused || (!t->kicked && !t->uring)) {
+            qemu_cond_wait(&t->cond, &t->lock);
+            continue;
+        }
+        if (!t->kicked && !nvme_uring_ready(t->uring)) {
+            t->waiting = 1;
+            qemu_mutex_unlock(&t->lock);
+            nvme_uring_wait(t->uring);
+            qemu_mutex_lock(&t->lock);
+            t->waiting = 0;
+            continue;
+        }
+        t->kicked = 0;
+        t->busy = 1;
+        qemu_mutex_unlock(&t->lock);
+
+        if (t->uring) {
+            nvme_uring_complete(n, t->uring);
+        }
+        io_thread_drain(t);
+        if (t->uring) {
+            nvme_uring_submit(t->uring);
+        }
+
+        qemu_mutex_lock(&t->lock);
+        t->busy = 0;
+        /* Wake up a main loop waiting in nvme_io_thread_pause() */
+        qemu_cond_broadcast(&t->cond);
+    }
+    t->state = TH_EXIT;
+    qemu_mutex_unlock(&t->lock);
+    return NULL;
+}
+
+int nvme_in_io_thread(void)
+{
+    return in_io_thread;
+}
+
+/* Deliver the interrupts raised by the I/O threads */
+static void io_thread_irq_read(void *opaque)
+{
+    NVMEState *n = opaque;
+    uint32_t vectors, vector;
+    uint32_t cqes[NVME_MSIX_NVECTORS];
+
+    event_notifier_test_and_clear(&n->irq_notifier);
+
+    qemu_mutex_lock(&n->irq_lock);
+    vectors = n->pending_irqs;
+    n->pending_irqs = 0;
+    memcpy(cqes, n->pending_cqes, sizeof(cqes));
+    memset(n->pending_cqes, 0, sizeof(n->pending_cqes));
+    qemu_mutex_unlock(&n->irq_lock);
+
+    for (vector = 0; vectors; vector++, vectors >>= 1) {
+        if (vectors & 1) {
+            nvme_irq_notify(n, vector, cqes[vector]);
+        }
+    }
+}
+
+void nvme_io_thread_notify(NVMEState *n, uint32_t vector, uint32_t nr_cqes)
+{
+    uint32_t pending;
+
+    qemu_mutex_lock(&n->irq_lock);
+    pending = n->pending_irqs;
+    n->pending_irqs |= 1 << vector;
+    n->pending_cqes[vector] += nr_cqes;
+    qemu_mutex_unlock(&n->irq_lock);
+
+    if (!pending) {
+        event_notifier_set(&n->irq_notifier);
+    }
+}
+
+void nvme_io_thread_kick(NVMEState *n, uint16_t cq_id)
+{
+    NVMEIOThread *t = &n->iothreads[cq_io_thread(n, cq_id)];
+
+    qemu_mutex_lock(&t->lock);
+    if (t->waiting && !t->kicked) {
+        nvme_uring_kick(t->uring);
+    }
+    t->kicked = 1;
+    qemu_cond_signal(&t->cond);
+    qemu_mutex_unlock(&t->lock);
+}
+
+/* Ring the I/O of a SQ is queued on */
+NVMEUring *nvme_sq_uring(NVMEState *n, uint16_t sq_id)
+{
+    if (!n->nr_iothreads) {
+        return n->uring;
+    }
+    return n->iothreads[cq_io_thread(n, n->sq[sq_id].cq_id)].uring;
+}
+
+/* Wait until no I/O thread touches the queues and keep them off */
+void nvme_io_thread_pause(NVMEState *n)
+{
+    uint32_t i;
+
+    for (i = 0; i < n->nr_iothreads; i++) {
+        NVMEIOThread *t = &n->iothreads[i];
+
+        qemu_mutex_lock(&t->lock);
+        t->paused = 1;
+        while (t->busy) {
+            qemu_cond_wait(&t->cond, &t->lock);
+        }
+        qemu_mutex_unlock(&t->lock);
+    }
+}
+
+void nvme_io_thread_resume(NVMEState *n)
+{
+    uint32_t i;
+
+    for (i = 0; i < n->nr_iothreads; i++) {
+        NVMEIOThread *t = &n->iothreads[i];
+
+        qemu_mutex_lock(&t->lock);
+        t->paused = 0;
+        /* Doorbells rung while paused are still pending */
+        qemu_cond_broadcast(&t->cond);
+        qemu_mutex_unlock(&t->lock);
+    }
+}
+
+int nvme_init_io_thread(NVMEState *n)
+{
+    uint32_t i;
+    int ret;
+
+    if (n->nr_iothreads >= NVME_MAX_QID) {
+        LOG_ERR("iothreads must be lower than %d", NVME_MAX_QID);
+        return FAIL;
+    }
+
+    ret = event_notifier_init(&n->irq_notifier, 0);
+    if (ret < 0) {
+        LOG_ERR("Unable to create the I/O thread notifier: %d", ret);
+        return FAIL;
+    }
+    qemu_mutex_init(&n->irq_lock);
+    n->pending_irqs = 0;
+    memset(n->pending_cqes, 0, sizeof(n->pending_cqes));
+    qemu_set_fd_handler(event_notifier_get_fd(&n->irq_notifier),
+        io_thread_irq_read, NULL, n);
+
+    n->iothreads = qemu_mallocz(n->nr_iothreads * sizeof(NVMEIOThread));
+    for (i = 0; i < n->nr_iothreads; i++) {
+        NVMEIOThread *t = &n->iothreads[i];
+
+        t->n = n;
+        t->index = i;
+        if (n->flags & NVME_FLAG_URING) {
+            t->uring = nvme_uring_new(n, 1);
+            if (!t->uring) {
+                return FAIL;
+            }
+        }
+        t->state = TH_STARTED;
+        qemu_mutex_init(&t->lock);
+        qemu_cond_init(&t->cond);
+        qemu_thread_create(&t->thread, io_thread_run, t);
+    }
+    LOG_NORM("Started %u I/O threads%s", n->nr_iothreads,
+        (n->flags & NVME_FLAG_URING) ? " with io_uring" : "");
+    return 0;
+}
+
+void nvme_exit_io_thread(NVMEState *n)
+{
+    uint32_t i;
+
+    if (!n->iothreads) {
+        return;
+    }
+
+    for (i = 0; i < n->nr_iothreads; i++) {
+        NVMEIOThread *t = &n->iothreads[i];
+
+        qemu_mutex_lock(&t->lock);
+        t->state = TH_STOP;
+        if (t->waiting) {
+            nvme_uring_kick(t->uring);
+        }
+        qemu_cond_broadcast(&t->cond);
+        qemu_mutex_unlock(&t->lock);
+        qemu_thread_join(&t->thread);
+        qemu_cond_destroy(&t->cond);
+        qemu_mutex_destroy(&t->lock);
+        if (t->uring) {
+            nvme_uring_cancel(n, t->uring, NVME_MAX_QID);
+            nvme_uring_free(t->uring);
+        }
+    }
+    qemu_free(n->iothreads);
+    n->iothreads = NULL;
+
+    qemu_set_fd_handler(event_notifier_get_fd(&n->irq_notifier),
+        NULL, NULL, NULL);
+    event_notifier_cleanup(&n->irq_notifier);
+    qemu_mutex_destroy(&n->irq_lock);
+}
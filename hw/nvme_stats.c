@@ -0,0 +1,399 @@
+/*
+ * Copyright (c) 2011 Intel Corporation
+ *
+ * by Patrick Porlan <patrick.porlan@intel.com>
+ *    Nisheeth Bhat <nisheeth.bhat@intel.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ *
+ * This file deals with the statistics of the controllers, reported by the
+ * "info nvme" monitor command and query-nvme, and with the counters of the
+ * SMART / Health and Error Information log pages. The counters of a queue
+ * ID are only updated by the context serving the queue, the I/O threads
+ * are paused while the monitor reads them.
+ */
+
+#include "nvme.h"
+#include "nvme_debug.h"
+#include "host-utils.h"
+#include "monitor.h"
+#include "qint.h"
+#include "qbool.h"
+#include "qlist.h"
+#include "qdict.h"
+#include "qstring.h"
+#include "trace.h"
+
+static QTAILQ_HEAD(, NVMEState) nvme_devices =
+    QTAILQ_HEAD_INITIALIZER(nvme_devices);
+
+static const char *stats_io_names[NVME_STATS_OPCODES] = {
+    [NVME_CMD_FLUSH] = "flush",
+    [NVME_CMD_WRITE] = "write",
+    [NVME_CMD_READ] = "read",
+    [NVME_CMD_COMPARE] = "compare",
+    [NVME_CMD_WRITE_ZEROES] = "write-zeroes",
+    [NVME_CMD_DSM] = "dsm",
+};
+
+static const char *stats_admin_names[NVME_STATS_OPCODES] = {
+    [NVME_ADM_CMD_DELETE_SQ] = "delete-sq",
+    [NVME_ADM_CMD_CREATE_SQ] = "create-sq",
+    [NVME_ADM_CMD_GET_LOG_PAGE] = "get-log-page",
+    [NVME_ADM_CMD_DELETE_CQ] = "delete-cq",
+    [NVME_ADM_CMD_CREATE_CQ] = "create-cq",
+    [NVME_ADM_CMD_IDENTIFY] = "identify",
+    [NVME_ADM_CMD_ABORT] = "abort",
+    [NVME_ADM_CMD_SET_FEATURES] = "set-features",
+    [NVME_ADM_CMD_GET_FEATURES] = "get-features",
+    [NVME_ADM_CMD_ASYNC_EV_REQ] = "async-event",
+};
+
+/* Add an entry to the Error Information log. Errors are rare, the log is
+ * shared by all the queues under error_lock. */
+static void stats_log_error(NVMEState *n, uint16_t sq_id, NVMECmd *sqe,
+    NVMECQE *cqe)
+{
+    struct NVME_rw *rw = (struct NVME_rw *)sqe;
+    NVMEErrorLogEntry *e;
+
+    qemu_mutex_lock(&n->error_lock);
+    e = &n->error_log[n->error_count++ % NVME_ERROR_LOG_ENTRIES];
+    memset(e, 0, sizeof(*e));
+    e->error_count = n->error_count;
+    e->sqid = sq_id;
+    e->cid = sqe->cid;
+    e->status = (cqe->status & ~1) | n->cq[n->sq[sq_id].cq_id].phase_tag;
+    e->param_error_location = 0xffff;
+    e->nsid = sqe->nsid;
+    if (sq_id != ASQ_ID && (sqe->opcode == NVME_CMD_READ ||
+        sqe->opcode == NVME_CMD_WRITE || sqe->opcode == NVME_CMD_COMPARE ||
+        sqe->opcode == NVME_CMD_WRITE_ZEROES)) {
+        e->lba = rw->slba;
+    }
+    qemu_mutex_unlock(&n->error_lock);
+}
+
+/* Account a command completing with cqe, start being get_clock() when it
+ * was fetched from its SQ */
+void nvme_stats_done(NVMEState *n, uint16_t sq_id, NVMECmd *sqe,
+    NVMECQE *cqe, int64_t start)
+{
+    NVMEQueueStats *st = &n->stats[sq_id];
+    NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
+    struct NVME_rw *e = (struct NVME_rw *)sqe;
+    NVMENamespace *ns;
+    NVMELatHist *h;
+    int64_t now = get_clock();
+    uint64_t lat = now - start, us;
+    int b;
+
+    trace_nvme_cmd_complete(n, sq_id, sqe->cid, sqe->opcode, cqe->status,
+        lat);
+    if (sq_id != ASQ_ID && st->outstanding && !--st->outstanding) {
+        st->busy_ns += now - st->busy_start;
+    }
+
+    if (sf->sc || sf->sct) {
+        st->errors++;
+        if (sf->sct == NVME_SCT_MEDIA_ERR) {
+            st->media_errors++;
+        }
+        stats_log_error(n, sq_id, sqe, cqe);
+    } else if (sq_id != ASQ_ID && (sqe->opcode == NVME_CMD_READ ||
+        sqe->opcode == NVME_CMD_WRITE || sqe->opcode == NVME_CMD_COMPARE)) {
+        ns = nvme_ns(n, sqe->nsid);
+        if (ns) {
+            if (sqe->opcode == NVME_CMD_WRITE) {
+                st->write_bytes += (uint64_t)(e->nlb + 1) << ns->lba_shift;
+                st->write_cmds++;
+            } else {
+                st->read_bytes += (uint64_t)(e->nlb + 1) << ns->lba_shift;
+                st->read_cmds++;
+            }
+        }
+    }
+
+    if (sqe->opcode >= NVME_STATS_OPCODES) {
+        return;
+    }
+    h = &st->lat[sqe->opcode];
+    h->count++;
+    h->total_ns += lat;
+    if (lat > h->max_ns) {
+        h->max_ns = lat;
+    }
+    us = lat / 1000;
+    b = us ? 64 - clz64(us) : 0;
+    h->bucket[MIN(b, NVME_STATS_LAT_BUCKETS - 1)]++;
+}
+
+/* Commands of sq_id, or of all SQs when it is NVME_MAX_QID, were dropped
+ * without completion */
+void nvme_stats_cancel(NVMEState *n, uint16_t sq_id)
+{
+    NVMEQueueStats *st;
+    uint16_t qid;
+
+    for (qid = 1; qid < NVME_MAX_QID; qid++) {
+        st = &n->stats[qid];
+        if ((sq_id != NVME_MAX_QID && qid != sq_id) || !st->outstanding) {
+            continue;
+        }
+        st->busy_ns += get_clock() - st->busy_start;
+        st->outstanding = 0;
+    }
+}
+
+/* Fill the counters of the SMART / Health log. The I/O queues keep
+ * running, the counters are read as they go. */
+void nvme_stats_smart(NVMEState *n, NVMESmartLog *smart)
+{
+    NVMEQueueStats *st;
+    uint64_t read_bytes = 0, write_bytes = 0, busy_ns = 0;
+    int64_t now = get_clock();
+    uint16_t qid;
+
+    for (qid = 1; qid < NVME_MAX_QID; qid++) {
+        st = &n->stats[qid];
+        read_bytes += st->read_bytes;
+        write_bytes += st->write_bytes;
+        smart->host_read_commands[0] += st->read_cmds;
+        smart->host_write_commands[0] += st->write_cmds;
+        smart->media_errors[0] += st->media_errors;
+        busy_ns += st->busy_ns;
+        if (st->outstanding) {
+            busy_ns += now - st->busy_start;
+        }
+    }
+    /* Units of 1000 512 bytes blocks, rounded up */
+    smart->data_units_read[0] = (read_bytes + 511999) / 512000;
+    smart->data_units_written[0] = (write_bytes + 511999) / 512000;
+    smart->controller_busy_time[0] = busy_ns / (60 * 1000000000ULL);
+    smart->power_cycles[0] = 1;
+    smart->power_on_hours[0] = (now - n->start_time) /
+        (3600 * 1000000000ULL);
+    smart->number_of_error_info_log_entries[0] = n->error_count;
+}
+
+static QObject *stats_queue(NVMEState *n, uint16_t qid)
+{
+    NVMEQueueStats *st = &n->stats[qid];
+    NVMEIOSQueue *sq = &n->sq[qid];
+    QDict *q = qdict_new();
+
+    qdict_put(q, "qid", qint_from_int(qid));
+    qdict_put(q, "commands", qint_from_int(st->commands));
+    qdict_put(q, "errors", qint_from_int(st->errors));
+    qdict_put(q, "read-bytes", qint_from_int(st->read_bytes));
+    qdict_put(q, "write-bytes", qint_from_int(st->write_bytes));
+    qdict_put(q, "sq-depth", qint_from_int(sq->dma_addr ?
+        (sq->tail + sq->size + 1 - sq->head) % (sq->size + 1) : 0));
+    qdict_put(q, "sq-max-depth", qint_from_int(st->max_depth));
+    qdict_put(q, "completions", qint_from_int(st->completions));
+    qdict_put(q, "inflight", qint_from_int(n->cq[qid].inflight));
+    qdict_put(q, "max-inflight", qint_from_int(st->max_inflight));
+    qdict_put(q, "cq-full", qint_from_int(st->cq_full));
+    return QOBJECT(q);
+}
+
+/* Histogram of an opcode over all the queues, NULL if it never ran */
+static QObject *stats_latency(NVMEState *n, int admin, int opcode)
+{
+    NVMELatHist sum;
+    NVMELatHist *h;
+    QList *buckets;
+    QDict *l;
+    uint16_t qid;
+    int b;
+
+    memset(&sum, 0, sizeof(sum));
+    for (qid = 0; qid < NVME_MAX_QID; qid++) {
+        if ((qid == ASQ_ID) != admin) {
+            continue;
+        }
+        h = &n->stats[qid].lat[opcode];
+        sum.count += h->count;
+        sum.total_ns += h->total_ns;
+        sum.max_ns = MAX(sum.max_ns, h->max_ns);
+        for (b = 0; b < NVME_STATS_LAT_BUCKETS; b++) {
+            sum.bucket[b] += h->bucket[b];
+        }
+    }
+    if (!sum.count) {
+        return NULL;
+    }
+
+    l = qdict_new();
+    qdict_put(l, "admin", qbool_from_int(admin));
+    qdict_put(l, "opcode", qint_from_int(opcode));
+    if ((admin ? stats_admin_names : stats_io_names)[opcode]) {
+        qdict_put(l, "name", qstring_from_str((admin ? stats_admin_names :
+            stats_io_names)[opcode]));
+    }
+    qdict_put(l, "count", qint_from_int(sum.count));
+    qdict_put(l, "total-ns", qint_from_int(sum.total_ns));
+    qdict_put(l, "max-ns", qint_from_int(sum.max_ns));
+    buckets = qlist_new();
+    for (b = 0; b < NVME_STATS_LAT_BUCKETS; b++) {
+        qlist_append(buckets, qint_from_int(sum.bucket[b]));
+    }
+    qdict_put(l, "histogram", buckets);
+    return QOBJECT(l);
+}
+
+static QObject *stats_device(NVMEState *n)
+{
+    QList *queues = qlist_new(), *latency = qlist_new();
+    QObject *obj;
+    QDict *d = qdict_new();
+    uint16_t qid;
+    int admin, opcode;
+    char addr[16];
+
+    snprintf(addr, sizeof(addr), "%02x.%x", PCI_SLOT(n->dev.devfn),
+        PCI_FUNC(n->dev.devfn));
+    qdict_put(d, "addr", qstring_from_str(addr));
+    if (n->dev.qdev.id) {
+        qdict_put(d, "id", qstring_from_str(n->dev.qdev.id));
+    }
+
+    for (qid = 0; qid < NVME_MAX_QID; qid++) {
+        if (qid == ASQ_ID || n->sq[qid].dma_addr || n->cq[qid].dma_addr) {
+            qlist_append_obj(queues, stats_queue(n, qid));
+        }
+    }
+    qdict_put(d, "queues", queues);
+
+    for (admin = 1; admin >= 0; admin--) {
+        for (opcode = 0; opcode < NVME_STATS_OPCODES; opcode++) {
+            obj = stats_latency(n, admin, opcode);
+            if (obj) {
+                qlist_append_obj(latency, obj);
+            }
+        }
+    }
+    qdict_put(d, "latency", latency);
+    return QOBJECT(d);
+}
+
+static void stats_info(Monitor *mon, QObject **ret_data)
+{
+    QList *devices = qlist_new();
+    NVMEState *n;
+
+    QTAILQ_FOREACH(n, &nvme_devices, stats_entry) {
+        nvme_io_thread_pause(n);
+        qlist_append_obj(devices, stats_device(n));
+        nvme_io_thread_resume(n);
+    }
+    *ret_data = QOBJECT(devices);
+}
+
+static void stats_print_latency(Monitor *mon, QDict *l)
+{
+    QListEntry *e;
+    uint64_t count = qdict_get_int(l, "count");
+    int b = 0;
+
+    if (qdict_haskey(l, "name")) {
+        monitor_printf(mon, "  %-13s", qdict_get_str(l, "name"));
+    } else {
+        monitor_printf(mon, "  %s 0x%02x   ", qdict_get_bool(l, "admin") ?
+            "admin" : "io   ", (int)qdict_get_int(l, "opcode"));
+    }
+    monitor_printf(mon, " %10"PRIu64" %10.1f %10.1f\n", count,
+        qdict_get_int(l, "total-ns") / 1000.0 / count,
+        qdict_get_int(l, "max-ns") / 1000.0);
+
+    monitor_printf(mon, "   ");
+    QLIST_FOREACH_ENTRY(qdict_get_qlist(l, "histogram"), e) {
+        count = qint_get_int(qobject_to_qint(qlist_entry_obj(e)));
+        if (count) {
+            if (b == NVME_STATS_LAT_BUCKETS - 1) {
+                monitor_printf(mon, " >=%"PRIu64":%"PRIu64,
+                    (uint64_t)1 << (b - 1), count);
+            } else {
+                monitor_printf(mon, " <%"PRIu64":%"PRIu64, (uint64_t)1 << b,
+                    count);
+            }
+        }
+        b++;
+    }
+    monitor_printf(mon, "\n");
+}
+
+static void stats_print(Monitor *mon, const QObject *data)
+{
+    QListEntry *dev, *e;
+    QDict *d, *q;
+
+    if (qlist_empty(qobject_to_qlist(data))) {
+        monitor_printf(mon, "No NVMe controller\n");
+        return;
+    }
+
+    QLIST_FOREACH_ENTRY(qobject_to_qlist(data), dev) {
+        d = qobject_to_qdict(qlist_entry_obj(dev));
+        monitor_printf(mon, "NVMe controller at %s", qdict_get_str(d, "addr"));
+        if (qdict_haskey(d, "id")) {
+            monitor_printf(mon, ", id \"%s\"", qdict_get_str(d, "id"));
+        }
+        monitor_printf(mon, "\n  qid   commands errors    read MB   write MB"
+            "  sq depth/max  inflight/max  cq full\n");
+        QLIST_FOREACH_ENTRY(qdict_get_qlist(d, "queues"), e) {
+            q = qobject_to_qdict(qlist_entry_obj(e));
+            monitor_printf(mon, "  %3"PRId64" %10"PRId64" %6"PRId64
+                " %10"PRId64" %10"PRId64" %8"PRId64"/%-5"PRId64
+                " %8"PRId64"/%-5"PRId64" %7"PRId64"\n",
+                qdict_get_int(q, "qid"), qdict_get_int(q, "commands"),
+                qdict_get_int(q, "errors"),
+                qdict_get_int(q, "read-bytes") >> 20,
+                qdict_get_int(q, "write-bytes") >> 20,
+                qdict_get_int(q, "sq-depth"),
+                qdict_get_int(q, "sq-max-depth"),
+                qdict_get_int(q, "inflight"),
+                qdict_get_int(q, "max-inflight"),
+                qdict_get_int(q, "cq-full"));
+        }
+        monitor_printf(mon, "  latency           count     avg us     max us"
+            "  (histogram: upper bound us:count)\n");
+        QLIST_FOREACH_ENTRY(qdict_get_qlist(d, "latency"), e) {
+            stats_print_latency(mon, qobject_to_qdict(qlist_entry_obj(e)));
+        }
+    }
+}
+
+void nvme_stats_init(NVMEState *n)
+{
+    n->stats = qemu_mallocz(NVME_MAX_QID * sizeof(NVMEQueueStats));
+    n->start_time = get_clock();
+    n->error_log = qemu_mallocz(NVME_ERROR_LOG_ENTRIES *
+        sizeof(NVMEErrorLogEntry));
+    qemu_mutex_init(&n->error_lock);
+    QTAILQ_INSERT_TAIL(&nvme_devices, n, stats_entry);
+    monitor_set_nvme_handlers(stats_info, stats_print);
+}
+
+void nvme_stats_exit(NVMEState *n)
+{
+    if (!n->stats) {
+        return;
+    }
+    QTAILQ_REMOVE(&nvme_devices, n, stats_entry);
+    qemu_free(n->stats);
+    n->stats = NULL;
+    qemu_free(n->error_log);
+    n->error_log = NULL;
+    qemu_mutex_destroy(&n->error_lock);
+}
@@ -20,209 +20,1873 @@
 
 #include "nvme.h"
 #include "nvme_debug.h"
+#include "block_int.h"
+#include "bitmap.h"
+#include "trace.h"
 #include <sys/mman.h>
 
+/* Backing file of namespace 1, the others get a _ns<nsid> suffix */
 #define NVME_STORAGE_FILE_NAME "nvme_store.img"
+#define NVME_STORAGE_FILE_FMT "nvme_store_ns%u.img"
 #define PAGE_SIZE 4096
+/* Write Zeroes to a drive writes this much at a time */
+#define NVME_ZERO_BUF_SIZE (1024 * 1024)
 
+static const uint8_t nvme_zero_page[PAGE_SIZE]
+    __attribute__((aligned(PAGE_SIZE)));
+/* Never written, in the BSS like the bit bucket */
+static uint8_t nvme_zero_buf[NVME_ZERO_BUF_SIZE]
+    __attribute__((aligned(PAGE_SIZE)));
 
+/* SGL Bit Buckets are ranges of a QEMUSGList with this base. Read data
+ * they cover lands in nvme_bit_bucket, the host doesn't want it. */
+#define NVME_SG_BIT_BUCKET ((target_phys_addr_t)-1)
+#define NVME_BIT_BUCKET_SIZE (64 * 1024)
+/* Bounds the walk of a SGL whose segments loop */
+#define NVME_SGL_MAX_DESC 65536
+
+static uint8_t nvme_bit_bucket[NVME_BIT_BUCKET_SIZE]
+    __attribute__((aligned(PAGE_SIZE)));
+
+static const char *nvme_io_modes[] = {
+    [NVME_IO_MMAP] = "mmap",
+    [NVME_IO_BUFFERED] = "buffered",
+    [NVME_IO_DIRECT] = "direct",
+};
+
+/* Whether the guest range is RAM. Anything else dispatches to device
+ * callbacks that need the global mutex, which the I/O threads don't hold. */
+int nvme_addr_is_ram(target_phys_addr_t addr, target_phys_addr_t len)
+{
+    target_phys_addr_t end = addr + len;
+
+    if (end < addr) {
+        return 0;
+    }
+    for (addr &= ~(target_phys_addr_t)(PAGE_SIZE - 1); addr < end;
+        addr += PAGE_SIZE) {
+        if ((cpu_get_physical_page_desc(addr) & (PAGE_SIZE - 1)) !=
+            IO_MEM_RAM) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* An I/O thread reads zeroes from guest ranges that are not RAM and
+ * doesn't write to them */
 void nvme_dma_mem_read(target_phys_addr_t addr, uint8_t *buf, int len)
 {
+    if (nvme_in_io_thread() && !nvme_addr_is_ram(addr, len)) {
+        memset(buf, 0, len);
+        return;
+    }
     cpu_physical_memory_rw(addr, buf, len, 0);
 }
 
 void nvme_dma_mem_write(target_phys_addr_t addr, uint8_t *buf, int len)
 {
+    if (nvme_in_io_thread() && !nvme_addr_is_ram(addr, len)) {
+        return;
+    }
     cpu_physical_memory_rw(addr, buf, len, 1);
 }
 
-static uint8_t do_rw_prp(NVMEState *n, uint64_t mem_addr, uint64_t data_size,
-             uint64_t file_offset, uint8_t rw)
+/* Append a guest range or a bit bucket to qsg, merging it with the
+ * previous entry when the pages are physically adjacent or both are bit
+ * buckets. */
+static void nvme_sg_add(QEMUSGList *qsg, target_phys_addr_t addr,
+    target_phys_addr_t len)
+{
+    ScatterGatherEntry *last;
+
+    if (qsg->nsg) {
+        last = &qsg->sg[qsg->nsg - 1];
+        if (addr == NVME_SG_BIT_BUCKET ? last->base == addr :
+            (last->base != NVME_SG_BIT_BUCKET &&
+             last->base + last->len == addr)) {
+            last->len += len;
+            qsg->size += len;
+            return;
+        }
+    }
+    qemu_sglist_add(qsg, addr, len);
+}
+
+/* Build the list of guest ranges described by the PRP entries of a command
+ * transferring len bytes, in pages of CC.MPS. PRP1 may start anywhere in a
+ * page, every other entry must be page aligned. PRP2 is a pointer to a PRP
+ * list when the transfer spans more than two pages; the last entry of a
+ * list page then points to the next list page if more than one page is
+ * left. The list is read a run of at most prp_list entries at a time.
+ * qsg must be initialized, it is emptied first and keeps its array, so
+ * the lists of the request pool are reused without allocating. */
+static uint8_t nvme_map_prp(NVMEState *n, QEMUSGList *qsg, uint64_t prp1,
+    uint64_t prp2, uint32_t len)
+{
+    uint64_t prp_list[PAGE_SIZE / sizeof(uint64_t)];
+    uint32_t pg = nvme_page_size(n);
+    uint32_t trans_len, nents, left, i;
+    uint64_t addr;
+
+    qsg->nsg = 0;
+    qsg->size = 0;
+
+    trans_len = pg - (prp1 & (pg - 1));
+    trans_len = MIN(len, trans_len);
+    nvme_sg_add(qsg, prp1, trans_len);
+    len -= trans_len;
+    if (!len) {
+        return 0;
+    }
+
+    if (!prp2) {
+        goto fail;
+    }
+
+    if (len <= pg) {
+        if (prp2 & (pg - 1)) {
+            goto fail;
+        }
+        nvme_sg_add(qsg, prp2, len);
+        return 0;
+    }
+
+    if (prp2 & (sizeof(uint64_t) - 1)) {
+        goto fail;
+    }
+    addr = prp2;
+    /* Entries from addr to the end of its list page */
+    left = (pg - (prp2 & (pg - 1))) / sizeof(uint64_t);
+    while (len) {
+        nents = MIN(left, ARRAY_SIZE(prp_list));
+        nents = MIN(nents, (len + pg - 1) / pg);
+        nvme_addr_read(n, addr, (uint8_t *)prp_list, nents * sizeof(uint64_t));
+        addr += nents * sizeof(uint64_t);
+        left -= nents;
+
+        for (i = 0; i < nents; i++) {
+            if (!left && i == nents - 1 && len > pg) {
+                /* Chain to the next list page */
+                if (prp_list[i] & (pg - 1)) {
+                    goto fail;
+                }
+                addr = prp_list[i];
+                left = pg / sizeof(uint64_t);
+                break;
+            }
+            if (!prp_list[i] || (prp_list[i] & (pg - 1))) {
+                goto fail;
+            }
+            trans_len = MIN(len, pg);
+            nvme_sg_add(qsg, prp_list[i], trans_len);
+            len -= trans_len;
+        }
+    }
+    return 0;
+
+fail:
+    trace_nvme_err_prp(prp1, prp2);
+    return FAIL;
+}
+
+/* Add the range of a Data Block or Bit Bucket descriptor to qsg, *len
+ * being what the SGL still has to describe */
+static uint8_t nvme_sgl_add(QEMUSGList *qsg, NVMESglDesc *d, uint32_t *len,
+    int bit_bucket, NVMEStatusField *sf)
+{
+    uint8_t type = NVME_SGL_TYPE(d->type);
+
+    if (NVME_SGL_SUBTYPE(d->type) || (type == NVME_SGL_BIT_BUCKET ?
+        !bit_bucket : type != NVME_SGL_DATA_BLOCK)) {
+        sf->sc = NVME_SC_SGL_DESC_TYPE_INVALID;
+        return FAIL;
+    }
+    if (d->len > *len || (type == NVME_SGL_DATA_BLOCK &&
+        d->addr + d->len < d->addr)) {
+        sf->sc = NVME_SC_SGL_DATA_LEN_INVALID;
+        return FAIL;
+    }
+    if (d->len) {
+        nvme_sg_add(qsg, type == NVME_SGL_DATA_BLOCK ? d->addr :
+            NVME_SG_BIT_BUCKET, d->len);
+        *len -= d->len;
+    }
+    return 0;
+}
+
+/* Build the list of guest ranges described by a SGL transferring len
+ * bytes. The descriptor of the command is the only Data Block, or points
+ * to the first segment. The last descriptor of a segment may point to the
+ * next one, up to a Last Segment. Bit Buckets are only taken for data
+ * going to the host. qsg must be initialized, as for nvme_map_prp(). */
+static uint8_t nvme_map_sgl(NVMEState *n, QEMUSGList *qsg, NVMESglDesc *sgl,
+    uint32_t len, int bit_bucket, NVMEStatusField *sf)
+{
+    NVMESglDesc seg[PAGE_SIZE / sizeof(NVMESglDesc)], d = *sgl;
+    uint32_t nr, run, i, nr_desc = 0;
+    uint64_t addr;
+    uint8_t type = NVME_SGL_TYPE(d.type);
+
+    qsg->nsg = 0;
+    qsg->size = 0;
+
+    if (type == NVME_SGL_DATA_BLOCK || type == NVME_SGL_BIT_BUCKET) {
+        if (nvme_sgl_add(qsg, &d, &len, bit_bucket, sf) == FAIL) {
+            goto fail;
+        }
+        goto done;
+    }
+
+    while (type == NVME_SGL_SEGMENT || type == NVME_SGL_LAST_SEGMENT) {
+        if (NVME_SGL_SUBTYPE(d.type) || !d.len || d.len % sizeof(d)) {
+            sf->sc = NVME_SC_SGL_SEG_DESC_INVALID;
+            goto fail;
+        }
+        addr = d.addr;
+        nr = d.len / sizeof(d);
+        if ((nr_desc += nr) > NVME_SGL_MAX_DESC) {
+            sf->sc = NVME_SC_SGL_NR_DESC_INVALID;
+            goto fail;
+        }
+        while (nr) {
+            run = MIN(nr, ARRAY_SIZE(seg));
+            nvme_addr_read(n, addr, (uint8_t *)seg, run * sizeof(d));
+            addr += run * sizeof(d);
+            nr -= run;
+            for (i = 0; i < run; i++) {
+                if (!nr && i == run - 1 && type == NVME_SGL_SEGMENT) {
+                    /* The last descriptor of a Segment leads to the next
+                     * segment */
+                    d = seg[i];
+                    break;
+                }
+                if (nvme_sgl_add(qsg, &seg[i], &len, bit_bucket, sf) ==
+                    FAIL) {
+                    goto fail;
+                }
+            }
+        }
+        if (type == NVME_SGL_LAST_SEGMENT) {
+            goto done;
+        }
+        type = NVME_SGL_TYPE(d.type);
+    }
+    sf->sc = NVME_SC_SGL_DESC_TYPE_INVALID;
+    goto fail;
+
+done:
+    if (!len) {
+        return 0;
+    }
+    sf->sc = NVME_SC_SGL_DATA_LEN_INVALID;
+fail:
+    trace_nvme_err_sgl(sgl->addr, sgl->len, sgl->type, sf->sc);
+    return FAIL;
+}
+
+/* Whether all the guest ranges of qsg are RAM, Bit Buckets aside */
+static int nvme_sg_is_ram(QEMUSGList *qsg)
+{
+    int i;
+
+    for (i = 0; i < qsg->nsg; i++) {
+        if (qsg->sg[i].base != NVME_SG_BIT_BUCKET &&
+            !nvme_addr_is_ram(qsg->sg[i].base, qsg->sg[i].len)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Build the guest ranges of the data of an I/O command, from its PRPs or
+ * its SGL as PSDT selects. Bit Buckets are taken for Reads only. An I/O
+ * thread fails the command when the data is not all in guest RAM. */
+static uint8_t nvme_map_dptr(NVMEState *n, QEMUSGList *qsg, NVMECmd *sqe,
+    uint32_t len, NVMEStatusField *sf)
+{
+    switch (NVME_PSDT(sqe->fuse)) {
+    case NVME_PSDT_PRP:
+        if (nvme_map_prp(n, qsg, sqe->prp1, sqe->prp2, len) == FAIL) {
+            sf->sc = NVME_SC_INVALID_FIELD;
+            return FAIL;
+        }
+        break;
+    case NVME_PSDT_SGL:
+    case NVME_PSDT_SGL_MPTR:
+        /* No metadata, MPTR is ignored */
+        if (nvme_map_sgl(n, qsg, (NVMESglDesc *)&sqe->prp1, len,
+            sqe->opcode == NVME_CMD_READ, sf) == FAIL) {
+            return FAIL;
+        }
+        break;
+    default:
+        sf->sc = NVME_SC_INVALID_FIELD;
+        return FAIL;
+    }
+    if (nvme_in_io_thread() && !nvme_sg_is_ram(qsg)) {
+        sf->sc = NVME_SC_DATA_XFER_ERROR;
+        return FAIL;
+    }
+    return 0;
+}
+
+/* Copy len bytes between the host buffer buf and the guest ranges of qsg,
+ * starting skip bytes into them. Ranges mapping to guest RAM are copied
+ * directly, the others go through cpu_physical_memory_rw(). A NULL buf
+ * fills the guest ranges with zeroes. */
+static void nvme_sg_copy_part(QEMUSGList *qsg, uint64_t skip, uint8_t *buf,
+    uint64_t len, int to_guest)
+{
+    target_phys_addr_t addr, seg, plen;
+    uint8_t *mem;
+    int i;
+
+    for (i = 0; i < qsg->nsg && len; i++) {
+        if (skip >= qsg->sg[i].len) {
+            skip -= qsg->sg[i].len;
+            continue;
+        }
+        addr = qsg->sg[i].base + skip;
+        seg = MIN(qsg->sg[i].len - skip, len);
+        skip = 0;
+        len -= seg;
+        if (qsg->sg[i].base == NVME_SG_BIT_BUCKET ||
+            (nvme_in_io_thread() && !nvme_addr_is_ram(addr, seg))) {
+            /* Data the host discards, or that an I/O thread can't reach */
+            if (buf) {
+                buf += seg;
+            }
+            continue;
+        }
+        while (seg) {
+            plen = seg;
+            mem = cpu_physical_memory_map(addr, &plen, to_guest);
+            if (!mem) {
+                plen = buf ? seg : MIN(seg, PAGE_SIZE);
+                cpu_physical_memory_rw(addr, buf ? buf : (uint8_t *)nvme_zero_page,
+                    plen, to_guest);
+            } else {
+                if (!buf) {
+                    memset(mem, 0, plen);
+                } else if (to_guest) {
+                    memcpy(mem, buf, plen);
+                } else {
+                    memcpy(buf, mem, plen);
+                }
+                cpu_physical_memory_unmap(mem, plen, to_guest,
+                    to_guest ? plen : 0);
+            }
+            addr += plen;
+            seg -= plen;
+            if (buf) {
+                buf += plen;
+            }
+        }
+    }
+}
+
+/* Copy between the guest ranges of qsg and the host buffer buf */
+static void nvme_sg_copy(QEMUSGList *qsg, uint8_t *buf, int to_guest)
+{
+    nvme_sg_copy_part(qsg, 0, buf, qsg->size, to_guest);
+}
+
+/* Copy len bytes of buf to the guest memory described by PRP1 and PRP2 */
+uint8_t nvme_dma_write_prp(NVMEState *n, uint64_t prp1, uint64_t prp2,
+    uint8_t *buf, uint32_t len)
+{
+    QEMUSGList qsg;
+    uint8_t ret;
+
+    qemu_sglist_init(&qsg, 1);
+    ret = nvme_map_prp(n, &qsg, prp1, prp2, len);
+    if (!ret) {
+        nvme_sg_copy(&qsg, buf, 1);
+    }
+    qemu_sglist_destroy(&qsg);
+    return ret;
+}
+
+/* Transfer len bytes between the host buffer buf and the backing file of
+ * a namespace at off. In direct mode buf, off and len must be aligned. */
+static int nvme_file_io(NVMENamespace *ns, uint8_t *buf, uint64_t off,
+    uint64_t len, int write)
 {
-    uint8_t *mapping_addr = n->mapping_addr;
-    uint64_t m_offset = 0;
-    uint64_t f_offset = file_offset;
-    uint64_t total = data_size;
-    uint64_t len = 0;
+    ssize_t ret;
 
-    while (total != 0) {
-        if (total >= NVME_BUF_SIZE) {
-            len = NVME_BUF_SIZE;
+    if (ns->mapping_addr) {
+        if (write) {
+            memcpy(ns->mapping_addr + off, buf, len);
         } else {
-            len = total;
+            memcpy(buf, ns->mapping_addr + off, len);
         }
-        switch (rw) {
-        case NVME_CMD_READ:
-            nvme_dma_mem_write(mem_addr + m_offset,
-                mapping_addr + f_offset, len);
+        return 0;
+    }
+
+    while (len) {
+        if (write) {
+            ret = pwrite(ns->fd, buf, len, off);
+        } else {
+            ret = pread(ns->fd, buf, len, off);
+        }
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            LOG_ERR("Backing file %s failed at %"PRIu64": %s",
+                write ? "write" : "read", off,
+                ret ? strerror(errno) : "end of file");
+            return FAIL;
+        }
+        buf += ret;
+        off += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+/* Write zeroes over [off, off + len) of the backing file */
+static void nvme_file_fill_zero(NVMENamespace *ns, uint64_t off, uint64_t len)
+{
+    uint64_t chunk;
+
+    if (ns->mapping_addr) {
+        memset(ns->mapping_addr + off, 0, len);
+        return;
+    }
+    for (; len; off += chunk, len -= chunk) {
+        chunk = MIN(len, PAGE_SIZE);
+        if (nvme_file_io(ns, (uint8_t *)nvme_zero_page, off, chunk, 1)) {
+            return;
+        }
+    }
+}
+
+/* Smallest block size direct I/O on the file accepts */
+static uint32_t nvme_dio_align(int fd)
+{
+    uint8_t *buf = qemu_memalign(PAGE_SIZE, PAGE_SIZE);
+    uint32_t align;
+
+    for (align = 512; align < PAGE_SIZE; align <<= 1) {
+        if (pread(fd, buf, align, 0) == align || errno != EINVAL) {
             break;
-        case NVME_CMD_WRITE:
-            nvme_dma_mem_read(mem_addr + m_offset,
-                mapping_addr + f_offset, len);
+        }
+    }
+    qemu_vfree(buf);
+    return align;
+}
+
+/* Record the 4KB blocks of [off, off + len) of a thin namespace as
+ * written. I/O threads may write to the same namespace concurrently. */
+static void nvme_thin_alloc(NVMENamespace *ns, uint64_t off, uint64_t len)
+{
+    uint64_t blk, end = (off + len + PAGE_SIZE - 1) / PAGE_SIZE;
+    unsigned long *word, old;
+
+    for (blk = off / PAGE_SIZE; blk < end; blk++) {
+        word = &ns->alloc_map[BIT_WORD(blk)];
+        if (*word & BIT_MASK(blk)) {
+            continue;
+        }
+        old = __sync_fetch_and_or(word, BIT_MASK(blk));
+        if (!(old & BIT_MASK(blk))) {
+            __sync_fetch_and_add(&ns->nr_alloc, 1);
+        }
+    }
+}
+
+/* Read from a thin namespace: blocks never written read as zeroes, without
+ * touching the backing file */
+static void nvme_thin_read(NVMENamespace *ns, QEMUSGList *qsg, uint64_t off)
+{
+    uint64_t nr_blks = (ns->nsze << ns->lba_shift) / PAGE_SIZE;
+    uint64_t pos = 0, blk, next, end;
+    int written;
+
+    while (pos < qsg->size) {
+        blk = (off + pos) / PAGE_SIZE;
+        written = test_bit(blk, ns->alloc_map);
+        if (written) {
+            next = find_next_zero_bit(ns->alloc_map, nr_blks, blk);
+        } else {
+            next = find_next_bit(ns->alloc_map, nr_blks, blk);
+        }
+        end = MIN(next * PAGE_SIZE - off, qsg->size);
+        nvme_sg_copy_part(qsg, pos, written ? ns->mapping_addr + off + pos :
+            NULL, end - pos, 1);
+        pos = end;
+    }
+}
+
+/* Rebuild the bitmap of a thin backing file from the extents it has data
+ * in. Without SEEK_DATA support the whole file counts as written. */
+static void nvme_thin_load(NVMENamespace *ns)
+{
+    off_t data, hole = 0, size = ns->nsze << ns->lba_shift;
+
+    ns->alloc_map = bitmap_new(size / PAGE_SIZE);
+    ns->nr_alloc = 0;
+#ifdef SEEK_DATA
+    for (;;) {
+        data = lseek(ns->fd, hole, SEEK_DATA);
+        if (data < 0) {
+            if (errno == ENXIO) {
+                return;
+            }
             break;
-        default:
-            LOG_NORM("Error- wrong opcode: %d\n", rw);
+        }
+        hole = lseek(ns->fd, data, SEEK_HOLE);
+        if (hole < 0) {
             break;
         }
+        nvme_thin_alloc(ns, data, hole - data);
+    }
+#endif
+    nvme_thin_alloc(ns, 0, size);
+}
 
-        m_offset = m_offset + len;
-        f_offset = f_offset + len;
-        total = total - len;
-    };
+/* Namespace Utilization, in LBAs */
+uint64_t nvme_ns_nuse(NVMENamespace *ns)
+{
+    if (!ns->alloc_map) {
+        return ns->nsze;
+    }
+    return MIN((ns->nr_alloc * PAGE_SIZE) >> ns->lba_shift, ns->nsze);
+}
 
-    return NVME_SC_SUCCESS;
+static int nvme_thin_written(NVMENamespace *ns, uint64_t off)
+{
+    return !ns->alloc_map || test_bit(off / PAGE_SIZE, ns->alloc_map);
 }
 
-static uint8_t do_rw_prp_list(NVMEState *n, NVMECmd *command)
+/* Record the outcome of a Compare. The Write fused to a Compare only goes
+ * ahead when the data matched. A SQ held for the outcome is served again,
+ * by the main loop as it serves drives. */
+static void nvme_compare_done(NVMEState *n, NVMECmd *sqe, NVMECQE *cqe,
+    int miscompare)
 {
-    uint64_t total = 0;
-    uint64_t len = 0;
-    uint64_t offset = 0;
-    uint64_t prp_list[512];
-    uint16_t i = 0;
+    NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
+    NVMEIOSQueue *sq = &n->sq[cqe->sq_id];
 
-    uint8_t res = FAIL;
-    struct NVME_rw *cmd = (struct NVME_rw *)command;
+    if (miscompare) {
+        sf->sct = NVME_SCT_MEDIA_ERR;
+        sf->sc = NVME_SC_COMPARE_FAILED;
+    }
+    if (NVME_FUSE(sqe->fuse) == NVME_FUSE_FIRST) {
+        if (sq->fused == NVME_FUSED_PENDING) {
+            nvme_sq_ready(n, cqe->sq_id);
+            qemu_bh_schedule(n->sq_processing_bh);
+        }
+        sq->fused = (miscompare || sf->sc) ?
+            NVME_FUSED_FAILED : NVME_FUSED_PASSED;
+    }
+}
 
-    /*check if prp2 contains pointer to list or pointer to memory*/
-    /*assume page size 4096 */
-    /*TODO find from which NVME register PAGE_SIZE size should be read*/
+/* Compare the data of qsg with the LBAs at off of a file backed
+ * namespace */
+static void nvme_compare(NVMEState *n, NVMENamespace *ns, NVMECmd *sqe,
+    NVMECQE *cqe, QEMUSGList *qsg, uint64_t off)
+{
+    NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
+    uint64_t len = qsg->size, pos, chunk;
+    uint8_t *data = qemu_malloc(len), *buf;
+    int miscompare = 0;
 
-    total = (cmd->nlb + 1) * NVME_BLOCK_SIZE;
+    nvme_sg_copy(qsg, data, 0);
+    if (!ns->mapping_addr) {
+        /* Holes of a thin backing file read as zeroes */
+        buf = qemu_memalign(PAGE_SIZE, len);
+        if (nvme_file_io(ns, buf, off, len, 0)) {
+            sf->sc = NVME_SC_INTERNAL;
+        } else {
+            miscompare = memcmp(data, buf, len) != 0;
+        }
+        qemu_vfree(buf);
+    } else {
+        /* Blocks of a thin namespace never written hold zeroes */
+        for (pos = 0; pos < len && !miscompare; pos += chunk) {
+            chunk = MIN(len - pos, PAGE_SIZE - (off + pos) % PAGE_SIZE);
+            miscompare = memcmp(data + pos,
+                nvme_thin_written(ns, off + pos) ?
+                ns->mapping_addr + off + pos : nvme_zero_page, chunk) != 0;
+        }
+    }
+    qemu_free(data);
+    nvme_compare_done(n, sqe, cqe, miscompare);
+}
 
-    len = PAGE_SIZE;
-    offset = cmd->slba * NVME_BLOCK_SIZE;
+static void nvme_unmap_sg(NVMERequest *req)
+{
+    struct iovec *iov = req->qiov.iov;
+    int i;
 
-    res = do_rw_prp(n, cmd->prp1, len, offset, cmd->opcode);
-    if (res == FAIL) {
+    for (i = 0; i < req->qiov.niov; i++) {
+        if (iov[i].iov_base == nvme_bit_bucket ||
+            iov[i].iov_base == nvme_zero_buf) {
+            continue;
+        }
+        cpu_physical_memory_unmap(iov[i].iov_base, iov[i].iov_len,
+            req->to_guest, req->to_guest ? iov[i].iov_len : 0);
+    }
+    qemu_iovec_reset(&req->qiov);
+}
+
+/* Map the guest ranges of the request into req->qiov, which is empty, so
+ * the block layer transfers straight from/to guest memory. Returns FAIL
+ * when some range can't be mapped, in which case the caller bounces the
+ * data. */
+static uint8_t nvme_map_sg(NVMERequest *req)
+{
+    QEMUSGList *qsg = &req->qsg;
+    target_phys_addr_t addr, len, plen;
+    uint8_t *mem;
+    int i;
+
+    for (i = 0; i < qsg->nsg; i++) {
+        addr = qsg->sg[i].base;
+        len = qsg->sg[i].len;
+        while (len) {
+            plen = len;
+            if (addr == NVME_SG_BIT_BUCKET) {
+                /* Every chunk of a bit bucket reads into the same buffer */
+                plen = MIN(len, NVME_BIT_BUCKET_SIZE);
+                qemu_iovec_add(&req->qiov, nvme_bit_bucket, plen);
+                len -= plen;
+                continue;
+            }
+            mem = NULL;
+            if (!nvme_in_io_thread() || nvme_addr_is_ram(addr, plen)) {
+                mem = cpu_physical_memory_map(addr, &plen, req->to_guest);
+            }
+            if (!mem) {
+                nvme_unmap_sg(req);
+                return FAIL;
+            }
+            qemu_iovec_add(&req->qiov, mem, plen);
+            addr += plen;
+            len -= plen;
+        }
+    }
+    return 0;
+}
+
+/* Whether the host ranges of qiov suit the I/O mode of the namespace */
+static int nvme_iov_aligned(NVMENamespace *ns, QEMUIOVector *qiov)
+{
+    uintptr_t mask = ns->dio_align - 1;
+    int i;
+
+    if (ns->io_mode != NVME_IO_DIRECT) {
+        return 1;
+    }
+    for (i = 0; i < qiov->niov; i++) {
+        if (((uintptr_t)qiov->iov[i].iov_base | qiov->iov[i].iov_len) &
+            mask) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Transfer between the guest ranges of qsg and the backing file at off,
+ * for the modes without a mapping. The guest pages are used in place when
+ * they are RAM and suitably aligned, else the data goes through an
+ * aligned bounce buffer. */
+static int nvme_file_rw(NVMENamespace *ns, QEMUSGList *qsg, uint64_t off,
+    int write)
+{
+    NVMERequest req;
+    uint8_t *buf;
+    ssize_t ret;
+
+    memset(&req, 0, sizeof(req));
+#ifdef CONFIG_PREADV
+    req.qsg = *qsg;
+    qemu_iovec_init(&req.qiov, qsg->nsg);
+    req.to_guest = !write;
+    if (nvme_map_sg(&req) == 0) {
+        if (req.qiov.niov <= IOV_MAX && nvme_iov_aligned(ns, &req.qiov)) {
+            do {
+                if (write) {
+                    ret = pwritev(ns->fd, req.qiov.iov, req.qiov.niov, off);
+                } else {
+                    ret = preadv(ns->fd, req.qiov.iov, req.qiov.niov, off);
+                }
+            } while (ret < 0 && errno == EINTR);
+            nvme_unmap_sg(&req);
+            qemu_iovec_destroy(&req.qiov);
+            if (ret < 0 || ret != qsg->size) {
+                LOG_ERR("Backing file %s failed at %"PRIu64": %s",
+                    write ? "write" : "read", off,
+                    ret < 0 ? strerror(errno) : "short transfer");
+                return FAIL;
+            }
+            return 0;
+        }
+        nvme_unmap_sg(&req);
+    }
+    qemu_iovec_destroy(&req.qiov);
+#endif
+
+    buf = qemu_memalign(PAGE_SIZE, qsg->size);
+    if (write) {
+        nvme_sg_copy(qsg, buf, 0);
+    }
+    ret = nvme_file_io(ns, buf, off, qsg->size, write);
+    if (!ret && !write) {
+        nvme_sg_copy(qsg, buf, 1);
+    }
+    qemu_vfree(buf);
+    return ret;
+}
+
+/* Give a SQ its slice of the request pool, one context per entry its CQ
+ * can hold besides the one kept free. The CQ space check bounds the
+ * commands in flight, so the pool never runs dry and taking a context
+ * allocates nothing; the bounce buffers of Compare and of guest memory
+ * that isn't RAM still are. Only the owner of the SQ uses the pool, others
+ * do with the I/O threads paused. The SG lists and I/O vectors start empty
+ * and keep their arrays from one command to the next. There is a busy
+ * bucket per 4 contexts. */
+void nvme_init_sq_requests(NVMEState *n, uint16_t sq_id, uint16_t nr)
+{
+    NVMEIOSQueue *sq = &n->sq[sq_id];
+    NVMERequest *req;
+    uint32_t nr_buckets = 1;
+    uint16_t i, j;
+
+    sq->reqs = qemu_mallocz(nr * sizeof(*sq->reqs));
+    sq->nr_reqs = nr;
+    QTAILQ_INIT(&sq->free_reqs);
+    while (nr_buckets * 4 < nr) {
+        nr_buckets <<= 1;
+    }
+    sq->busy_reqs = qemu_malloc(nr_buckets * sizeof(*sq->busy_reqs));
+    sq->busy_mask = nr_buckets - 1;
+    for (i = 0; i < nr_buckets; i++) {
+        QTAILQ_INIT(&sq->busy_reqs[i]);
+    }
+    for (i = 0; i < nr; i++) {
+        req = &sq->reqs[i];
+        req->n = n;
+        req->sq_id = sq_id;
+        for (j = 0; j < NVME_IO_CHUNKS; j++) {
+            req->chunks[j].req = req;
+        }
+        QTAILQ_INSERT_TAIL(&sq->free_reqs, req, sq_entry);
+    }
+}
+
+/* The requests of the SQ must have been cancelled */
+void nvme_free_sq_requests(NVMEState *n, uint16_t sq_id)
+{
+    NVMEIOSQueue *sq = &n->sq[sq_id];
+    uint16_t i, j;
+
+    for (i = 0; i < sq->nr_reqs; i++) {
+        qemu_sglist_destroy(&sq->reqs[i].qsg);
+        qemu_iovec_destroy(&sq->reqs[i].qiov);
+        for (j = 0; j < NVME_IO_CHUNKS; j++) {
+            qemu_iovec_destroy(&sq->reqs[i].chunks[j].qiov);
+        }
+    }
+    qemu_free(sq->reqs);
+    sq->reqs = NULL;
+    sq->nr_reqs = 0;
+    qemu_free(sq->busy_reqs);
+    sq->busy_reqs = NULL;
+}
+
+/* Take a context from the pool of the SQ of cqe for a command going in
+ * flight. NULL when the pool is empty, which the CQ space check rules
+ * out. */
+NVMERequest *nvme_get_request(NVMEState *n, NVMENamespace *ns, NVMECmd *sqe,
+    NVMECQE *cqe)
+{
+    NVMEIOSQueue *sq = &n->sq[cqe->sq_id];
+    NVMERequest *req = QTAILQ_FIRST(&sq->free_reqs);
+
+    if (!req) {
+        return NULL;
+    }
+    QTAILQ_REMOVE(&sq->free_reqs, req, sq_entry);
+    QTAILQ_INSERT_TAIL(&sq->busy_reqs[sqe->cid & sq->busy_mask], req,
+        sq_entry);
+    req->ns = ns;
+    req->aiocb = NULL;
+    req->nr_chunks = 0;
+    req->pending = 0;
+    req->ret = 0;
+    req->cmd = *sqe;
+    req->cqe = *cqe;
+    req->buf = NULL;
+    req->to_guest = 0;
+    req->synced = 0;
+    req->uring = NULL;
+    req->start = get_clock();
+    return req;
+}
+
+void nvme_free_request(NVMERequest *req)
+{
+    NVMEIOSQueue *sq = &req->n->sq[req->sq_id];
+
+    /* Only the block layer requests are tracked by the controller, those
+     * on a ring may belong to an I/O thread and flushes wait in the
+     * cache */
+    if (req->ns->bs) {
+        QTAILQ_REMOVE(&req->n->requests, req, entry);
+    }
+    if (req->buf) {
+        qemu_vfree(req->buf);
+        req->buf = NULL;
+    } else {
+        nvme_unmap_sg(req);
+    }
+    qemu_iovec_reset(&req->qiov);
+    req->qsg.nsg = 0;
+    req->qsg.size = 0;
+    QTAILQ_REMOVE(&sq->busy_reqs[req->cmd.cid & sq->busy_mask], req,
+        sq_entry);
+    QTAILQ_INSERT_HEAD(&sq->free_reqs, req, sq_entry);
+}
+
+/* Whether a write has to be on stable storage when it completes */
+static int nvme_write_through(NVMEState *n, NVMECmd *sqe)
+{
+    struct NVME_rw *e = (struct NVME_rw *)sqe;
+
+    if (sqe->opcode == NVME_CMD_WRITE) {
+        return e->fua || !nvme_vwc_enabled(n);
+    }
+    return sqe->opcode == NVME_CMD_WRITE_ZEROES && !nvme_vwc_enabled(n);
+}
+
+static void nvme_rw_cb(void *opaque, int ret)
+{
+    NVMERequest *req = opaque;
+    NVMEState *n = req->n;
+    NVMEStatusField *sf = (NVMEStatusField *)&req->cqe.status;
+
+    if (ret) {
+        LOG_ERR("Block I/O error %d, opcode 0x%02x", ret, req->cmd.opcode);
+        sf->sc = NVME_SC_INTERNAL;
+        if (req->cmd.opcode == NVME_CMD_COMPARE) {
+            /* Fails the Write fused to it */
+            nvme_compare_done(n, &req->cmd, &req->cqe, 0);
+        }
+    } else if (req->cmd.opcode == NVME_CMD_COMPARE) {
+        uint8_t *data = qemu_malloc(req->qsg.size);
+
+        nvme_sg_copy(&req->qsg, data, 0);
+        nvme_compare_done(n, &req->cmd, &req->cqe,
+            memcmp(data, req->buf, req->qsg.size) != 0);
+        qemu_free(data);
+    } else if (!req->synced && nvme_write_through(n, &req->cmd)) {
+        /* The data has to reach stable storage before completing */
+        req->synced = 1;
+        req->aiocb = bdrv_aio_flush(req->ns->bs, nvme_rw_cb, req);
+        if (req->aiocb) {
+            return;
+        }
+        sf->sc = NVME_SC_INTERNAL;
+    } else if (req->buf && req->to_guest && !req->nr_chunks) {
+        nvme_sg_copy(&req->qsg, req->buf, 1);
+    }
+    nvme_stats_done(n, req->sq_id, &req->cmd, &req->cqe, req->start);
+    nvme_post_cqe(n, req->sq_id, &req->cqe);
+    nvme_free_request(req);
+}
+
+/* Completion of a chunk. A bounced Read copies the chunk to the guest
+ * right away, the command completes with its last chunk. */
+static void nvme_chunk_cb(void *opaque, int ret)
+{
+    NVMEChunk *c = opaque;
+    NVMERequest *req = c->req;
+
+    c->aiocb = NULL;
+    if (ret) {
+        req->ret = req->ret ? req->ret : ret;
+    } else if (req->buf && req->to_guest) {
+        nvme_sg_copy_part(&req->qsg, c->off, req->buf + c->off,
+            c->qiov.size, 1);
+    }
+    if (!--req->pending) {
+        nvme_rw_cb(req, req->ret);
+    }
+}
+
+/* Submit a Read or Write of more than a chunk as one block layer request
+ * per chunk, all in flight together. A bounced Write copies the data of
+ * each chunk just before it goes, while the chunks before it are already
+ * in the backend. nr_chunks stays 0 when nothing could be submitted. */
+static void nvme_bdrv_rw_chunks(NVMERequest *req, uint64_t len)
+{
+    struct NVME_rw *e = (struct NVME_rw *)&req->cmd;
+    int64_t sector = e->slba << (req->ns->lba_shift - BDRV_SECTOR_BITS);
+    int write = (req->cmd.opcode == NVME_CMD_WRITE);
+    NVMEChunk *c;
+    uint64_t off, size;
+
+    for (off = 0; off < len; off += size) {
+        size = MIN(len - off, NVME_IO_CHUNK_SIZE);
+        c = &req->chunks[req->nr_chunks];
+        c->off = off;
+        qemu_iovec_reset(&c->qiov);
+        qemu_iovec_copy(&c->qiov, &req->qiov, off, size);
+        if (write) {
+            if (req->buf) {
+                nvme_sg_copy_part(&req->qsg, off, req->buf + off, size, 0);
+            }
+            c->aiocb = bdrv_aio_writev(req->ns->bs,
+                sector + (off >> BDRV_SECTOR_BITS), &c->qiov,
+                size >> BDRV_SECTOR_BITS, nvme_chunk_cb, c);
+        } else {
+            c->aiocb = bdrv_aio_readv(req->ns->bs,
+                sector + (off >> BDRV_SECTOR_BITS), &c->qiov,
+                size >> BDRV_SECTOR_BITS, nvme_chunk_cb, c);
+        }
+        if (!c->aiocb) {
+            /* The chunks in flight complete the command with an error */
+            req->ret = -EIO;
+            break;
+        }
+        req->nr_chunks++;
+        req->pending++;
+    }
+}
+
+/* Submit an I/O command to the block layer. The completion entry is posted
+ * from nvme_rw_cb(), in whatever order the block layer completes. */
+static uint8_t nvme_bdrv_io(NVMEState *n, NVMENamespace *ns, NVMECmd *sqe,
+    NVMECQE *cqe)
+{
+    struct NVME_rw *e = (struct NVME_rw *)sqe;
+    NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
+    NVMERequest *req;
+    size_t len = (e->nlb + 1) << ns->lba_shift;
+    int shift = ns->lba_shift - BDRV_SECTOR_BITS;
+
+    req = nvme_get_request(n, ns, sqe, cqe);
+    if (!req) {
+        sf->sc = NVME_SC_INTERNAL;
         return FAIL;
     }
-    total = total - PAGE_SIZE;
-    offset = offset + PAGE_SIZE;
+    QTAILQ_INSERT_TAIL(&n->requests, req, entry);
 
-    /* LOG_NORM("sizeof(prp_list) %d\n", sizeof(prp_list)); */
-    memset(prp_list, 0, sizeof(prp_list));
-    nvme_dma_mem_read(cmd->prp2, (uint8_t *)prp_list, sizeof(prp_list));
+    if (sqe->opcode == NVME_CMD_FLUSH) {
+        req->aiocb = bdrv_aio_flush(ns->bs, nvme_rw_cb, req);
+    } else if (sqe->opcode == NVME_CMD_WRITE_ZEROES) {
+        /* No guest data: the zero buffer is written over and over */
+        size_t pos;
 
-    i = 0;
-    while (total != 0) {
-        if (i == 511) {
-            nvme_dma_mem_read(prp_list[511], (uint8_t *)prp_list,
-                sizeof(prp_list));
-            i = 0;
+        for (pos = 0; pos < len; pos += NVME_ZERO_BUF_SIZE) {
+            qemu_iovec_add(&req->qiov, nvme_zero_buf,
+                MIN(NVME_ZERO_BUF_SIZE, len - pos));
+        }
+        req->aiocb = bdrv_aio_writev(ns->bs, e->slba << shift,
+            &req->qiov, (e->nlb + 1) << shift, nvme_rw_cb, req);
+    } else {
+        req->to_guest = (sqe->opcode == NVME_CMD_READ);
+        if (nvme_map_dptr(n, &req->qsg, sqe, len, sf) == FAIL) {
+            nvme_free_request(req);
+            return FAIL;
+        }
+        /* Compare reads into a buffer, checked against the guest data on
+         * completion */
+        if (sqe->opcode == NVME_CMD_COMPARE || nvme_map_sg(req) == FAIL) {
+            req->buf = qemu_blockalign(ns->bs, len);
+            qemu_iovec_add(&req->qiov, req->buf, len);
+            if (sqe->opcode == NVME_CMD_WRITE && len <= NVME_IO_CHUNK_SIZE) {
+                nvme_sg_copy(&req->qsg, req->buf, 0);
+            }
         }
 
-        if (total >= PAGE_SIZE) {
-            len = PAGE_SIZE;
+        if (sqe->opcode == NVME_CMD_COMPARE &&
+            NVME_FUSE(sqe->fuse) == NVME_FUSE_FIRST) {
+            /* The fused Write needs the outcome */
+            n->sq[cqe->sq_id].fused = NVME_FUSED_PENDING;
+        }
+        if (sqe->opcode != NVME_CMD_COMPARE && len > NVME_IO_CHUNK_SIZE) {
+            nvme_bdrv_rw_chunks(req, len);
+        } else if (sqe->opcode == NVME_CMD_WRITE) {
+            req->aiocb = bdrv_aio_writev(ns->bs, e->slba << shift,
+                &req->qiov, (e->nlb + 1) << shift, nvme_rw_cb, req);
         } else {
-            len = total;
+            req->aiocb = bdrv_aio_readv(ns->bs, e->slba << shift,
+                &req->qiov, (e->nlb + 1) << shift, nvme_rw_cb, req);
+        }
+    }
+
+    if (!req->aiocb && !req->nr_chunks) {
+        nvme_free_request(req);
+        sf->sc = NVME_SC_INTERNAL;
+        if (n->sq[cqe->sq_id].fused == NVME_FUSED_PENDING) {
+            n->sq[cqe->sq_id].fused = NVME_FUSED_FAILED;
+        }
+        return FAIL;
+    }
+    return NVME_REQ_PENDING;
+}
+
+/* Cancel what a request has in flight in the block layer */
+static void nvme_cancel_aio(NVMERequest *req)
+{
+    int i;
+
+    for (i = 0; i < req->nr_chunks; i++) {
+        if (req->chunks[i].aiocb) {
+            bdrv_aio_cancel(req->chunks[i].aiocb);
+        }
+    }
+    if (req->aiocb) {
+        bdrv_aio_cancel(req->aiocb);
+    }
+}
+
+/* Cancel the block layer requests of a SQ, or of all SQs when sq_id is
+ * NVME_MAX_QID. No completion is posted for them. */
+void nvme_cancel_requests(NVMEState *n, uint16_t sq_id)
+{
+    NVMERequest *req, *next;
+    uint32_t i;
+
+    QTAILQ_FOREACH_SAFE(req, &n->requests, entry, next) {
+        if (sq_id != NVME_MAX_QID && req->sq_id != sq_id) {
+            continue;
+        }
+        nvme_cancel_aio(req);
+        n->cq[n->sq[req->sq_id].cq_id].inflight--;
+        nvme_free_request(req);
+    }
+    if (n->uring) {
+        nvme_uring_cancel(n, n->uring, sq_id);
+    }
+    for (i = 0; n->iothreads && i < n->nr_iothreads; i++) {
+        if (n->iothreads[i].uring) {
+            nvme_uring_cancel(n, n->iothreads[i].uring, sq_id);
         }
-        res = do_rw_prp(n, prp_list[i], len, offset, cmd->opcode);
-        if (res == FAIL) {
+    }
+    nvme_cache_cancel(n, sq_id);
+    nvme_stats_cancel(n, sq_id);
+}
+
+/* The context of the command cid of a SQ, while the command is in flight */
+NVMERequest *nvme_find_request(NVMEState *n, uint16_t sq_id, uint16_t cid)
+{
+    NVMEIOSQueue *sq = &n->sq[sq_id];
+    NVMERequest *req;
+
+    if (!sq->busy_reqs) {
+        return NULL;
+    }
+    QTAILQ_FOREACH(req, &sq->busy_reqs[cid & sq->busy_mask], sq_entry) {
+        if (req->cmd.cid == cid) {
+            return req;
+        }
+    }
+    return NULL;
+}
+
+/* Stop a command in flight: a block layer request is cancelled, a flush
+ * the destage thread hasn't picked up yet is dropped, and the command
+ * completes with Command Abort Requested. Returns FAIL when the command
+ * can't be stopped any more, as once it's on a ring, it then completes as
+ * usual. For the main loop with the I/O threads paused. */
+uint8_t nvme_abort_request(NVMEState *n, NVMERequest *req)
+{
+    NVMEStatusField *sf = (NVMEStatusField *)&req->cqe.status;
+
+    if (req->ns->bs) {
+        nvme_cancel_aio(req);
+    } else if (req->uring || nvme_cache_abort(n, req) == FAIL) {
+        return FAIL;
+    }
+    trace_nvme_cmd_aborted(n, req->sq_id, req->cmd.cid);
+    sf->sc = NVME_SC_ABORT_REQ;
+    if (req->cmd.opcode == NVME_CMD_COMPARE) {
+        /* Fails the Write fused to it */
+        nvme_compare_done(n, &req->cmd, &req->cqe, 0);
+    }
+    nvme_stats_done(n, req->sq_id, &req->cmd, &req->cqe, req->start);
+    nvme_post_cqe(n, req->sq_id, &req->cqe);
+    nvme_free_request(req);
+    return 0;
+}
+
+/* Post the completions reaped from a ring. With cancel set, those of
+ * sq_id, or of all SQs when it is NVME_MAX_QID, are dropped instead. */
+static void nvme_uring_reap(NVMEState *n, NVMEUring *r, int cancel,
+    uint16_t sq_id)
+{
+    struct NVME_rw *e;
+    NVMEStatusField *sf;
+    NVMERequest *req;
+    uint64_t cq_mask = 0;
+    uint16_t cq_id;
+    void *opaque;
+    int res;
+
+    while (nvme_uring_next(r, &opaque, &res)) {
+        req = opaque;
+        cq_id = n->sq[req->sq_id].cq_id;
+        if (cancel && (sq_id == NVME_MAX_QID || req->sq_id == sq_id)) {
+            n->cq[cq_id].inflight--;
+            nvme_free_request(req);
+            continue;
+        }
+
+        e = (struct NVME_rw *)&req->cmd;
+        sf = (NVMEStatusField *)&req->cqe.status;
+        if (res < 0 || (size_t)res != req->qiov.size) {
+            LOG_ERR("io_uring error %d, opcode 0x%02x", res, e->opcode);
+            sf->sc = NVME_SC_INTERNAL;
+        } else if (e->opcode == NVME_CMD_WRITE &&
+            !nvme_write_through(n, &req->cmd)) {
+            nvme_cache_write(n, req->ns, e->slba << req->ns->lba_shift,
+                res, 0);
+        }
+        n->cq_batch[cq_id].open = 1;
+        cq_mask |= 1ULL << cq_id;
+        nvme_stats_done(n, req->sq_id, &req->cmd, &req->cqe, req->start);
+        nvme_post_cqe(n, req->sq_id, &req->cqe);
+        nvme_free_request(req);
+    }
+    nvme_cq_batch_flush(n, cq_mask);
+}
+
+void nvme_uring_complete(NVMEState *n, NVMEUring *r)
+{
+    nvme_uring_reap(n, r, 0, 0);
+}
+
+/* Wait for the requests queued on a ring, for the main loop with the I/O
+ * threads paused. Those of sq_id, or of all SQs when it is NVME_MAX_QID,
+ * complete without a CQE, the others complete as usual. */
+void nvme_uring_cancel(NVMEState *n, NVMEUring *r, uint16_t sq_id)
+{
+    for (;;) {
+        nvme_uring_submit(r);
+        nvme_uring_reap(n, r, 1, sq_id);
+        if (!nvme_uring_inflight(r)) {
             break;
         }
-        total = total - len;
-        offset = offset + len;
-        i++;
+        nvme_uring_wait(r);
+    }
+}
+
+/* Queue a Read or Write of a file backed namespace on the ring of its SQ,
+ * the transfer goes straight from/to guest memory. Returns
+ * NVME_REQ_PENDING once queued, FAIL on an invalid data pointer and 0 when
+ * the ring can't take the command, which then goes through the mapping. */
+static uint8_t nvme_uring_rw(NVMEState *n, NVMENamespace *ns, NVMECmd *sqe,
+    NVMECQE *cqe, uint64_t off, uint64_t len)
+{
+    NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
+    int write = (sqe->opcode == NVME_CMD_WRITE);
+    NVMERequest *req;
+
+    req = nvme_get_request(n, ns, sqe, cqe);
+    if (!req) {
+        return 0;
+    }
+    req->uring = nvme_sq_uring(n, cqe->sq_id);
+    req->to_guest = !write;
+
+    if (nvme_map_dptr(n, &req->qsg, sqe, len, sf) == FAIL) {
+        nvme_free_request(req);
+        return FAIL;
+    }
+    if (nvme_map_sg(req) == FAIL) {
+        nvme_free_request(req);
+        return 0;
+    }
+    if (req->qiov.niov > IOV_MAX || !nvme_iov_aligned(ns, &req->qiov)) {
+        nvme_free_request(req);
+        return 0;
+    }
+    if (nvme_uring_queue_rw(req->uring, write, ns - n->ns, req->qiov.iov,
+        req->qiov.niov, off, write && nvme_write_through(n, sqe), req)) {
+        nvme_free_request(req);
+        return 0;
+    }
+    if (write && ns->alloc_map) {
+        nvme_thin_alloc(ns, off, len);
+    }
+    return NVME_REQ_PENDING;
+}
+
+/* Make [off, off + len) of a file backed namespace read as zeroes. The
+ * partial 4KB blocks at the edges are zeroed. The whole blocks are punched
+ * out of the backing file when deallocating or thin, else zeroed in place
+ * by the host filesystem, with a memset as the last resort. */
+static void nvme_file_zero(NVMENamespace *ns, uint64_t off, uint64_t len,
+    int deallocate)
+{
+    uint64_t start = (off + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    uint64_t end = (off + len) & ~(uint64_t)(PAGE_SIZE - 1);
+    uint64_t blk;
+    unsigned long *word, old;
+    int done = 0;
+
+    /* Each edge block on its own, written or not. end < start when the
+     * range is within a single block, the head piece then covers it. */
+    if (start != off && nvme_thin_written(ns, off)) {
+        nvme_file_fill_zero(ns, off, MIN(off + len, start) - off);
+    }
+    if (end != off + len && end >= start && nvme_thin_written(ns, end)) {
+        nvme_file_fill_zero(ns, end, off + len - end);
+    }
+    if (start >= end) {
+        return;
+    }
+
+#ifdef CONFIG_FALLOCATE
+    if (deallocate || ns->alloc_map) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+        done = !fallocate(ns->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+            start, end - start);
+#endif
+    } else {
+#ifdef FALLOC_FL_ZERO_RANGE
+        done = !fallocate(ns->fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE,
+            start, end - start);
+#endif
+    }
+#endif
+    if (!done) {
+        nvme_file_fill_zero(ns, start, end - start);
+    }
+
+    if (ns->alloc_map) {
+        for (blk = start / PAGE_SIZE; blk < end / PAGE_SIZE; blk++) {
+            word = &ns->alloc_map[BIT_WORD(blk)];
+            if (!(*word & BIT_MASK(blk))) {
+                continue;
+            }
+            old = __sync_fetch_and_and(word, ~BIT_MASK(blk));
+            if (old & BIT_MASK(blk)) {
+                __sync_fetch_and_sub(&ns->nr_alloc, 1);
+            }
+        }
+    }
+}
+
+/* Pass the context attributes of a range on to the host page cache */
+static void nvme_file_hint(NVMENamespace *ns, uint32_t cattr, uint64_t off,
+    uint64_t len)
+{
+    int advice = -1;
+
+    if (cattr & NVME_DSM_SR) {
+        posix_fadvise(ns->fd, off, len, POSIX_FADV_SEQUENTIAL);
+    }
+    switch (NVME_DSM_AF(cattr)) {
+    case NVME_DSM_AF_FREQ_READ:
+    case NVME_DSM_AF_SPEC_READ:
+        advice = POSIX_FADV_WILLNEED;
+        break;
+    case NVME_DSM_AF_INFREQUENT:
+        advice = POSIX_FADV_DONTNEED;
+        break;
+    case NVME_DSM_AF_ONE_TIME:
+        advice = POSIX_FADV_NOREUSE;
+        break;
+    }
+    if (NVME_DSM_AL(cattr) == NVME_DSM_AL_LOW) {
+        advice = POSIX_FADV_WILLNEED;
+    }
+    if (advice != -1) {
+        posix_fadvise(ns->fd, off, len, advice);
+    }
+}
+
+static void nvme_discard_cb(void *opaque, int ret);
+
+/* Discard the next piece of the ranges of a DSM on a drive. The ranges
+ * are kept in req->buf and shrink as they go. Returns 0 once they are all
+ * gone. */
+static int nvme_bdrv_discard_next(NVMERequest *req)
+{
+    struct NVME_dsm *c = (struct NVME_dsm *)&req->cmd;
+    NVMENamespace *ns = req->ns;
+    NVMEDsmRange *r = (NVMEDsmRange *)req->buf;
+    int shift = ns->lba_shift - BDRV_SECTOR_BITS;
+    uint32_t i, nlb;
+
+    for (i = 0; i <= c->nr; i++) {
+        while (r[i].nlb) {
+            /* The block layer counts sectors in an int */
+            nlb = MIN(r[i].nlb, (1U << 30) >> shift);
+            req->aiocb = bdrv_aio_discard(ns->bs, r[i].slba << shift,
+                nlb << shift, nvme_discard_cb, req);
+            r[i].slba += nlb;
+            r[i].nlb -= nlb;
+            if (req->aiocb) {
+                return 1;
+            }
+            trace_nvme_err_discard(ns->bs, -EIO);
+        }
     }
+    return 0;
+}
+
+static void nvme_discard_cb(void *opaque, int ret)
+{
+    NVMERequest *req = opaque;
+    NVMEState *n = req->n;
 
-    return res;
+    req->aiocb = NULL;
+    if (ret < 0) {
+        /* Deallocation is advisory, the data just stays */
+        trace_nvme_err_discard(req->ns->bs, ret);
+    }
+    if (nvme_bdrv_discard_next(req)) {
+        return;
+    }
+    nvme_stats_done(n, req->sq_id, &req->cmd, &req->cqe, req->start);
+    nvme_post_cqe(n, req->sq_id, &req->cqe);
+    nvme_free_request(req);
+}
+
+/* Deallocate the ranges of a drive, one block layer discard after the
+ * other. The command completes from nvme_discard_cb(). */
+static uint8_t nvme_bdrv_dsm(NVMEState *n, NVMENamespace *ns, NVMECmd *sqe,
+    NVMECQE *cqe, NVMEDsmRange *ranges, uint32_t nr)
+{
+    NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
+    NVMERequest *req;
+
+    req = nvme_get_request(n, ns, sqe, cqe);
+    if (!req) {
+        sf->sc = NVME_SC_INTERNAL;
+        return FAIL;
+    }
+    QTAILQ_INSERT_TAIL(&n->requests, req, entry);
+    req->buf = qemu_memalign(sizeof(*ranges), nr * sizeof(*ranges));
+    memcpy(req->buf, ranges, nr * sizeof(*ranges));
+    if (!nvme_bdrv_discard_next(req)) {
+        nvme_free_request(req);
+        return NVME_SC_SUCCESS;
+    }
+    return NVME_REQ_PENDING;
+}
+
+/* Dataset Management: deallocate the ranges when AD is set, else take
+ * their context attributes as caching hints. Drives get no hints. */
+static uint8_t nvme_dsm(NVMEState *n, NVMENamespace *ns, NVMECmd *sqe,
+    NVMECQE *cqe)
+{
+    struct NVME_dsm *c = (struct NVME_dsm *)sqe;
+    NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
+    NVMEDsmRange ranges[NVME_DSM_MAX_RANGES];
+    uint32_t nr = c->nr + 1, i;
+    QEMUSGList qsg;
+
+    qemu_sglist_init(&qsg, 1);
+    if (nvme_map_dptr(n, &qsg, sqe, nr * sizeof(*ranges), sf) == FAIL) {
+        qemu_sglist_destroy(&qsg);
+        return FAIL;
+    }
+    nvme_sg_copy(&qsg, (uint8_t *)ranges, 0);
+    qemu_sglist_destroy(&qsg);
+
+    for (i = 0; i < nr; i++) {
+        if (ranges[i].slba > ns->nsze ||
+            ranges[i].nlb > ns->nsze - ranges[i].slba) {
+            trace_nvme_err_lba_range(ns, cqe->sq_id, sqe->cid, ranges[i].slba,
+                ranges[i].nlb);
+            sf->sc = NVME_SC_LBA_RANGE;
+            return FAIL;
+        }
+    }
+
+    if (ns->bs) {
+        if (c->attributes & NVME_DSM_AD) {
+            return nvme_bdrv_dsm(n, ns, sqe, cqe, ranges, nr);
+        }
+        return NVME_SC_SUCCESS;
+    }
+
+    for (i = 0; i < nr; i++) {
+        if (!ranges[i].nlb) {
+            continue;
+        }
+        if (c->attributes & NVME_DSM_AD) {
+            nvme_file_zero(ns, ranges[i].slba << ns->lba_shift,
+                (uint64_t)ranges[i].nlb << ns->lba_shift, 1);
+        } else {
+            nvme_file_hint(ns, ranges[i].cattr,
+                ranges[i].slba << ns->lba_shift,
+                (uint64_t)ranges[i].nlb << ns->lba_shift);
+        }
+    }
+    return NVME_SC_SUCCESS;
+}
+
+/* Check a command against the fused operation in progress on its SQ.
+ * Only a Compare followed by a Write of the same LBAs can be fused: the SQ
+ * is not served between the two commands. The pair is not atomic with
+ * respect to the commands of other SQs, which may write the LBAs between
+ * the Compare and the Write. */
+static uint8_t nvme_fused_check(NVMEState *n, NVMECmd *sqe, NVMECQE *cqe)
+{
+    struct NVME_rw *e = (struct NVME_rw *)sqe;
+    NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
+    NVMEIOSQueue *sq = &n->sq[cqe->sq_id];
+    uint8_t fused = sq->fused;
+
+    sq->fused = NVME_FUSED_NONE;
+    switch (NVME_FUSE(sqe->fuse)) {
+    case NVME_FUSE_NONE:
+        return 0;
+    case NVME_FUSE_FIRST:
+        if (sqe->opcode != NVME_CMD_COMPARE) {
+            break;
+        }
+        /* Until the Compare succeeds */
+        sq->fused = NVME_FUSED_FAILED;
+        sq->fused_nsid = sqe->nsid;
+        sq->fused_slba = e->slba;
+        sq->fused_nlb = e->nlb;
+        return 0;
+    case NVME_FUSE_SECOND:
+        if (sqe->opcode != NVME_CMD_WRITE) {
+            break;
+        }
+        if (fused != NVME_FUSED_NONE && (sqe->nsid != sq->fused_nsid ||
+            e->slba != sq->fused_slba || e->nlb != sq->fused_nlb)) {
+            break;
+        }
+        if (fused == NVME_FUSED_PASSED) {
+            return 0;
+        }
+        sf->sc = (fused == NVME_FUSED_FAILED) ? NVME_SC_FUSED_FAIL :
+            NVME_SC_FUSED_MISSING;
+        return FAIL;
+    }
+    trace_nvme_err_fused(n, cqe->sq_id, sqe->cid, sqe->fuse);
+    sf->sc = NVME_SC_INVALID_FIELD;
+    return FAIL;
 }
 
 uint8_t nvme_io_command(NVMEState *n, NVMECmd *sqe, NVMECQE *cqe)
 {
     struct NVME_rw *e = (struct NVME_rw *)sqe;
+    NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
+    NVMENamespace *ns;
+    QEMUSGList qsg;
+    uint64_t off, len;
     uint8_t res = FAIL;
 
+    if ((sqe->opcode != NVME_CMD_READ) &&
+        (sqe->opcode != NVME_CMD_WRITE) &&
+        (sqe->opcode != NVME_CMD_FLUSH) &&
+        (sqe->opcode != NVME_CMD_COMPARE) &&
+        (sqe->opcode != NVME_CMD_WRITE_ZEROES) &&
+        (sqe->opcode != NVME_CMD_DSM)) {
+        trace_nvme_err_opcode(n, cqe->sq_id, sqe->cid, sqe->opcode);
+        sf->sc = NVME_SC_INVALID_OPCODE;
+        return res;
+    }
+
+    if (nvme_fused_check(n, sqe, cqe) == FAIL) {
+        return res;
+    }
+
+    ns = nvme_ns(n, sqe->nsid);
+    if (!ns) {
+        trace_nvme_err_nsid(n, cqe->sq_id, sqe->cid, sqe->nsid);
+        sf->sc = NVME_SC_INVALID_NAMESPACE;
+        return res;
+    }
+
     if (sqe->opcode == NVME_CMD_FLUSH) {
-        return NVME_SC_SUCCESS;
+        if (ns->bs) {
+            return nvme_bdrv_io(n, ns, sqe, cqe);
+        }
+        return nvme_cache_flush(n, ns, sqe, cqe);
     }
 
-    if ((sqe->opcode != NVME_CMD_READ) &&
-        (sqe->opcode != NVME_CMD_WRITE)) {
-        LOG_NORM("Wrong IO opcode:\t\t0x%02x\n", sqe->opcode);
+    if (sqe->opcode == NVME_CMD_DSM) {
+        return nvme_dsm(n, ns, sqe, cqe);
+    }
+
+    if (e->slba >= ns->nsze || e->nlb + 1 > ns->nsze - e->slba) {
+        trace_nvme_err_lba_range(ns, cqe->sq_id, sqe->cid, e->slba, e->nlb);
+        sf->sc = NVME_SC_LBA_RANGE;
         return res;
     }
 
-    if (!e->prp2) {
-        res = do_rw_prp(n, e->prp1,
-            ((e->nlb + 1) * NVME_BLOCK_SIZE),
-            (e->slba * NVME_BLOCK_SIZE), e->opcode);
-    } else if ((e->nlb + 1) <= 2 * (PAGE_SIZE/NVME_BLOCK_SIZE)) {
-        res = do_rw_prp(n, e->prp1, PAGE_SIZE,
-            e->slba * NVME_BLOCK_SIZE, e->opcode);
+    off = e->slba << ns->lba_shift;
+    len = (uint64_t)(e->nlb + 1) << ns->lba_shift;
+    /* MDTS bounds what moves data, Write Zeroes moves none */
+    if (len > NVME_MAX_XFER_SIZE && sqe->opcode != NVME_CMD_WRITE_ZEROES) {
+        trace_nvme_err_mdts(n, cqe->sq_id, sqe->cid, len);
+        sf->sc = NVME_SC_INVALID_FIELD;
+        return res;
+    }
+    if (ns->bs) {
+        return nvme_bdrv_io(n, ns, sqe, cqe);
+    }
 
-        if (res == FAIL) {
+    if (sqe->opcode == NVME_CMD_WRITE_ZEROES) {
+        nvme_file_zero(ns, off, len, 0);
+        /* fallocate() changes are only durable once the file is synced */
+        if (nvme_write_through(n, sqe) && qemu_fdatasync(ns->fd)) {
+            sf->sc = NVME_SC_INTERNAL;
             return FAIL;
         }
-        res = do_rw_prp(n, e->prp2,
-            (e->nlb + 1) * NVME_BLOCK_SIZE - PAGE_SIZE,
-            e->slba * NVME_BLOCK_SIZE + PAGE_SIZE,
-            e->opcode);
+        return NVME_SC_SUCCESS;
+    }
+
+    if ((n->flags & NVME_FLAG_URING) && (sqe->opcode == NVME_CMD_READ ||
+        sqe->opcode == NVME_CMD_WRITE)) {
+        res = nvme_uring_rw(n, ns, sqe, cqe, off, len);
+        if (res != NVME_SC_SUCCESS) {
+            return res;
+        }
+    }
 
-        if (res == FAIL) {
+    qemu_sglist_init(&qsg, 1);
+    if (nvme_map_dptr(n, &qsg, sqe, len, sf) == FAIL) {
+        qemu_sglist_destroy(&qsg);
+        return FAIL;
+    }
+    if (sqe->opcode == NVME_CMD_COMPARE) {
+        nvme_compare(n, ns, sqe, cqe, &qsg, off);
+        qemu_sglist_destroy(&qsg);
+        return NVME_SC_SUCCESS;
+    }
+
+    if (!ns->mapping_addr) {
+        /* Holes of a thin backing file read as zeroes */
+        if (nvme_file_rw(ns, &qsg, off, sqe->opcode == NVME_CMD_WRITE)) {
+            qemu_sglist_destroy(&qsg);
+            sf->sc = NVME_SC_INTERNAL;
             return FAIL;
         }
+    } else if (ns->alloc_map && sqe->opcode == NVME_CMD_READ) {
+        nvme_thin_read(ns, &qsg, off);
+    } else {
+        nvme_sg_copy(&qsg, ns->mapping_addr + off,
+            sqe->opcode == NVME_CMD_READ);
+    }
+    if (sqe->opcode == NVME_CMD_WRITE) {
+        if (ns->alloc_map) {
+            nvme_thin_alloc(ns, off, len);
+        }
+        nvme_cache_write(n, ns, off, len, nvme_write_through(n, sqe));
+    }
+    qemu_sglist_destroy(&qsg);
+    return NVME_SC_SUCCESS;
+}
+
+static void nvme_storage_file_name(uint32_t nsid, char *name, size_t len)
+{
+    if (nsid == 1) {
+        pstrcpy(name, len, NVME_STORAGE_FILE_NAME);
     } else {
-        res = do_rw_prp_list(n, sqe);
+        snprintf(name, len, NVME_STORAGE_FILE_FMT, nsid);
     }
-    return res;
 }
 
-static int nvme_create_storage_file(NVMEState *n)
+static int nvme_create_storage_file(const char *name, size_t size)
 {
-    n->fd = open(NVME_STORAGE_FILE_NAME, O_RDWR | O_CREAT
-        | O_TRUNC, S_IRUSR | S_IWUSR);
-    posix_fallocate(n->fd, 0, NVME_STORAGE_FILE_SIZE);
-    LOG_NORM("Backing store created with fd %d\n", n->fd);
-    close(n->fd);
-    n->fd = -1;
+    int fd;
+
+    fd = open(name, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd == -1) {
+        return FAIL;
+    }
+    posix_fallocate(fd, 0, size);
+    LOG_NORM("Backing store %s created with fd %d\n", name, fd);
+    close(fd);
     return 0;
 }
 
 int nvme_close_storage_file(NVMEState *n)
 {
-    if (n->fd != -1) {
-        if (n->mapping_addr) {
-            munmap(n->mapping_addr, n->mapping_size);
-            n->mapping_addr = NULL;
-            n->mapping_size = 0;
+    NVMENamespace *ns;
+    uint32_t i;
+
+    nvme_cancel_requests(n, NVME_MAX_QID);
+    nvme_cache_stop(n);
+    for (i = 0; i < n->nr_namespaces; i++) {
+        ns = &n->ns[i];
+        if (ns->fd == -1) {
+            continue;
+        }
+        if (ns->mapping_addr) {
+            munmap(ns->mapping_addr, ns->mapping_size);
+            ns->mapping_addr = NULL;
+            ns->mapping_size = 0;
         }
-        close(n->fd);
-        n->fd = -1;
+        qemu_free(ns->alloc_map);
+        ns->alloc_map = NULL;
+        close(ns->fd);
+        ns->fd = -1;
     }
+    nvme_uring_update_files(n);
     return 0;
 }
 
 int nvme_open_storage_file(NVMEState *n)
 {
+    char name[64];
     struct stat st;
     uint8_t *mapping_addr;
+    NVMENamespace *ns;
+    size_t size;
+    uint32_t i;
+    int flags;
+
+    for (i = 0; i < n->nr_namespaces; i++) {
+        ns = &n->ns[i];
+        if (ns->bs) {
+            continue;
+        }
+        if (ns->fd != -1) {
+            return FAIL;
+        }
 
-    if (n->fd != -1) {
+        nvme_storage_file_name(i + 1, name, sizeof(name));
+        size = ns->nsze << ns->lba_shift;
+        flags = O_RDWR;
+        if (ns->io_mode == NVME_IO_DIRECT) {
+            flags |= O_DIRECT;
+        }
+        if (n->flags & NVME_FLAG_THIN) {
+            /* Sparse file, blocks get allocated on first write. Resizing
+             * keeps the data. */
+            ns->fd = open(name, flags | O_CREAT, S_IRUSR | S_IWUSR);
+            if (ns->fd == -1 || ftruncate(ns->fd, size)) {
+                goto fail;
+            }
+        } else {
+            if (stat(name, &st) != 0 || st.st_size != size) {
+                nvme_create_storage_file(name, size);
+            }
+            ns->fd = open(name, flags);
+            if (ns->fd == -1) {
+                goto fail;
+            }
+        }
+
+        if (ns->io_mode == NVME_IO_DIRECT) {
+            ns->dio_align = nvme_dio_align(ns->fd);
+            if (ns->dio_align > (1 << ns->lba_shift)) {
+                LOG_ERR("Direct I/O on %s needs %u byte blocks", name,
+                    ns->dio_align);
+                close(ns->fd);
+                ns->fd = -1;
+                goto fail;
+            }
+        }
+        if (n->flags & NVME_FLAG_THIN) {
+            nvme_thin_load(ns);
+        }
+        if (ns->io_mode != NVME_IO_MMAP) {
+            LOG_NORM("Namespace %u backing store opened for %s I/O\n", i + 1,
+                nvme_io_modes[ns->io_mode]);
+            continue;
+        }
+
+        mapping_addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+            ns->fd, 0);
+        if (mapping_addr == MAP_FAILED) {
+            close(ns->fd);
+            ns->fd = -1;
+            goto fail;
+        }
+
+        ns->mapping_size = size;
+        ns->mapping_addr = mapping_addr;
+        LOG_NORM("Namespace %u backing store mapped to %p\n", i + 1,
+            ns->mapping_addr);
+    }
+    nvme_uring_update_files(n);
+    if (nvme_cache_start(n)) {
+        nvme_close_storage_file(n);
+        return FAIL;
+    }
+    return 0;
+
+fail:
+    LOG_ERR("Unable to open the backing store %s", name);
+    nvme_close_storage_file(n);
+    return FAIL;
+}
+
+/* Call parse on each namespace with its item of list, a per namespace
+ * property. The namespaces keep their defaults when list is not given. */
+static int nvme_parse_ns_list(NVMEState *n, const char *list,
+    const char *name, int (*parse)(NVMENamespace *ns, const char *s,
+    size_t len))
+{
+    const char *s = NULL, *p = list;
+    size_t len = 0;
+    uint32_t i;
+
+    if (!list) {
+        return 0;
+    }
+    for (i = 0; i < n->nr_namespaces; i++) {
+        if (*p) {
+            s = p;
+            len = strcspn(p, ":");
+            p += len;
+            if (*p == ':') {
+                p++;
+            }
+        }
+        if (s && parse(&n->ns[i], s, len)) {
+            return FAIL;
+        }
+    }
+    if (*p) {
+        LOG_ERR("%s given for more than %u namespaces", name,
+            n->nr_namespaces);
+        return FAIL;
+    }
+    return 0;
+}
+
+static int nvme_parse_num(const char *s, size_t len, uint32_t *val)
+{
+    unsigned long long v;
+    char *end;
+
+    if (!len || !qemu_isdigit(*s)) {
+        return FAIL;
+    }
+    errno = 0;
+    v = strtoull(s, &end, 10);
+    if (errno || end != s + len || v > UINT32_MAX) {
+        return FAIL;
+    }
+    *val = v;
+    return 0;
+}
+
+static int nvme_parse_lba_size(NVMENamespace *ns, const char *s, size_t len)
+{
+    uint32_t size;
+
+    if (nvme_parse_num(s, len, &size) || (size != 512 && size != 4096)) {
+        LOG_ERR("lba_size must be 512 or 4096");
         return FAIL;
     }
+    ns->lba_shift = ffs(size) - 1;
+    ns->flbas = (ns->lba_shift == 12);
+    return 0;
+}
+
+static int nvme_parse_ns_size(NVMENamespace *ns, const char *s, size_t len)
+{
+    uint32_t mb;
+
+    if (nvme_parse_num(s, len, &mb) || !mb) {
+        LOG_ERR("ns_size must be a size in MB, not 0");
+        return FAIL;
+    }
+    ns->nsze = ((uint64_t)mb << 20) >> ns->lba_shift;
+    return 0;
+}
+
+static int nvme_parse_io_mode(NVMENamespace *ns, const char *s, size_t len)
+{
+    uint8_t mode;
 
-    if (stat(NVME_STORAGE_FILE_NAME, &st) != 0 ||
-        st.st_size != NVME_STORAGE_FILE_SIZE) {
-        nvme_create_storage_file(n);
+    for (mode = 0; mode < ARRAY_SIZE(nvme_io_modes); mode++) {
+        if (strlen(nvme_io_modes[mode]) == len &&
+            !strncmp(s, nvme_io_modes[mode], len)) {
+            ns->io_mode = mode;
+            return 0;
+        }
     }
+    LOG_ERR("io_mode must be mmap, buffered or direct");
+    return FAIL;
+}
+
+/* Check the namespace properties and size the namespaces. Either all
+ * namespaces are backed by a drive, drive for namespace 1 and driveN for
+ * namespace N, or none is and each gets a backing file of ns_size MB.
+ * lba_size applies to both, ns_size and io_mode to backing files only. */
+int nvme_init_namespaces(NVMEState *n)
+{
+    NVMENamespace *ns;
+    int64_t len;
+    uint32_t i;
 
-    n->fd = open(NVME_STORAGE_FILE_NAME, O_RDWR);
-    if (n->fd == -1) {
+    if (n->nr_namespaces == 0 || n->nr_namespaces > NVME_MAX_NAMESPACES) {
+        LOG_ERR("namespaces must be in 1..%d", NVME_MAX_NAMESPACES);
+        return FAIL;
+    }
+    if (n->ns[0].bs && (n->flags & NVME_FLAG_THIN)) {
+        LOG_ERR("thin is only supported for file backed namespaces");
+        return FAIL;
+    }
+    if (n->ns[0].bs && n->io_mode) {
+        LOG_ERR("io_mode is only supported for file backed namespaces");
+        return FAIL;
+    }
+    if (n->ns[0].bs && n->ns_size) {
+        LOG_ERR("ns_size is only supported for file backed namespaces");
         return FAIL;
     }
-    mapping_addr = mmap(NULL, NVME_STORAGE_FILE_SIZE, PROT_READ | PROT_WRITE,
-        MAP_SHARED, n->fd, 0);
 
-    if (mapping_addr == NULL) {
-        close(n->fd);
+    for (i = 0; i < NVME_MAX_NAMESPACES; i++) {
+        ns = &n->ns[i];
+        ns->fd = -1;
+        ns->io_mode = NVME_IO_MMAP;
+        ns->mapping_addr = NULL;
+        ns->mapping_size = 0;
+        ns->alloc_map = NULL;
+        ns->lba_shift = ffs(NVME_BLOCK_SIZE) - 1;
+        ns->flbas = 0;
+        if (i >= n->nr_namespaces) {
+            if (ns->bs) {
+                LOG_ERR("drive%u given for %u namespaces", i + 1,
+                    n->nr_namespaces);
+                return FAIL;
+            }
+            continue;
+        }
+        if (!ns->bs != !n->ns[0].bs) {
+            LOG_ERR("namespace %u has no drive", i + 1);
+            return FAIL;
+        }
+    }
+    if (nvme_parse_ns_list(n, n->lba_size, "lba_size", nvme_parse_lba_size)) {
         return FAIL;
     }
 
-    n->mapping_size = NVME_STORAGE_FILE_SIZE;
-    n->mapping_addr = mapping_addr;
+    for (i = 0; i < n->nr_namespaces; i++) {
+        ns = &n->ns[i];
+        if (ns->bs) {
+            len = bdrv_getlength(ns->bs);
+            if (len < 0) {
+                LOG_ERR("Unable to get the size of namespace %u", i + 1);
+                return FAIL;
+            }
+            ns->nsze = len >> ns->lba_shift;
+        } else {
+            ns->nsze = ((uint64_t)NVME_NS_SIZE_MB << 20) >> ns->lba_shift;
+        }
+    }
+    if (nvme_parse_ns_list(n, n->ns_size, "ns_size", nvme_parse_ns_size) ||
+        nvme_parse_ns_list(n, n->io_mode, "io_mode", nvme_parse_io_mode)) {
+        return FAIL;
+    }
 
-    LOG_NORM("Backing store mapped to %p\n", n->mapping_addr);
+    for (i = 0; i < n->nr_namespaces; i++) {
+        ns = &n->ns[i];
+        LOG_NORM("Namespace %u: %"PRIu64" LBAs of %u bytes", i + 1,
+            ns->nsze, 1 << ns->lba_shift);
+    }
     return 0;
 }
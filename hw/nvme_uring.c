@@ -0,0 +1,514 @@
+/*
+ * Copyright (c) 2011 Intel Corporation
+ *
+ * by Patrick Porlan <patrick.porlan@intel.com>
+ *    Nisheeth Bhat <nisheeth.bhat@intel.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ *
+ * This file deals with the io_uring engine of the file backed namespaces.
+ * Each context serving I/O queues, the main loop or an I/O thread, owns a
+ * ring: the Reads and Writes of its SQs are queued on it during a
+ * processing pass, submitted with a single system call at the end of the
+ * pass, and their completions are posted to the CQs as the ring reaps
+ * them. The backing files are registered with every ring. An I/O thread
+ * sleeps in its ring, so that both completions and doorbells wake it up.
+ */
+
+#include "nvme.h"
+#include "nvme_debug.h"
+
+#ifdef CONFIG_IO_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <linux/io_uring.h>
+
+#ifndef RWF_DSYNC
+#define RWF_DSYNC 0x00000002
+#endif
+
+#define NVME_URING_ENTRIES 256
+#define NVME_URING_SQPOLL_IDLE_MS 100
+/* The notifier is registered after the backing files */
+#define NVME_URING_KICK_FILE NVME_MAX_NAMESPACES
+/* user_data of the notifier poll, requests have their address there */
+#define NVME_URING_KICK 0
+
+struct NVMEUring {
+    int fd;
+    uint32_t flags; /* IORING_SETUP_* */
+    uint8_t *sq_ring;
+    uint8_t *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_flags;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    unsigned cq_entries;
+    struct io_uring_cqe *cqes;
+    unsigned to_submit; /* SQEs queued since the last submission */
+    uint32_t inflight; /* requests submitted and not reaped yet */
+    uint8_t thread; /* served by an I/O thread, kicked through the ring */
+    EventNotifier notifier;
+};
+
+static int uring_enter(NVMEUring *r, unsigned to_submit,
+    unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, r->fd, to_submit, min_complete,
+        flags, NULL, 0);
+}
+
+static int uring_register(NVMEUring *r, unsigned opcode, void *arg,
+    unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, r->fd, opcode, arg, nr_args);
+}
+
+/* Next free SQE, NULL when the SQ ring is full even after a submission */
+static struct io_uring_sqe *uring_get_sqe(NVMEUring *r)
+{
+    unsigned tail = *r->sq_tail;
+    struct io_uring_sqe *sqe;
+
+    if (tail - *(volatile unsigned *)r->sq_head >= r->sq_entries) {
+        nvme_uring_submit(r);
+        if (tail - *(volatile unsigned *)r->sq_head >= r->sq_entries) {
+            return NULL;
+        }
+    }
+    sqe = &r->sqes[tail & *r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[tail & *r->sq_mask] = tail & *r->sq_mask;
+    return sqe;
+}
+
+/* Hand the SQE from uring_get_sqe() over to the kernel */
+static void uring_commit_sqe(NVMEUring *r)
+{
+    /* The SQE must be visible before the tail moves */
+    __sync_synchronize();
+    *(volatile unsigned *)r->sq_tail = *r->sq_tail + 1;
+    r->to_submit++;
+}
+
+/* Wait for the notifier of an I/O thread ring to be set */
+static void uring_arm_kick(NVMEUring *r)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(r);
+
+    if (!sqe) {
+        /* The notifier poll does not count against the CQ room, this only
+         * happens with a broken ring */
+        LOG_ERR("Unable to arm the I/O thread notifier");
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = NVME_URING_KICK_FILE;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = NVME_URING_KICK;
+    uring_commit_sqe(r);
+}
+
+static int uring_map(NVMEUring *r, struct io_uring_params *p)
+{
+    r->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    r->cq_ring_size = p->cq_off.cqes +
+        p->cq_entries * sizeof(struct io_uring_cqe);
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        r->sq_ring_size = MAX(r->sq_ring_size, r->cq_ring_size);
+        r->cq_ring_size = r->sq_ring_size;
+    }
+
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED) {
+        r->sq_ring = NULL;
+        return FAIL;
+    }
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ring = r->sq_ring;
+    } else {
+        r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ring == MAP_FAILED) {
+            r->cq_ring = NULL;
+            return FAIL;
+        }
+    }
+    r->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        return FAIL;
+    }
+
+    r->sq_head = (unsigned *)(r->sq_ring + p->sq_off.head);
+    r->sq_tail = (unsigned *)(r->sq_ring + p->sq_off.tail);
+    r->sq_mask = (unsigned *)(r->sq_ring + p->sq_off.ring_mask);
+    r->sq_flags = (unsigned *)(r->sq_ring + p->sq_off.flags);
+    r->sq_array = (unsigned *)(r->sq_ring + p->sq_off.array);
+    r->sq_entries = p->sq_entries;
+    r->cq_head = (unsigned *)(r->cq_ring + p->cq_off.head);
+    r->cq_tail = (unsigned *)(r->cq_ring + p->cq_off.tail);
+    r->cq_mask = (unsigned *)(r->cq_ring + p->cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(r->cq_ring + p->cq_off.cqes);
+    r->cq_entries = p->cq_entries;
+    return 0;
+}
+
+/* Register the backing files and the notifier at fixed indexes, so that
+ * the files can be swapped on a controller reset without rebuilding the
+ * ring */
+static int uring_files(NVMEState *n, NVMEUring *r, int reg)
+{
+    int fds[NVME_MAX_NAMESPACES + 1];
+    struct io_uring_files_update up;
+    uint32_t i;
+
+    for (i = 0; i < NVME_MAX_NAMESPACES; i++) {
+        fds[i] = (i < n->nr_namespaces) ? n->ns[i].fd : -1;
+    }
+    fds[NVME_URING_KICK_FILE] = event_notifier_get_fd(&r->notifier);
+
+    if (reg) {
+        return uring_register(r, IORING_REGISTER_FILES, fds,
+            NVME_MAX_NAMESPACES + 1);
+    }
+    memset(&up, 0, sizeof(up));
+    up.fds = (uintptr_t)fds;
+    return uring_register(r, IORING_REGISTER_FILES_UPDATE, &up,
+        NVME_MAX_NAMESPACES);
+}
+
+NVMEUring *nvme_uring_new(NVMEState *n, int thread)
+{
+    struct io_uring_params p;
+    NVMEUring *r;
+
+    r = qemu_mallocz(sizeof(*r));
+    r->thread = thread;
+    if (event_notifier_init(&r->notifier, 0) < 0) {
+        LOG_ERR("Unable to create the io_uring notifier");
+        qemu_free(r);
+        return NULL;
+    }
+
+    memset(&p, 0, sizeof(p));
+    if (n->flags & NVME_FLAG_URING_SQPOLL) {
+        p.flags |= IORING_SETUP_SQPOLL;
+        p.sq_thread_idle = NVME_URING_SQPOLL_IDLE_MS;
+    }
+    r->fd = syscall(__NR_io_uring_setup, NVME_URING_ENTRIES, &p);
+    if (r->fd < 0) {
+        LOG_ERR("Unable to set up an io_uring: %s", strerror(errno));
+        event_notifier_cleanup(&r->notifier);
+        qemu_free(r);
+        return NULL;
+    }
+    r->flags = p.flags;
+
+    if (uring_map(r, &p)) {
+        LOG_ERR("Unable to map the io_uring: %s", strerror(errno));
+        goto fail;
+    }
+    if (uring_files(n, r, 1) < 0) {
+        LOG_ERR("Unable to register the io_uring files: %s",
+            strerror(errno));
+        goto fail;
+    }
+    if (thread) {
+        uring_arm_kick(r);
+        nvme_uring_submit(r);
+    } else if (uring_register(r, IORING_REGISTER_EVENTFD,
+        &r->notifier.fd, 1) < 0) {
+        LOG_ERR("Unable to register the io_uring notifier: %s",
+            strerror(errno));
+        goto fail;
+    }
+    return r;
+
+fail:
+    nvme_uring_free(r);
+    return NULL;
+}
+
+/* The requests queued on the ring must have been reaped */
+void nvme_uring_free(NVMEUring *r)
+{
+    if (!r) {
+        return;
+    }
+    if (r->sqes) {
+        munmap(r->sqes, r->sqes_size);
+    }
+    if (r->cq_ring && r->cq_ring != r->sq_ring) {
+        munmap(r->cq_ring, r->cq_ring_size);
+    }
+    if (r->sq_ring) {
+        munmap(r->sq_ring, r->sq_ring_size);
+    }
+    close(r->fd);
+    event_notifier_cleanup(&r->notifier);
+    qemu_free(r);
+}
+
+/* Point the ring of every serving context at the current backing files */
+void nvme_uring_update_files(NVMEState *n)
+{
+    uint32_t i;
+
+    if (n->uring && uring_files(n, n->uring, 0) < 0) {
+        LOG_ERR("Unable to update the io_uring files: %s", strerror(errno));
+    }
+    for (i = 0; n->iothreads && i < n->nr_iothreads; i++) {
+        if (n->iothreads[i].uring &&
+            uring_files(n, n->iothreads[i].uring, 0) < 0) {
+            LOG_ERR("Unable to update the io_uring files: %s",
+                strerror(errno));
+        }
+    }
+}
+
+/* Queue a read or write of the backing file of namespace index ns_index.
+ * Returns FAIL when the ring is full. */
+int nvme_uring_queue_rw(NVMEUring *r, int write, uint32_t ns_index,
+    struct iovec *iov, int niov, uint64_t off, int dsync, void *opaque)
+{
+    struct io_uring_sqe *sqe;
+
+    /* Keep the completions within the CQ ring */
+    if (r->inflight + 1 >= r->cq_entries) {
+        return FAIL;
+    }
+    sqe = uring_get_sqe(r);
+    if (!sqe) {
+        return FAIL;
+    }
+    sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = ns_index;
+    sqe->addr = (uintptr_t)iov;
+    sqe->len = niov;
+    sqe->off = off;
+    if (dsync) {
+        sqe->rw_flags = RWF_DSYNC;
+    }
+    sqe->user_data = (uintptr_t)opaque;
+    uring_commit_sqe(r);
+    r->inflight++;
+    return 0;
+}
+
+/* Submit the SQEs queued so far. With SQPOLL the kernel thread picks them
+ * up by itself, unless it went idle. */
+void nvme_uring_submit(NVMEUring *r)
+{
+    unsigned flags = 0;
+    int ret;
+
+    if (!r->to_submit) {
+        return;
+    }
+    if (r->flags & IORING_SETUP_SQPOLL) {
+        __sync_synchronize();
+        if (!(*(volatile unsigned *)r->sq_flags & IORING_SQ_NEED_WAKEUP)) {
+            r->to_submit = 0;
+            return;
+        }
+        flags = IORING_ENTER_SQ_WAKEUP;
+    }
+
+    ret = uring_enter(r, r->to_submit, 0, flags);
+    if (ret < 0) {
+        /* Retried on the next submission */
+        if (errno != EAGAIN && errno != EBUSY && errno != EINTR) {
+            LOG_ERR("io_uring submission failed: %s", strerror(errno));
+        }
+        return;
+    }
+    if (r->flags & IORING_SETUP_SQPOLL || ret >= r->to_submit) {
+        r->to_submit = 0;
+    } else {
+        r->to_submit -= ret;
+    }
+}
+
+/* Whether the ring has completions to reap */
+int nvme_uring_ready(NVMEUring *r)
+{
+    __sync_synchronize();
+    return *(volatile unsigned *)r->cq_head !=
+        *(volatile unsigned *)r->cq_tail;
+}
+
+uint32_t nvme_uring_inflight(NVMEUring *r)
+{
+    return r->inflight;
+}
+
+/* Pop the next request completion, res being the result of the read or
+ * write. Returns 0 once the CQ ring is empty. */
+int nvme_uring_next(NVMEUring *r, void **opaque, int *res)
+{
+    struct io_uring_cqe *cqe;
+    unsigned head;
+    uint64_t data;
+
+    while (nvme_uring_ready(r)) {
+        head = *r->cq_head;
+        cqe = &r->cqes[head & *r->cq_mask];
+        data = cqe->user_data;
+        *res = cqe->res;
+        /* The CQE must be read before the kernel may reuse the slot */
+        __sync_synchronize();
+        *(volatile unsigned *)r->cq_head = head + 1;
+
+        if (data == NVME_URING_KICK) {
+            event_notifier_test_and_clear(&r->notifier);
+            uring_arm_kick(r);
+            continue;
+        }
+        r->inflight--;
+        *opaque = (void *)(uintptr_t)data;
+        return 1;
+    }
+    return 0;
+}
+
+/* Sleep until the ring has a completion. This does not submit, so that an
+ * I/O thread can wait while the main loop owns the ring. */
+void nvme_uring_wait(NVMEUring *r)
+{
+    if (uring_enter(r, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+        errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        LOG_ERR("io_uring wait failed: %s", strerror(errno));
+    }
+}
+
+/* Wake up the I/O thread sleeping in nvme_uring_wait() */
+void nvme_uring_kick(NVMEUring *r)
+{
+    event_notifier_set(&r->notifier);
+}
+
+/* Completions of the main loop ring */
+static void uring_main_read(void *opaque)
+{
+    NVMEState *n = opaque;
+
+    event_notifier_test_and_clear(&n->uring->notifier);
+    nvme_uring_complete(n, n->uring);
+    nvme_uring_submit(n->uring);
+}
+
+/* Set up the ring of the main loop, when it serves the I/O queues */
+int nvme_uring_init(NVMEState *n)
+{
+    if (n->nr_iothreads) {
+        return 0;
+    }
+    n->uring = nvme_uring_new(n, 0);
+    if (!n->uring) {
+        return FAIL;
+    }
+    qemu_set_fd_handler(event_notifier_get_fd(&n->uring->notifier),
+        uring_main_read, NULL, n);
+    LOG_NORM("io_uring engine enabled%s",
+        (n->flags & NVME_FLAG_URING_SQPOLL) ? " with SQ polling" : "");
+    return 0;
+}
+
+void nvme_uring_exit(NVMEState *n)
+{
+    if (!n->uring) {
+        return;
+    }
+    nvme_uring_cancel(n, n->uring, NVME_MAX_QID);
+    qemu_set_fd_handler(event_notifier_get_fd(&n->uring->notifier),
+        NULL, NULL, NULL);
+    nvme_uring_free(n->uring);
+    n->uring = NULL;
+}
+
+#else
+
+NVMEUring *nvme_uring_new(NVMEState *n, int thread)
+{
+    return NULL;
+}
+
+void nvme_uring_free(NVMEUring *r)
+{
+}
+
+void nvme_uring_update_files(NVMEState *n)
+{
+}
+
+int nvme_uring_queue_rw(NVMEUring *r, int write, uint32_t ns_index,
+    struct iovec *iov, int niov, uint64_t off, int dsync, void *opaque)
+{
+    return FAIL;
+}
+
+void nvme_uring_submit(NVMEUring *r)
+{
+}
+
+int nvme_uring_ready(NVMEUring *r)
+{
+    return 0;
+}
+
+uint32_t nvme_uring_inflight(NVMEUring *r)
+{
+    return 0;
+}
+
+int nvme_uring_next(NVMEUring *r, void **opaque, int *res)
+{
+    return 0;
+}
+
+void nvme_uring_wait(NVMEUring *r)
+{
+}
+
+void nvme_uring_kick(NVMEUring *r)
+{
+}
+
+int nvme_uring_init(NVMEState *n)
+{
+    LOG_ERR("uring: QEMU was built without io_uring support");
+    return FAIL;
+}
+
+void nvme_uring_exit(NVMEState *n)
+{
+}
+
+#endif
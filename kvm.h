@@ -195,5 +195,8 @@ int kvm_physical_memory_addr_from_ram(KVMState *s, ram_addr_t ram_addr,
 #endif
 int kvm_set_ioeventfd_mmio_long(int fd, uint32_t adr, uint32_t val, bool assign);
 
+/* Signal fd on any 32bit write to adr; the written value is dropped */
+int kvm_set_ioeventfd_mmio_kick(int fd, uint64_t adr, bool assign);
+
 int kvm_set_ioeventfd_pio_word(int fd, uint16_t adr, uint16_t val, bool assign);
 #endif
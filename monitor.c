@@ -2442,6 +2442,33 @@ static void do_info_kvm(Monitor *mon, QObject **ret_data)
 #endif
 }
 
+static MonitorInfoNew *nvme_info_handler;
+static MonitorUserPrint *nvme_print_handler;
+
+void monitor_set_nvme_handlers(MonitorInfoNew *info, MonitorUserPrint *print)
+{
+    nvme_info_handler = info;
+    nvme_print_handler = print;
+}
+
+static void do_info_nvme_print(Monitor *mon, const QObject *data)
+{
+    if (!nvme_print_handler) {
+        monitor_printf(mon, "No NVMe controller\n");
+        return;
+    }
+    nvme_print_handler(mon, data);
+}
+
+static void do_info_nvme(Monitor *mon, QObject **ret_data)
+{
+    if (!nvme_info_handler) {
+        *ret_data = QOBJECT(qlist_new());
+        return;
+    }
+    nvme_info_handler(mon, ret_data);
+}
+
 static void do_info_numa(Monitor *mon)
 {
     int i;
@@ -2934,6 +2961,14 @@ static const mon_cmd_t info_cmds[] = {
         .user_print = do_info_kvm_print,
         .mhandler.info_new = do_info_kvm,
     },
+    {
+        .name       = "nvme",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show NVMe controller statistics",
+        .user_print = do_info_nvme_print,
+        .mhandler.info_new = do_info_nvme,
+    },
     {
         .name       = "numa",
         .args_type  = "",
@@ -3180,6 +3215,14 @@ static const mon_cmd_t qmp_query_cmds[] = {
         .user_print = do_info_kvm_print,
         .mhandler.info_new = do_info_kvm,
     },
+    {
+        .name       = "nvme",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show NVMe controller statistics",
+        .user_print = do_info_nvme_print,
+        .mhandler.info_new = do_info_nvme,
+    },
     {
         .name       = "status",
         .args_type  = "",
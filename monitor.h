@@ -60,6 +60,11 @@ void monitor_flush(Monitor *mon);
 
 typedef void (MonitorCompletion)(void *opaque, QObject *ret_data);
 
+/* "info nvme" and query-nvme, served by the NVMe controller model */
+typedef void (MonitorInfoNew)(Monitor *mon, QObject **ret_data);
+typedef void (MonitorUserPrint)(Monitor *mon, const QObject *data);
+void monitor_set_nvme_handlers(MonitorInfoNew *info, MonitorUserPrint *print);
+
 void monitor_set_error(Monitor *mon, QError *qerror);
 
 #endif /* !MONITOR_H */
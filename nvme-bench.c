@@ -0,0 +1,1705 @@
+/*
+ * NVMe controller benchmark
+ *
+ * Copyright (c) 2011 Intel Corporation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ *
+ * Runs the NVMe device model without a guest. The controller is
+ * instantiated against a synthetic guest RAM and driven through BAR0 the
+ * way a host driver would: the tool sets up the admin queues, creates the
+ * I/O queue pairs, keeps them filled with reads and writes and reaps the
+ * completions by polling the CQ phase tags. Only the PCI, MSI-X, memory
+ * and main loop services the controller uses are provided here.
+ */
+
+#include <getopt.h>
+#include <sys/select.h>
+#include "qemu-common.h"
+#include "qemu-timer.h"
+#include "qemu-char.h"
+#include "monitor.h"
+#include "qjson.h"
+#include "qstring.h"
+#include "block_int.h"
+#include "kvm.h"
+#include "hw/nvme.h"
+
+#define BENCH_PAGE_SIZE 4096
+/* Guest physical address of the synthetic RAM; 0 means "unset" to the
+ * controller. */
+#define BENCH_RAM_BASE 0x100000ULL
+#define BENCH_BAR0_ADDR 0xfe000000ULL
+#define BENCH_CMB_ADDR 0xc0000000ULL
+#define BENCH_MSIX_CAP 0x40
+#define BENCH_ADMIN_ENTRIES 32
+#define BENCH_IO_VECTOR 1
+
+/* Synthetic guest memory, allocated with a bump pointer */
+static uint8_t *guest_ram;
+static uint64_t guest_ram_size;
+static uint64_t guest_ram_used;
+
+static uint64_t guest_alloc(uint64_t size)
+{
+    uint64_t addr;
+
+    size = (size + BENCH_PAGE_SIZE - 1) & ~(uint64_t)(BENCH_PAGE_SIZE - 1);
+    if (guest_ram_used + size > guest_ram_size) {
+        fprintf(stderr, "nvme-bench: out of guest memory, use -m\n");
+        exit(1);
+    }
+    addr = BENCH_RAM_BASE + guest_ram_used;
+    guest_ram_used += size;
+    return addr;
+}
+
+/* Controller Memory Buffer, the RAM the controller allocates for its
+ * BAR, mapped at BENCH_CMB_ADDR */
+static uint8_t *cmb_ram;
+static uint64_t cmb_size;
+static uint64_t cmb_used;
+
+static int guest_is_cmb(target_phys_addr_t addr)
+{
+    return addr >= BENCH_CMB_ADDR && addr - BENCH_CMB_ADDR < cmb_size;
+}
+
+static uint64_t cmb_alloc(uint64_t size)
+{
+    uint64_t addr;
+
+    size = (size + BENCH_PAGE_SIZE - 1) & ~(uint64_t)(BENCH_PAGE_SIZE - 1);
+    if (cmb_used + size > cmb_size) {
+        fprintf(stderr, "nvme-bench: out of controller memory, raise "
+            "cmb_size_mb\n");
+        exit(1);
+    }
+    addr = BENCH_CMB_ADDR + cmb_used;
+    cmb_used += size;
+    return addr;
+}
+
+static void *guest_ptr(uint64_t addr)
+{
+    if (guest_is_cmb(addr)) {
+        return cmb_ram + (addr - BENCH_CMB_ADDR);
+    }
+    return guest_ram + (addr - BENCH_RAM_BASE);
+}
+
+static int guest_is_ram(target_phys_addr_t addr)
+{
+    return addr >= BENCH_RAM_BASE && addr - BENCH_RAM_BASE < guest_ram_size;
+}
+
+void cpu_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf,
+                            int len, int is_write)
+{
+    if ((!guest_is_ram(addr) || !guest_is_ram(addr + len - 1)) &&
+        (!guest_is_cmb(addr) || !guest_is_cmb(addr + len - 1))) {
+        if (!is_write) {
+            memset(buf, 0xff, len);
+        }
+        return;
+    }
+    if (is_write) {
+        memcpy(guest_ptr(addr), buf, len);
+    } else {
+        memcpy(buf, guest_ptr(addr), len);
+    }
+}
+
+ram_addr_t cpu_get_physical_page_desc(target_phys_addr_t addr)
+{
+    return guest_is_ram(addr) || guest_is_cmb(addr) ? IO_MEM_RAM :
+        IO_MEM_UNASSIGNED;
+}
+
+void *cpu_physical_memory_map(target_phys_addr_t addr,
+                              target_phys_addr_t *plen,
+                              int is_write)
+{
+    uint64_t end = BENCH_RAM_BASE + guest_ram_size;
+
+    if (!guest_is_ram(addr)) {
+        return NULL;
+    }
+    if (addr + *plen > end) {
+        *plen = end - addr;
+    }
+    return guest_ptr(addr);
+}
+
+void cpu_physical_memory_unmap(void *buffer, target_phys_addr_t len,
+                               int is_write, target_phys_addr_t access_len)
+{
+}
+
+ram_addr_t qemu_ram_alloc(DeviceState *dev, const char *name,
+                          ram_addr_t size)
+{
+    cmb_ram = qemu_memalign(BENCH_PAGE_SIZE, size);
+    memset(cmb_ram, 0, size);
+    cmb_size = size;
+    return 0;
+}
+
+void *qemu_get_ram_ptr(ram_addr_t addr)
+{
+    return cmb_ram + addr;
+}
+
+void qemu_ram_free(ram_addr_t addr)
+{
+}
+
+void *cpu_register_map_client(void *opaque, void (*callback)(void *opaque))
+{
+    return NULL;
+}
+
+/* The io memory regions of BAR0 as registered and mapped by the
+ * controller, its registers and its doorbells. Index i is io memory
+ * i + 1, 0 being IO_MEM_RAM. */
+#define BENCH_IO_REGIONS 2
+static struct {
+    CPUReadMemoryFunc * const *read;
+    CPUWriteMemoryFunc * const *write;
+    void *opaque;
+    target_phys_addr_t start;
+    ram_addr_t size;
+} io_regions[BENCH_IO_REGIONS];
+static int nr_io_regions;
+
+int cpu_register_io_memory(CPUReadMemoryFunc * const *mem_read,
+                           CPUWriteMemoryFunc * const *mem_write,
+                           void *opaque, enum device_endian endian)
+{
+    assert(nr_io_regions < BENCH_IO_REGIONS);
+    io_regions[nr_io_regions].read = mem_read;
+    io_regions[nr_io_regions].write = mem_write;
+    io_regions[nr_io_regions].opaque = opaque;
+    return ++nr_io_regions;
+}
+
+void cpu_register_physical_memory_log(target_phys_addr_t start_addr,
+                                      ram_addr_t size,
+                                      ram_addr_t phys_offset,
+                                      ram_addr_t region_offset,
+                                      bool log_dirty)
+{
+    if (phys_offset && phys_offset <= nr_io_regions) {
+        io_regions[phys_offset - 1].start = start_addr;
+        io_regions[phys_offset - 1].size = size;
+    }
+}
+
+/* The region of BAR0 offset addr, addr becoming the offset in it */
+static int bench_io_region(target_phys_addr_t *addr)
+{
+    int i;
+
+    *addr += BENCH_BAR0_ADDR;
+    for (i = 0; i < nr_io_regions; i++) {
+        if (*addr >= io_regions[i].start &&
+            *addr - io_regions[i].start < io_regions[i].size) {
+            *addr -= io_regions[i].start;
+            return i;
+        }
+    }
+    abort();
+}
+
+static void mmio_writel(target_phys_addr_t addr, uint32_t val)
+{
+    int i = bench_io_region(&addr);
+
+    io_regions[i].write[2](io_regions[i].opaque, addr, val);
+}
+
+static uint32_t mmio_readl(target_phys_addr_t addr)
+{
+    int i = bench_io_region(&addr);
+
+    return io_regions[i].read[2](io_regions[i].opaque, addr);
+}
+
+/* PCI and MSI-X */
+static PCIDeviceInfo *nvme_info;
+static PCIMapIORegionFunc *bar0_map;
+static PCIMapIORegionFunc *cmb_map;
+static uint64_t nr_irqs;
+
+void pci_qdev_register(PCIDeviceInfo *info)
+{
+    if (!strcmp(info->qdev.name, "nvme")) {
+        nvme_info = info;
+    }
+}
+
+void pci_register_bar(PCIDevice *pci_dev, int region_num,
+                      pcibus_t size, uint8_t type,
+                      PCIMapIORegionFunc *map_func)
+{
+    if (region_num == 0) {
+        bar0_map = map_func;
+    } else if (region_num == NVME_CMB_BIR) {
+        cmb_map = map_func;
+    }
+}
+
+uint32_t pci_default_read_config(PCIDevice *d, uint32_t address, int len)
+{
+    uint32_t val = 0;
+
+    memcpy(&val, d->config + address, len);
+    return le32_to_cpu(val);
+}
+
+void pci_default_write_config(PCIDevice *d, uint32_t address, uint32_t val,
+                              int len)
+{
+}
+
+int msix_init(PCIDevice *pdev, unsigned short nentries,
+              unsigned bar_nr, unsigned bar_size)
+{
+    pdev->msix_entries_nr = nentries;
+    pdev->msix_cap = BENCH_MSIX_CAP;
+    pdev->msix_bar_size = bar_size + 2 * BENCH_PAGE_SIZE;
+    pdev->cap_present |= QEMU_PCI_CAP_MSIX;
+    /* Report MSI-X as enabled by the guest */
+    pdev->config[BENCH_MSIX_CAP + 3] |= 0x80;
+    return 0;
+}
+
+void msix_mmio_map(PCIDevice *pci_dev, int region_num,
+                   pcibus_t addr, pcibus_t size, int type)
+{
+}
+
+int msix_vector_use(PCIDevice *dev, unsigned vector)
+{
+    return 0;
+}
+
+void msix_notify(PCIDevice *dev, unsigned vector)
+{
+    nr_irqs++;
+}
+
+int kvm_has_many_ioeventfds(void)
+{
+    return 0;
+}
+
+int kvm_set_ioeventfd_mmio_kick(int fd, uint64_t addr, bool assign)
+{
+    return -ENOSYS;
+}
+
+/* qdev properties of the controller, set from -o */
+static int parse_uint32(DeviceState *dev, Property *prop, const char *str)
+{
+    uint32_t *ptr = (void *)dev + prop->offset;
+    char *end;
+
+    *ptr = strtoul(str, &end, 0);
+    return *end ? -EINVAL : 0;
+}
+
+static int parse_bit(DeviceState *dev, Property *prop, const char *str)
+{
+    uint32_t *ptr = (void *)dev + prop->offset;
+
+    if (!strcmp(str, "on")) {
+        *ptr |= 1U << prop->bitnr;
+    } else if (!strcmp(str, "off")) {
+        *ptr &= ~(1U << prop->bitnr);
+    } else {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static int parse_string(DeviceState *dev, Property *prop, const char *str)
+{
+    char **ptr = (void *)dev + prop->offset;
+
+    qemu_free(*ptr);
+    *ptr = qemu_strdup(str);
+    return 0;
+}
+
+static int bench_bdrv_flags = BDRV_O_RDWR | BDRV_O_CACHE_WB;
+
+static int parse_drive(DeviceState *dev, Property *prop, const char *str)
+{
+    BlockDriverState **ptr = (void *)dev + prop->offset;
+    BlockDriverState *bs;
+
+    bs = bdrv_new("nvme-bench");
+    if (bdrv_open(bs, str, bench_bdrv_flags, NULL) < 0) {
+        fprintf(stderr, "nvme-bench: can't open %s\n", str);
+        bdrv_delete(bs);
+        return -EINVAL;
+    }
+    *ptr = bs;
+    return 0;
+}
+
+PropertyInfo qdev_prop_uint32 = {
+    .name  = "uint32",
+    .type  = PROP_TYPE_UINT32,
+    .size  = sizeof(uint32_t),
+    .parse = parse_uint32,
+};
+
+PropertyInfo qdev_prop_bit = {
+    .name  = "on/off",
+    .type  = PROP_TYPE_BIT,
+    .size  = sizeof(uint32_t),
+    .parse = parse_bit,
+};
+
+PropertyInfo qdev_prop_string = {
+    .name  = "string",
+    .type  = PROP_TYPE_STRING,
+    .size  = sizeof(char *),
+    .parse = parse_string,
+};
+
+PropertyInfo qdev_prop_drive = {
+    .name  = "drive",
+    .type  = PROP_TYPE_DRIVE,
+    .size  = sizeof(BlockDriverState *),
+    .parse = parse_drive,
+};
+
+static void set_prop_defaults(DeviceState *dev, Property *prop)
+{
+    for (; prop->name; prop++) {
+        void *ptr = (void *)dev + prop->offset;
+
+        if (!prop->defval) {
+            continue;
+        }
+        if (prop->info->type == PROP_TYPE_BIT) {
+            parse_bit(dev, prop, *(bool *)prop->defval ? "on" : "off");
+        } else {
+            memcpy(ptr, prop->defval, prop->info->size);
+        }
+    }
+}
+
+static int set_props(DeviceState *dev, Property *props, char *opts)
+{
+    char *opt, *val, *save = NULL;
+    Property *prop;
+
+    for (opt = strtok_r(opts, ",", &save); opt;
+         opt = strtok_r(NULL, ",", &save)) {
+        val = strchr(opt, '=');
+        if (!val) {
+            fprintf(stderr, "nvme-bench: expected name=value: %s\n", opt);
+            return -1;
+        }
+        *val++ = 0;
+        for (prop = props; prop->name; prop++) {
+            if (!strcmp(prop->name, opt)) {
+                break;
+            }
+        }
+        if (!prop->name) {
+            fprintf(stderr, "nvme-bench: unknown property %s\n", opt);
+            return -1;
+        }
+        if (prop->info->parse(dev, prop, val) < 0) {
+            fprintf(stderr, "nvme-bench: bad value for %s: %s\n", opt, val);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Main loop services: monitor stubs, timers and fd handlers */
+Monitor *cur_mon;
+QEMUClock *rt_clock;
+QEMUClock *vm_clock;
+QEMUClock *host_clock;
+
+void qemu_service_io(void)
+{
+}
+
+int monitor_cur_is_qmp(void)
+{
+    return 0;
+}
+
+void monitor_set_error(Monitor *mon, QError *qerror)
+{
+}
+
+/* Only "info nvme" prints through the monitor */
+void monitor_vprintf(Monitor *mon, const char *fmt, va_list ap)
+{
+    vprintf(fmt, ap);
+}
+
+void monitor_printf(Monitor *mon, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+}
+
+static MonitorInfoNew *nvme_stats_info;
+static MonitorUserPrint *nvme_stats_print;
+
+void monitor_set_nvme_handlers(MonitorInfoNew *info, MonitorUserPrint *print)
+{
+    nvme_stats_info = info;
+    nvme_stats_print = print;
+}
+
+void monitor_print_filename(Monitor *mon, const char *filename)
+{
+}
+
+void monitor_protocol_event(MonitorEvent event, QObject *data)
+{
+}
+
+struct QEMUTimer {
+    int64_t expire_time;
+    int scale;
+    int pending;
+    QEMUTimerCB *cb;
+    void *opaque;
+    QLIST_ENTRY(QEMUTimer) next;
+};
+
+static QLIST_HEAD(, QEMUTimer) timers = QLIST_HEAD_INITIALIZER(timers);
+
+int64_t qemu_get_clock_ns(QEMUClock *clock)
+{
+    return get_clock();
+}
+
+QEMUTimer *qemu_new_timer(QEMUClock *clock, int scale,
+                          QEMUTimerCB *cb, void *opaque)
+{
+    QEMUTimer *ts = qemu_mallocz(sizeof(*ts));
+
+    ts->scale = scale;
+    ts->cb = cb;
+    ts->opaque = opaque;
+    QLIST_INSERT_HEAD(&timers, ts, next);
+    return ts;
+}
+
+void qemu_free_timer(QEMUTimer *ts)
+{
+    QLIST_REMOVE(ts, next);
+    qemu_free(ts);
+}
+
+void qemu_del_timer(QEMUTimer *ts)
+{
+    ts->pending = 0;
+}
+
+void qemu_mod_timer(QEMUTimer *ts, int64_t expire_time)
+{
+    ts->expire_time = expire_time * ts->scale;
+    ts->pending = 1;
+}
+
+int qemu_timer_pending(QEMUTimer *ts)
+{
+    return ts->pending;
+}
+
+/* Run the expired timers, return the ns until the next one or -1 */
+static int64_t run_timers(void)
+{
+    QEMUTimer *ts;
+    int64_t now, next;
+    int ran;
+
+    do {
+        ran = 0;
+        next = -1;
+        now = get_clock();
+        QLIST_FOREACH(ts, &timers, next) {
+            if (!ts->pending) {
+                continue;
+            }
+            if (ts->expire_time <= now) {
+                ts->pending = 0;
+                ts->cb(ts->opaque);
+                ran = 1;
+                break;
+            }
+            if (next < 0 || ts->expire_time - now < next) {
+                next = ts->expire_time - now;
+            }
+        }
+    } while (ran);
+    return next;
+}
+
+typedef struct IOHandlerRecord {
+    int fd;
+    IOCanReadHandler *fd_read_poll;
+    IOHandler *fd_read;
+    IOHandler *fd_write;
+    void *opaque;
+    QLIST_ENTRY(IOHandlerRecord) next;
+} IOHandlerRecord;
+
+static QLIST_HEAD(, IOHandlerRecord) io_handlers =
+    QLIST_HEAD_INITIALIZER(io_handlers);
+static int event_pending;
+
+int qemu_set_fd_handler2(int fd, IOCanReadHandler *fd_read_poll,
+                         IOHandler *fd_read, IOHandler *fd_write,
+                         void *opaque)
+{
+    IOHandlerRecord *ioh;
+
+    QLIST_FOREACH(ioh, &io_handlers, next) {
+        if (ioh->fd == fd) {
+            break;
+        }
+    }
+    if (!fd_read && !fd_write) {
+        if (ioh) {
+            QLIST_REMOVE(ioh, next);
+            qemu_free(ioh);
+        }
+        return 0;
+    }
+    if (!ioh) {
+        ioh = qemu_mallocz(sizeof(*ioh));
+        QLIST_INSERT_HEAD(&io_handlers, ioh, next);
+    }
+    ioh->fd = fd;
+    ioh->fd_read_poll = fd_read_poll;
+    ioh->fd_read = fd_read;
+    ioh->fd_write = fd_write;
+    ioh->opaque = opaque;
+    return 0;
+}
+
+int qemu_set_fd_handler(int fd, IOHandler *fd_read, IOHandler *fd_write,
+                        void *opaque)
+{
+    return qemu_set_fd_handler2(fd, NULL, fd_read, fd_write, opaque);
+}
+
+void qemu_notify_event(void)
+{
+    event_pending = 1;
+}
+
+/* One main loop iteration. Blocks until a fd is ready or a timer expires,
+ * unless something is already pending. */
+static void bench_loop_wait(int nonblocking)
+{
+    IOHandlerRecord *ioh, *next;
+    struct timeval tv;
+    fd_set rfds, wfds;
+    int64_t timeout;
+    int nfds = -1, ret;
+
+    while (qemu_bh_poll()) {
+    }
+    timeout = run_timers();
+    if (nonblocking || event_pending) {
+        timeout = 0;
+    } else if (timeout < 0 || timeout > 10000000) {
+        timeout = 10000000;
+    }
+    event_pending = 0;
+
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    QLIST_FOREACH(ioh, &io_handlers, next) {
+        if (ioh->fd_read &&
+            (!ioh->fd_read_poll || ioh->fd_read_poll(ioh->opaque))) {
+            FD_SET(ioh->fd, &rfds);
+            nfds = MAX(nfds, ioh->fd);
+        }
+        if (ioh->fd_write) {
+            FD_SET(ioh->fd, &wfds);
+            nfds = MAX(nfds, ioh->fd);
+        }
+    }
+
+    tv.tv_sec = timeout / 1000000000;
+    tv.tv_usec = (timeout % 1000000000) / 1000;
+    ret = select(nfds + 1, &rfds, &wfds, NULL, &tv);
+    if (ret > 0) {
+        QLIST_FOREACH_SAFE(ioh, &io_handlers, next, next) {
+            if (ioh->fd_read && FD_ISSET(ioh->fd, &rfds)) {
+                ioh->fd_read(ioh->opaque);
+            }
+            if (ioh->fd_write && FD_ISSET(ioh->fd, &wfds)) {
+                ioh->fd_write(ioh->opaque);
+            }
+        }
+    }
+    run_timers();
+    while (qemu_bh_poll()) {
+    }
+}
+
+/* Host driver side */
+typedef struct BenchQueue {
+    uint16_t qid;
+    uint16_t entries;
+    uint16_t sq_tail;
+    uint16_t cq_head;
+    uint16_t sq_db; /* values last written to the doorbell registers */
+    uint16_t cq_db;
+    uint8_t phase;
+    uint8_t prio;
+    uint64_t sq_addr;
+    uint64_t cq_addr;
+    uint64_t done;
+    int64_t lat_sum;
+} BenchQueue;
+
+typedef struct BenchSlot {
+    uint64_t buf;
+    uint64_t prp1;
+    uint64_t prp2;
+    NVMESglDesc sgl;  /* data pointer with -g */
+    uint64_t slba;
+    uint8_t opcode;
+    int64_t start;
+} BenchSlot;
+
+static BenchQueue admin_q;
+static BenchQueue *io_q;
+static BenchSlot *slots;
+
+static uint32_t nr_queues = 1;
+static uint32_t qdepth = 32;
+static uint32_t block_size = 4096;
+static uint32_t write_pct;
+static uint32_t flush_pct;
+static int write_through;
+static int random_io;
+static int scatter;
+static int verify;
+static int trim;
+static int zero_cmp;
+static int wrr;
+static int dbbuf;
+static int use_cmb;
+static int use_sgl;
+/* Doorbell Buffer Config buffers: shadow doorbells, then EventIdx */
+static uint64_t dbbuf_addr;
+static uint32_t dbbuf_size;
+/* CAP.DSTRD */
+static uint32_t dstrd;
+static uint64_t nr_doorbells;
+static uint32_t arbitration;
+static uint32_t coalescing;
+static uint64_t nr_ios = 100000;
+/* Namespaces, from Identify. Queue q issues to namespace q % nr_ns */
+static uint32_t nr_ns;
+static uint64_t ns_blocks[NVME_MAX_NAMESPACES];
+/* LBAs the run issues to: the whole namespace, or what the write pass of
+ * -v covered for its read pass */
+static uint64_t ns_io_blocks[NVME_MAX_NAMESPACES];
+static uint32_t ns_lba_size[NVME_MAX_NAMESPACES];
+static uint64_t seq_lba[NVME_MAX_NAMESPACES];
+static uint64_t seq_end[NVME_MAX_NAMESPACES]; /* highest LBA reached + 1 */
+
+static uint64_t nr_done, nr_issued, nr_errors, nr_miscompares, bytes_done;
+static int64_t *lat;
+
+static void bench_queue_init(BenchQueue *q, uint16_t qid, uint16_t entries)
+{
+    q->qid = qid;
+    q->entries = entries;
+    q->sq_tail = 0;
+    q->cq_head = 0;
+    q->sq_db = 0;
+    q->cq_db = 0;
+    q->phase = 1;
+    if (use_cmb && qid) {
+        q->sq_addr = cmb_alloc(entries * sizeof(NVMECmd));
+    } else {
+        q->sq_addr = guest_alloc(entries * sizeof(NVMECmd));
+    }
+    q->cq_addr = guest_alloc(entries * sizeof(NVMECQE));
+    memset(guest_ptr(q->sq_addr), 0, entries * sizeof(NVMECmd));
+    memset(guest_ptr(q->cq_addr), 0, entries * sizeof(NVMECQE));
+}
+
+static void bench_submit(BenchQueue *q, NVMECmd *cmd)
+{
+    NVMECmd *sq = guest_ptr(q->sq_addr);
+
+    sq[q->sq_tail] = *cmd;
+    q->sq_tail = (q->sq_tail + 1) % q->entries;
+}
+
+/* Update the shadow of a doorbell, and tell whether the doorbell register
+ * must be written as well: the EventIdx lies between the last value
+ * written and the new one */
+static int bench_shadow_db(BenchQueue *q, uint32_t off, uint16_t old,
+    uint16_t val)
+{
+    uint32_t *db = guest_ptr(dbbuf_addr + off);
+    uint32_t *ei = guest_ptr(dbbuf_addr + dbbuf_size + off);
+    uint16_t e = q->entries;
+
+    *db = cpu_to_le32(val);
+    __sync_synchronize();
+    return (val + 2 * e - le32_to_cpu(*ei) - 1) % e < (val + e - old) % e;
+}
+
+static void bench_ring_sq(BenchQueue *q)
+{
+    __sync_synchronize();
+    if (q->sq_tail == q->sq_db) {
+        return;
+    }
+    if (dbbuf && q->qid && !bench_shadow_db(q, NVME_DBBUF_SQ(q->qid, dstrd),
+        q->sq_db, q->sq_tail)) {
+        q->sq_db = q->sq_tail;
+        return;
+    }
+    q->sq_db = q->sq_tail;
+    nr_doorbells++;
+    mmio_writel(NVME_SQyTDBL(q->qid, dstrd), q->sq_tail);
+}
+
+/* Return the next completion of q, or NULL */
+static NVMECQE *bench_reap(BenchQueue *q)
+{
+    NVMECQE *cqe = (NVMECQE *)guest_ptr(q->cq_addr) + q->cq_head;
+    NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
+
+    __sync_synchronize();
+    if (sf->p != q->phase) {
+        return NULL;
+    }
+    if (++q->cq_head == q->entries) {
+        q->cq_head = 0;
+        q->phase = !q->phase;
+    }
+    return cqe;
+}
+
+static void bench_ring_cq(BenchQueue *q)
+{
+    if (q->cq_head == q->cq_db) {
+        return;
+    }
+    if (dbbuf && q->qid && !bench_shadow_db(q, NVME_DBBUF_CQ(q->qid, dstrd),
+        q->cq_db, q->cq_head)) {
+        q->cq_db = q->cq_head;
+        return;
+    }
+    q->cq_db = q->cq_head;
+    nr_doorbells++;
+    mmio_writel(NVME_CQyHDBL(q->qid, dstrd), q->cq_head);
+}
+
+/* Run an admin command to completion */
+static int bench_admin(NVMECmd *cmd)
+{
+    NVMECQE *cqe;
+    NVMEStatusField *sf;
+    int i;
+
+    bench_submit(&admin_q, cmd);
+    bench_ring_sq(&admin_q);
+    for (i = 0; i < 1000; i++) {
+        cqe = bench_reap(&admin_q);
+        if (cqe) {
+            bench_ring_cq(&admin_q);
+            sf = (NVMEStatusField *)&cqe->status;
+            return sf->sc;
+        }
+        bench_loop_wait(i == 0);
+    }
+    fprintf(stderr, "nvme-bench: admin command 0x%02x timed out\n",
+        cmd->opcode);
+    exit(1);
+}
+
+static void bench_enable(void)
+{
+    int i;
+
+    bench_queue_init(&admin_q, 0, BENCH_ADMIN_ENTRIES);
+    mmio_writel(NVME_AQA, ((BENCH_ADMIN_ENTRIES - 1) << 16) |
+        (BENCH_ADMIN_ENTRIES - 1));
+    mmio_writel(NVME_ASQ, (uint32_t)admin_q.sq_addr);
+    mmio_writel(NVME_ASQ + 4, admin_q.sq_addr >> 32);
+    mmio_writel(NVME_ACQ, (uint32_t)admin_q.cq_addr);
+    mmio_writel(NVME_ACQ + 4, admin_q.cq_addr >> 32);
+    /* 64 byte SQEs, 16 byte CQEs */
+    mmio_writel(NVME_CC, (4 << 20) | (6 << 16) |
+        ((wrr ? NVME_CC_AMS_WRR : NVME_CC_AMS_RR) << 11) | CC_EN);
+    for (i = 0; i < 1000 && !(mmio_readl(NVME_CTST) & 1); i++) {
+        bench_loop_wait(0);
+    }
+    if (!(mmio_readl(NVME_CTST) & 1)) {
+        fprintf(stderr, "nvme-bench: controller not ready\n");
+        exit(1);
+    }
+}
+
+static void bench_set_feature(uint8_t fid, uint32_t cdw11)
+{
+    NVMEAdmCmdFeatures f;
+    int sc;
+
+    memset(&f, 0, sizeof(f));
+    f.opcode = NVME_ADM_CMD_SET_FEATURES;
+    f.cid = 0xffff;
+    f.fid = fid;
+    f.cdw11 = cdw11;
+    sc = bench_admin((NVMECmd *)&f);
+    if (sc) {
+        fprintf(stderr, "nvme-bench: set feature 0x%x failed: 0x%x\n",
+            fid, sc);
+        exit(1);
+    }
+}
+
+/* Read the SMART / Health log across a page boundary, and the Error
+ * Information log after a failing Get Log Page */
+static void bench_smart_log(void)
+{
+    NVMEAdmCmdGetLogPage c;
+    NVMESmartLog smart;
+    NVMEErrorLogEntry err;
+    uint64_t buf = guest_alloc(2 * BENCH_PAGE_SIZE);
+    int sc;
+
+    memset(&c, 0, sizeof(c));
+    c.opcode = NVME_ADM_CMD_GET_LOG_PAGE;
+    c.cid = 0xfffd;
+    c.nsid = 0xffffffff;
+    c.prp1 = buf + BENCH_PAGE_SIZE - 256;
+    c.prp2 = buf + BENCH_PAGE_SIZE;
+    c.lid = NVME_LOG_SMART_INFO;
+    c.numd = sizeof(smart) / 4 - 1;
+    sc = bench_admin((NVMECmd *)&c);
+    memcpy(&smart, guest_ptr(c.prp1), sizeof(smart));
+    printf("smart-log: sc 0x%x temp %u spare %u%% units read %"PRIu64
+        " written %"PRIu64" read cmds %"PRIu64" write cmds %"PRIu64
+        " busy %"PRIu64" min power on %"PRIu64" h errors %"PRIu64"\n",
+        sc, smart.temperature[0] | smart.temperature[1] << 8,
+        smart.available_spare, smart.data_units_read[0],
+        smart.data_units_written[0], smart.host_read_commands[0],
+        smart.host_write_commands[0], smart.controller_busy_time[0],
+        smart.power_on_hours[0], smart.number_of_error_info_log_entries[0]);
+
+    c.lid = 0x7f;
+    sc = bench_admin((NVMECmd *)&c);
+    c.lid = NVME_LOG_ERROR_INFO;
+    c.numd = sizeof(err) / 4 - 1;
+    c.prp1 = buf;
+    c.prp2 = 0;
+    printf("error-log: invalid lid sc 0x%x, ", sc);
+    sc = bench_admin((NVMECmd *)&c);
+    memcpy(&err, guest_ptr(buf), sizeof(err));
+    printf("sc 0x%x count %"PRIu64" sqid %u cid 0x%x status 0x%x\n", sc,
+        err.error_count, err.sqid, err.cid, err.status);
+}
+
+static void bench_identify(void)
+{
+    NVMEAdmCmdIdentify id;
+    NVMEIdentifyController *ctrl;
+    NVMEIdentifyNamespace *ns;
+    uint64_t buf = guest_alloc(BENCH_PAGE_SIZE);
+    uint32_t i;
+    int sc;
+
+    memset(&id, 0, sizeof(id));
+    id.opcode = NVME_ADM_CMD_IDENTIFY;
+    id.cid = 0xfffe;
+    id.prp1 = buf;
+    id.cns = NVME_IDENTIFY_CONTROLLER;
+    sc = bench_admin((NVMECmd *)&id);
+    ctrl = guest_ptr(buf);
+    if (sc || !ctrl->nn || ctrl->nn > NVME_MAX_NAMESPACES) {
+        fprintf(stderr, "nvme-bench: identify controller failed: 0x%x\n", sc);
+        exit(1);
+    }
+    nr_ns = ctrl->nn;
+    if (use_sgl && !(ctrl->sgls & NVME_SGLS_SUPPORTED)) {
+        fprintf(stderr, "nvme-bench: the controller does not take SGLs\n");
+        exit(1);
+    }
+    if (ctrl->mdts && block_size > (BENCH_PAGE_SIZE << ctrl->mdts)) {
+        fprintf(stderr, "nvme-bench: block size above the %u byte MDTS\n",
+            BENCH_PAGE_SIZE << ctrl->mdts);
+        exit(1);
+    }
+
+    for (i = 0; i < nr_ns; i++) {
+        id.cns = NVME_IDENTIFY_NAMESPACE;
+        id.nsid = i + 1;
+        sc = bench_admin((NVMECmd *)&id);
+        ns = guest_ptr(buf);
+        if (sc) {
+            fprintf(stderr, "nvme-bench: identify namespace %u failed: "
+                "0x%x\n", i + 1, sc);
+            exit(1);
+        }
+        ns_blocks[i] = ns->nsze;
+        ns_io_blocks[i] = ns->nsze;
+        ns_lba_size[i] = 1 << ns->lbaf[ns->flbas & 0xf].lbads;
+        if (block_size % ns_lba_size[i] ||
+            ns_blocks[i] < block_size / ns_lba_size[i]) {
+            fprintf(stderr, "nvme-bench: bs does not fit namespace %u "
+                "(%"PRIu64" LBAs of %u bytes)\n", i + 1, ns_blocks[i],
+                ns_lba_size[i]);
+            exit(1);
+        }
+    }
+}
+
+/* Deallocate every namespace with one DSM command of two ranges and
+ * print the namespace utilization before and after */
+static uint64_t bench_nuse(uint32_t nsid)
+{
+    NVMEAdmCmdIdentify id;
+    uint64_t buf = guest_alloc(BENCH_PAGE_SIZE);
+
+    memset(&id, 0, sizeof(id));
+    id.opcode = NVME_ADM_CMD_IDENTIFY;
+    id.cid = 0xfffe;
+    id.prp1 = buf;
+    id.cns = NVME_IDENTIFY_NAMESPACE;
+    id.nsid = nsid;
+    bench_admin((NVMECmd *)&id);
+    return ((NVMEIdentifyNamespace *)guest_ptr(buf))->nuse;
+}
+
+static void bench_trim(void)
+{
+    struct NVME_dsm cmd;
+    NVMECmd sqe;
+    NVMEDsmRange *r;
+    uint64_t buf = guest_alloc(BENCH_PAGE_SIZE);
+    NVMECQE *cqe;
+    uint64_t before;
+    uint32_t i;
+    int k;
+
+    for (i = 0; i < nr_ns; i++) {
+        before = bench_nuse(i + 1);
+        r = guest_ptr(buf);
+        memset(r, 0, 2 * sizeof(*r));
+        /* An unaligned head range and the rest of the namespace */
+        r[0].slba = 1;
+        r[0].nlb = 6;
+        r[1].slba = 7;
+        r[1].nlb = ns_blocks[i] - 7;
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.opcode = NVME_CMD_DSM;
+        cmd.cid = 0;
+        cmd.nsid = i + 1;
+        cmd.prp1 = buf;
+        cmd.nr = 1;
+        cmd.attributes = NVME_DSM_AD;
+        memcpy(&sqe, &cmd, sizeof(sqe));
+        bench_submit(&io_q[0], &sqe);
+        bench_ring_sq(&io_q[0]);
+        for (k = 0; !(cqe = bench_reap(&io_q[0])); k++) {
+            bench_loop_wait(k == 0);
+        }
+        bench_ring_cq(&io_q[0]);
+        printf("ns %u: deallocate sc 0x%x, nuse %"PRIu64" -> %"PRIu64"\n",
+            i + 1, ((NVMEStatusField *)&cqe->status)->sc, before,
+            bench_nuse(i + 1));
+    }
+}
+
+/* Submit one command on the first I/O queue and wait for it. Returns the
+ * status as SCT << 8 | SC. */
+static int bench_io_sync(void *cmd, int nr)
+{
+    NVMECmd sqe[2];
+    NVMECQE *cqe;
+    NVMEStatusField *sf;
+    int k, i, status = 0;
+
+    memcpy(sqe, cmd, nr * sizeof(NVMECmd));
+    for (i = 0; i < nr; i++) {
+        bench_submit(&io_q[0], &sqe[i]);
+    }
+    bench_ring_sq(&io_q[0]);
+    for (i = 0; i < nr; i++) {
+        for (k = 0; !(cqe = bench_reap(&io_q[0])); k++) {
+            bench_loop_wait(k == 0);
+        }
+        sf = (NVMEStatusField *)&cqe->status;
+        status = status << 16 | sf->sct << 8 | sf->sc;
+    }
+    bench_ring_cq(&io_q[0]);
+    return status;
+}
+
+static void bench_rw(struct NVME_rw *rw, uint8_t opcode, uint64_t buf,
+    uint64_t slba, uint32_t nlb)
+{
+    memset(rw, 0, sizeof(*rw));
+    rw->opcode = opcode;
+    rw->nsid = 1;
+    rw->prp1 = buf;
+    rw->prp2 = buf + BENCH_PAGE_SIZE;
+    rw->slba = slba;
+    rw->nlb = nlb - 1;
+}
+
+/* Write Zeroes, Compare and fused Compare and Write on namespace 1 */
+static void bench_zero_cmp(void)
+{
+    struct NVME_rw rw[2];
+    uint64_t buf = guest_alloc(2 * BENCH_PAGE_SIZE);
+    uint32_t nlb = 2 * BENCH_PAGE_SIZE / ns_lba_size[0];
+
+    memset(guest_ptr(buf), 0xa5, 2 * BENCH_PAGE_SIZE);
+    bench_rw(&rw[0], NVME_CMD_WRITE, buf, 0, nlb);
+    printf("write: 0x%x\n", bench_io_sync(rw, 1));
+    bench_rw(&rw[0], NVME_CMD_COMPARE, buf, 0, nlb);
+    printf("compare same: 0x%x\n", bench_io_sync(rw, 1));
+    bench_rw(&rw[0], NVME_CMD_WRITE_ZEROES, 0, 1, 2);
+    printf("write zeroes: 0x%x\n", bench_io_sync(rw, 1));
+    bench_rw(&rw[0], NVME_CMD_COMPARE, buf, 0, nlb);
+    printf("compare after zeroes: 0x%x\n", bench_io_sync(rw, 1));
+    memset(guest_ptr(buf) + ns_lba_size[0], 0,
+        MIN(2 * ns_lba_size[0], 2 * BENCH_PAGE_SIZE - ns_lba_size[0]));
+    printf("compare zeroed copy: 0x%x\n", bench_io_sync(rw, 1));
+
+    /* Fused: compare matches, write 0x5a over the same LBAs */
+    uint64_t wbuf = guest_alloc(2 * BENCH_PAGE_SIZE);
+    memset(guest_ptr(wbuf), 0x5a, 2 * BENCH_PAGE_SIZE);
+    bench_rw(&rw[0], NVME_CMD_COMPARE, buf, 0, nlb);
+    rw[0].fuse = NVME_FUSE_FIRST;
+    bench_rw(&rw[1], NVME_CMD_WRITE, wbuf, 0, nlb);
+    rw[1].fuse = NVME_FUSE_SECOND;
+    printf("fused pass: 0x%08x\n", bench_io_sync(rw, 2));
+    printf("fused again (miscompare): 0x%08x\n", bench_io_sync(rw, 2));
+    memcpy(guest_ptr(buf), guest_ptr(wbuf), 2 * BENCH_PAGE_SIZE);
+    rw[1].nlb = 0;
+    printf("fused other LBAs: 0x%08x\n", bench_io_sync(rw, 2));
+    rw[0].fuse = 0;
+    printf("second alone: 0x%x\n", bench_io_sync(&rw[1], 1));
+}
+
+static void bench_create_queues(void)
+{
+    NVMEAdmCmdCreateCQ ccq;
+    NVMEAdmCmdCreateSQ csq;
+    uint32_t i;
+    int sc;
+
+    io_q = qemu_mallocz(nr_queues * sizeof(*io_q));
+    for (i = 0; i < nr_queues; i++) {
+        BenchQueue *q = &io_q[i];
+
+        bench_queue_init(q, i + 1, qdepth + 1);
+        if (wrr) {
+            /* Spread the queues over the urgent, high, medium and low
+             * priority classes */
+            q->prio = i % NVME_QPRIO_NR;
+        }
+
+        memset(&ccq, 0, sizeof(ccq));
+        ccq.opcode = NVME_ADM_CMD_CREATE_CQ;
+        ccq.cid = 2 * i;
+        ccq.prp1 = q->cq_addr;
+        ccq.qid = q->qid;
+        ccq.qsize = q->entries - 1;
+        ccq.pc = 1;
+        ccq.ien = 1;
+        ccq.iv = BENCH_IO_VECTOR + i % (NVME_MSIX_NVECTORS - 1);
+        sc = bench_admin((NVMECmd *)&ccq);
+        if (sc) {
+            fprintf(stderr, "nvme-bench: create CQ %d failed: 0x%x\n",
+                q->qid, sc);
+            exit(1);
+        }
+
+        memset(&csq, 0, sizeof(csq));
+        csq.opcode = NVME_ADM_CMD_CREATE_SQ;
+        csq.cid = 2 * i + 1;
+        csq.prp1 = q->sq_addr;
+        csq.qid = q->qid;
+        csq.qsize = q->entries - 1;
+        csq.pc = 1;
+        csq.qprio = q->prio;
+        csq.cqid = q->qid;
+        sc = bench_admin((NVMECmd *)&csq);
+        if (sc) {
+            fprintf(stderr, "nvme-bench: create SQ %d failed: 0x%x\n",
+                q->qid, sc);
+            exit(1);
+        }
+    }
+}
+
+/* Move the I/O queue doorbells to guest memory with Doorbell Buffer
+ * Config */
+static void bench_dbbuf_config(void)
+{
+    NVMECmd cmd;
+    int sc;
+
+    /* Laid out like the doorbells, at their stride */
+    dbbuf_size = MAX(NVME_DB_SIZE(dstrd), BENCH_PAGE_SIZE);
+    dbbuf_addr = guest_alloc(2 * dbbuf_size);
+    memset(guest_ptr(dbbuf_addr), 0, 2 * dbbuf_size);
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_ADM_CMD_DBBUF_CONFIG;
+    cmd.prp1 = dbbuf_addr;
+    cmd.prp2 = dbbuf_addr + dbbuf_size;
+    sc = bench_admin(&cmd);
+    if (sc) {
+        fprintf(stderr, "nvme-bench: Doorbell Buffer Config failed: 0x%x\n",
+            sc);
+        exit(1);
+    }
+}
+
+/* Allocate the data buffer and PRPs of every command slot. With -S the
+ * data pages are not physically adjacent. */
+static void bench_init_slots(void)
+{
+    uint32_t pages = block_size / BENCH_PAGE_SIZE;
+    uint32_t i, p, idx, stride = scatter ? 2 : 1;
+    uint64_t buf, list, *ents;
+
+    slots = qemu_mallocz(nr_queues * qdepth * sizeof(*slots));
+    for (i = 0; i < nr_queues * qdepth; i++) {
+        BenchSlot *s = &slots[i];
+
+        buf = guest_alloc((uint64_t)pages * stride * BENCH_PAGE_SIZE);
+        memset(guest_ptr(buf), i, (uint64_t)pages * stride * BENCH_PAGE_SIZE);
+        s->buf = buf;
+        s->prp1 = buf;
+        if (use_sgl) {
+            s->sgl.addr = buf;
+            s->sgl.len = block_size;
+            s->sgl.type = NVME_SGL_DATA_BLOCK << 4;
+            if (scatter && pages > 1) {
+                /* One Data Block per page, in a Last Segment */
+                NVMESglDesc *descs;
+
+                list = (use_cmb ? cmb_alloc : guest_alloc)(pages *
+                    sizeof(*descs));
+                descs = guest_ptr(list);
+                memset(descs, 0, pages * sizeof(*descs));
+                for (p = 0; p < pages; p++) {
+                    descs[p].addr = buf + (uint64_t)p * stride *
+                        BENCH_PAGE_SIZE;
+                    descs[p].len = BENCH_PAGE_SIZE;
+                    descs[p].type = NVME_SGL_DATA_BLOCK << 4;
+                }
+                s->sgl.addr = list;
+                s->sgl.len = pages * sizeof(*descs);
+                s->sgl.type = NVME_SGL_LAST_SEGMENT << 4;
+            }
+        } else if (pages == 2) {
+            s->prp2 = buf + stride * BENCH_PAGE_SIZE;
+        } else if (pages > 2) {
+            /* One list entry per page, plus the chain pointers */
+            list = (use_cmb ? cmb_alloc : guest_alloc)((pages + pages / 511 +
+                1) * sizeof(uint64_t));
+            ents = guest_ptr(list);
+            for (p = 1, idx = 0; p < pages; idx++) {
+                if (idx % 512 == 511 && pages - p > 1) {
+                    ents[idx] = list + (idx + 1) * sizeof(uint64_t);
+                    continue;
+                }
+                ents[idx] = buf + (uint64_t)p * stride * BENCH_PAGE_SIZE;
+                p++;
+            }
+            s->prp2 = list;
+        }
+    }
+}
+
+/* With -v every LBA carries its number, checked when it is read back */
+static uint64_t *lba_stamp(BenchSlot *s, uint32_t lba_size, uint32_t lba)
+{
+    uint64_t off = (uint64_t)lba * lba_size;
+    uint32_t stride = scatter ? 2 : 1;
+
+    return guest_ptr(s->buf + (off / BENCH_PAGE_SIZE) * stride *
+        BENCH_PAGE_SIZE + off % BENCH_PAGE_SIZE);
+}
+
+static void bench_issue(BenchQueue *q, uint16_t cid)
+{
+    BenchSlot *s = &slots[(q->qid - 1) * qdepth + cid];
+    uint32_t ns = (q->qid - 1) % nr_ns;
+    uint32_t nlb = block_size / ns_lba_size[ns];
+    uint32_t i;
+    NVMECmd cmd;
+    struct NVME_rw *rw = (struct NVME_rw *)&cmd;
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = (uint32_t)(rand() % 100) < write_pct ?
+        NVME_CMD_WRITE : NVME_CMD_READ;
+    if (flush_pct && (uint32_t)(rand() % 100) < flush_pct) {
+        cmd.opcode = NVME_CMD_FLUSH;
+    }
+    cmd.cid = cid;
+    cmd.nsid = ns + 1;
+    cmd.prp1 = s->prp1;
+    cmd.prp2 = s->prp2;
+    if (use_sgl) {
+        memcpy(&cmd.prp1, &s->sgl, sizeof(s->sgl));
+        cmd.fuse = NVME_PSDT_SGL << 6;
+    }
+    if (random_io) {
+        rw->slba = ((uint64_t)rand() % (ns_io_blocks[ns] / nlb)) * nlb;
+    } else {
+        rw->slba = seq_lba[ns];
+        seq_lba[ns] += nlb;
+        seq_end[ns] = MAX(seq_end[ns], seq_lba[ns]);
+        if (seq_lba[ns] + nlb > ns_io_blocks[ns]) {
+            seq_lba[ns] = 0;
+        }
+    }
+    rw->nlb = nlb - 1;
+
+    if (verify) {
+        for (i = 0; i < nlb; i++) {
+            *lba_stamp(s, ns_lba_size[ns], i) = cmd.opcode == NVME_CMD_WRITE ?
+                rw->slba + i : ~0ULL;
+        }
+    }
+    s->slba = rw->slba;
+    s->opcode = cmd.opcode;
+    s->start = get_clock();
+    bench_submit(q, &cmd);
+    nr_issued++;
+}
+
+static void bench_complete(BenchQueue *q, NVMECQE *cqe)
+{
+    BenchSlot *s = &slots[(q->qid - 1) * qdepth + cqe->command_id];
+    NVMEStatusField *sf = (NVMEStatusField *)&cqe->status;
+    uint32_t lba_size = ns_lba_size[(q->qid - 1) % nr_ns];
+    uint32_t i;
+
+    if (sf->sc) {
+        nr_errors++;
+    } else if (verify && s->opcode == NVME_CMD_READ) {
+        for (i = 0; i < block_size / lba_size; i++) {
+            if (*lba_stamp(s, lba_size, i) != s->slba + i) {
+                nr_miscompares++;
+                break;
+            }
+        }
+    }
+    lat[nr_done] = get_clock() - s->start;
+    q->lat_sum += lat[nr_done++];
+    q->done++;
+    bytes_done += block_size;
+}
+
+static int cmp_lat(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Keep every queue filled until nr_ios commands have completed, then
+ * print the statistics of the run */
+static void bench_run(void)
+{
+    NVMECQE *cqe;
+    int64_t start, elapsed, lat_sum = 0;
+    uint64_t irqs = nr_irqs, doorbells = nr_doorbells, k;
+    uint32_t i, nr, reaped;
+    uint16_t cid;
+
+    nr_done = nr_issued = bytes_done = 0;
+    memset(seq_lba, 0, sizeof(seq_lba));
+    for (i = 0; i < nr_queues; i++) {
+        io_q[i].done = 0;
+        io_q[i].lat_sum = 0;
+    }
+
+    start = get_clock();
+    for (i = 0; i < nr_queues; i++) {
+        for (cid = 0; cid < qdepth && nr_issued < nr_ios; cid++) {
+            bench_issue(&io_q[i], cid);
+        }
+        bench_ring_sq(&io_q[i]);
+    }
+
+    while (nr_done < nr_ios) {
+        reaped = 0;
+        for (i = 0; i < nr_queues; i++) {
+            BenchQueue *q = &io_q[i];
+
+            nr = 0;
+            while ((cqe = bench_reap(q))) {
+                cid = cqe->command_id;
+                bench_complete(q, cqe);
+                if (nr_issued < nr_ios) {
+                    bench_issue(q, cid);
+                }
+                nr++;
+            }
+            if (nr) {
+                bench_ring_cq(q);
+                bench_ring_sq(q);
+                reaped += nr;
+            }
+        }
+        bench_loop_wait(reaped != 0);
+    }
+    elapsed = get_clock() - start;
+    irqs = nr_irqs - irqs;
+    doorbells = nr_doorbells - doorbells;
+
+    qsort(lat, nr_done, sizeof(*lat), cmp_lat);
+    for (k = 0; k < nr_done; k++) {
+        lat_sum += lat[k];
+    }
+    printf("%"PRIu64" commands, %u queue(s) x qd %u, bs %u, %u%% writes, "
+        "%s\n", nr_done, nr_queues, qdepth, block_size, write_pct,
+        random_io ? "random" : "sequential");
+    printf("  %.0f IOPS, %.2f MB/s, %.3f s, %.2f commands per interrupt\n",
+        nr_done * 1e9 / elapsed, bytes_done * 1e9 / elapsed / (1 << 20),
+        elapsed / 1e9, irqs ? (double)nr_done / irqs : 0.0);
+    printf("  %.2f doorbell writes per command\n",
+        (double)doorbells / nr_done);
+    printf("  latency us: min %.1f avg %.1f p50 %.1f p99 %.1f p99.9 %.1f "
+        "max %.1f\n",
+        lat[0] / 1e3, lat_sum / 1e3 / nr_done,
+        lat[nr_done / 2] / 1e3, lat[nr_done * 99 / 100] / 1e3,
+        lat[nr_done * 999 / 1000] / 1e3, lat[nr_done - 1] / 1e3);
+    if (wrr) {
+        for (i = 0; i < nr_queues; i++) {
+            printf("  queue %u, class %u: %"PRIu64" commands, "
+                "avg latency %.1f us\n", io_q[i].qid, io_q[i].prio,
+                io_q[i].done,
+                io_q[i].done ? io_q[i].lat_sum / 1e3 / io_q[i].done : 0.0);
+        }
+    }
+}
+
+static void usage(const char *name)
+{
+    printf(
+"Usage: %s [OPTIONS]\n"
+"\n"
+"Drive the NVMe device model from synthetic guest memory and report\n"
+"the performance of the controller path alone.\n"
+"\n"
+"  -o, --props=LIST      controller properties, e.g. drive=disk.img,iothreads=1\n"
+"  -n, --nocache         open the drive with O_DIRECT\n"
+"  -j, --queues=N        number of I/O queue pairs (default 1)\n"
+"  -q, --qdepth=N        commands in flight per queue (default 32)\n"
+"  -b, --bs=N            bytes per command, a multiple of 4096 (default 4096)\n"
+"  -w, --write=PCT       percentage of writes (default 0)\n"
+"  -r, --random          random instead of sequential LBAs\n"
+"  -S, --scatter         data pages that are not physically adjacent\n"
+"  -c, --count=N         number of commands to complete (default 100000)\n"
+"  -m, --mem=MB          size of the guest memory (default 256)\n"
+"  -a, --wrr=H:M:L       weighted round robin arbitration with these\n"
+"                        weights; the queues cycle through the urgent,\n"
+"                        high, medium and low priority classes\n"
+"  -i, --coalesce=THR:US  interrupt coalescing: one interrupt per THR\n"
+"                        completions, held back at most US microseconds\n"
+"  -v, --verify          write the LBAs, then read them back and check them;\n"
+"                        not with -w\n"
+"  -f, --flush=PCT       percentage of the commands that are flushes\n"
+"  -W, --write-through   disable the volatile write cache\n"
+"  -d, --dbbuf           shadow doorbells in guest memory (Doorbell Buffer\n"
+"                        Config)\n"
+"  -C, --cmb             place the I/O SQs and the PRP lists or SGL segments\n"
+"                        in the Controller Memory Buffer, sized with the\n"
+"                        cmb_size_mb property\n"
+"  -g, --sgl             describe the data with SGLs rather than PRPs: one\n"
+"                        Data Block, or one per page with -S\n"
+"  -t, --trim            deallocate the namespaces after the run\n"
+"  -s, --stats           print the controller statistics after the run\n"
+"  -z, --zero-compare    check Write Zeroes and Compare after the run\n"
+"  -h, --help            display this help and exit\n"
+"\n"
+"Without a drive the controller uses its mmap backing file, created in\n"
+"the current directory.\n",
+    name);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] = {
+        { "props", required_argument, NULL, 'o' },
+        { "nocache", no_argument, NULL, 'n' },
+        { "queues", required_argument, NULL, 'j' },
+        { "qdepth", required_argument, NULL, 'q' },
+        { "bs", required_argument, NULL, 'b' },
+        { "write", required_argument, NULL, 'w' },
+        { "random", no_argument, NULL, 'r' },
+        { "scatter", no_argument, NULL, 'S' },
+        { "count", required_argument, NULL, 'c' },
+        { "mem", required_argument, NULL, 'm' },
+        { "wrr", required_argument, NULL, 'a' },
+        { "coalesce", required_argument, NULL, 'i' },
+        { "verify", no_argument, NULL, 'v' },
+        { "trim", no_argument, NULL, 't' },
+        { "flush", required_argument, NULL, 'f' },
+        { "write-through", no_argument, NULL, 'W' },
+        { "dbbuf", no_argument, NULL, 'd' },
+        { "cmb", no_argument, NULL, 'C' },
+        { "sgl", no_argument, NULL, 'g' },
+        { "zero-compare", no_argument, NULL, 'z' },
+        { "stats", no_argument, NULL, 's' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    NVMEState *n;
+    char *props = NULL;
+    uint64_t mem_mb = 256;
+    unsigned int hpw, mpw, lpw, thr, us, i;
+    int random_read, stats = 0;
+    int c;
+
+    while ((c = getopt_long(argc, argv, "o:nj:q:b:w:rSc:m:a:i:vtzf:WdCgsh", long_options,
+                            NULL)) != -1) {
+        switch (c) {
+        case 'o':
+            props = optarg;
+            break;
+        case 'n':
+            bench_bdrv_flags |= BDRV_O_NOCACHE;
+            break;
+        case 'j':
+            nr_queues = strtoul(optarg, NULL, 0);
+            break;
+        case 'q':
+            qdepth = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            block_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'w':
+            write_pct = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            random_io = 1;
+            break;
+        case 'S':
+            scatter = 1;
+            break;
+        case 'c':
+            nr_ios = strtoull(optarg, NULL, 0);
+            break;
+        case 'm':
+            mem_mb = strtoull(optarg, NULL, 0);
+            break;
+        case 'a':
+            if (sscanf(optarg, "%u:%u:%u", &hpw, &mpw, &lpw) != 3 ||
+                !hpw || !mpw || !lpw || hpw > 256 || mpw > 256 ||
+                lpw > 256) {
+                fprintf(stderr, "nvme-bench: weights must be in 1..256\n");
+                exit(1);
+            }
+            /* 0's based weights, arbitration burst of one command */
+            arbitration = ((hpw - 1) << 24) | ((mpw - 1) << 16) |
+                ((lpw - 1) << 8);
+            wrr = 1;
+            break;
+        case 'i':
+            if (sscanf(optarg, "%u:%u", &thr, &us) != 2 || !thr ||
+                thr > 256 || us < 100 || us > 25500) {
+                fprintf(stderr, "nvme-bench: coalescing must be THR:US with "
+                    "THR in 1..256 and US in 100..25500\n");
+                exit(1);
+            }
+            /* 0's based threshold, time in 100us units */
+            coalescing = (thr - 1) | ((us / 100) << 8);
+            break;
+        case 'v':
+            verify = 1;
+            break;
+        case 'z':
+            zero_cmp = 1;
+            break;
+        case 'W':
+            write_through = 1;
+            break;
+        case 'd':
+            dbbuf = 1;
+            break;
+        case 'C':
+            use_cmb = 1;
+            break;
+        case 'g':
+            use_sgl = 1;
+            break;
+        case 'f':
+            flush_pct = strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            trim = 1;
+            break;
+        case 's':
+            stats = 1;
+            break;
+        case 'h':
+        default:
+            usage(argv[0]);
+            exit(c == 'h' ? 0 : 1);
+        }
+    }
+
+    if (!nr_queues || nr_queues >= NVME_MAX_QID) {
+        fprintf(stderr, "nvme-bench: queues must be in 1..%d\n",
+            NVME_MAX_QID - 1);
+        exit(1);
+    }
+    if (!qdepth || qdepth >= NVME_MAX_QUEUE_SIZE) {
+        fprintf(stderr, "nvme-bench: qdepth must be in 1..%d\n",
+            NVME_MAX_QUEUE_SIZE - 1);
+        exit(1);
+    }
+    if (!block_size || block_size % BENCH_PAGE_SIZE) {
+        fprintf(stderr, "nvme-bench: bs must be a multiple of %d\n",
+            BENCH_PAGE_SIZE);
+        exit(1);
+    }
+    if (verify && write_pct) {
+        fprintf(stderr, "nvme-bench: -v writes then reads, it does not "
+            "take -w\n");
+        exit(1);
+    }
+    if (!nr_ios) {
+        exit(0);
+    }
+
+    guest_ram_size = mem_mb << 20;
+    guest_ram = qemu_memalign(BENCH_PAGE_SIZE, guest_ram_size);
+    memset(guest_ram, 0, guest_ram_size);
+
+    bdrv_init();
+    module_call_init(MODULE_INIT_DEVICE);
+    if (!nvme_info) {
+        fprintf(stderr, "nvme-bench: nvme device not registered\n");
+        exit(1);
+    }
+
+    n = qemu_mallocz(nvme_info->qdev.size);
+    n->dev.config = qemu_mallocz(PCI_CONFIG_SPACE_SIZE);
+    set_prop_defaults(&n->dev.qdev, nvme_info->qdev.props);
+    if (props && set_props(&n->dev.qdev, nvme_info->qdev.props, props) < 0) {
+        exit(1);
+    }
+    if (nvme_info->init(&n->dev) < 0) {
+        fprintf(stderr, "nvme-bench: controller init failed\n");
+        exit(1);
+    }
+    bar0_map(&n->dev, 0, BENCH_BAR0_ADDR, n->bar0_size,
+        PCI_BASE_ADDRESS_SPACE_MEMORY | PCI_BASE_ADDRESS_MEM_TYPE_64);
+    if (cmb_map) {
+        cmb_map(&n->dev, NVME_CMB_BIR, BENCH_CMB_ADDR, cmb_size,
+            PCI_BASE_ADDRESS_SPACE_MEMORY | PCI_BASE_ADDRESS_MEM_TYPE_64 |
+            PCI_BASE_ADDRESS_MEM_PREFETCH);
+    }
+    if (use_cmb && !(mmio_readl(NVME_CMBSZ) & NVME_CMBSZ_SQS)) {
+        fprintf(stderr, "nvme-bench: -C needs the cmb_size_mb property\n");
+        exit(1);
+    }
+    dstrd = mmio_readl(NVME_CAP + 4) & 0xf;
+
+    bench_enable();
+    if (wrr) {
+        bench_set_feature(NVME_FEATURE_ARBITRATION, arbitration);
+    }
+    if (write_through) {
+        bench_set_feature(NVME_FEATURE_VOLATILE_WRITE_CACHE, 0);
+    }
+    if (coalescing) {
+        bench_set_feature(NVME_FEATURE_INTERRUPT_COALESCING, coalescing);
+    }
+    bench_create_queues();
+    if (dbbuf) {
+        bench_dbbuf_config();
+    }
+    bench_init_slots();
+    bench_identify();
+    lat = qemu_malloc(nr_ios * sizeof(*lat));
+
+    if (verify) {
+        /* Write pass, then read pass over the same LBAs */
+        random_read = random_io;
+        random_io = 0;
+        write_pct = 100;
+        bench_run();
+        write_pct = 0;
+        /* Only read back what the write pass covered */
+        memcpy(ns_io_blocks, seq_end, sizeof(ns_io_blocks));
+        random_io = random_read;
+    }
+    bench_run();
+    if (nr_errors || nr_miscompares) {
+        printf("%"PRIu64" errors, %"PRIu64" miscompares\n", nr_errors,
+            nr_miscompares);
+    }
+
+    if (zero_cmp) {
+        bench_zero_cmp();
+    }
+    if (trim) {
+        bench_trim();
+    }
+    if (stats) {
+        bench_smart_log();
+    }
+    if (stats && nvme_stats_info) {
+        QObject *data;
+        QString *json;
+
+        nvme_stats_info(NULL, &data);
+        nvme_stats_print(NULL, data);
+        json = qobject_to_json(data);
+        printf("%s\n", qstring_get_str(json));
+        QDECREF(json);
+        qobject_decref(data);
+    }
+    nvme_info->exit(&n->dev);
+    for (i = 0; i < NVME_MAX_NAMESPACES; i++) {
+        if (n->ns[i].bs) {
+            bdrv_delete(n->ns[i].bs);
+        }
+    }
+    return nr_errors || nr_miscompares;
+}
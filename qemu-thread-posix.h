@@ -14,4 +14,8 @@ struct QemuThread {
     pthread_t thread;
 };
 
+/* Returns ETIMEDOUT when msecs elapsed without a signal */
+int qemu_cond_timedwait(QemuCond *cond, QemuMutex *mutex, unsigned int msecs);
+void qemu_thread_join(QemuThread *thread);
+
 #endif
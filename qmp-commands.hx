@@ -1477,6 +1477,74 @@ Example:
 
 EQMP
 
+SQMP
+query-nvme
+----------
+
+Show the statistics of the NVMe controllers, counted since the controller
+was created.
+
+Each controller is represented by a json-object, the returned value is a
+json-array of all controllers. Each json-object contains the following:
+
+- "addr": PCI slot and function of the controller (json-string)
+- "id": device id, if any (json-string, optional)
+- "queues": a json-array of the admin queue and the created I/O queues,
+            each one with the following:
+    - "qid": queue ID (json-int)
+    - "commands": commands fetched from the SQ (json-int)
+    - "errors": commands completed with an error (json-int)
+    - "read-bytes": bytes read or compared (json-int)
+    - "write-bytes": bytes written (json-int)
+    - "sq-depth": entries pending in the SQ (json-int)
+    - "sq-max-depth": highest SQ depth seen (json-int)
+    - "completions": entries posted to the CQ (json-int)
+    - "inflight": commands in flight for the CQ (json-int)
+    - "max-inflight": highest count of commands in flight (json-int)
+    - "cq-full": times the SQs of the CQ stalled on a full CQ (json-int)
+- "latency": a json-array of the opcodes that ran, each one with:
+    - "admin": true for an admin command (json-bool)
+    - "opcode": opcode (json-int)
+    - "name": opcode name (json-string, optional)
+    - "count": completed commands (json-int)
+    - "total-ns": sum of the latencies in nanoseconds (json-int)
+    - "max-ns": highest latency in nanoseconds (json-int)
+    - "histogram": json-array of 24 json-ints, bucket 0 counts latencies
+                   under 1us, bucket N >= 1 those of [2^(N-1), 2^N) us,
+                   the last one includes all longer latencies
+
+Example:
+
+-> { "execute": "query-nvme" }
+<- { "return": [
+         {
+            "addr": "04.0",
+            "queues": [
+               { "qid": 0, "commands": 30, "errors": 0, "read-bytes": 0,
+                 "write-bytes": 0, "sq-depth": 0, "sq-max-depth": 1,
+                 "completions": 30, "inflight": 1, "max-inflight": 1,
+                 "cq-full": 0 },
+               { "qid": 1, "commands": 2048, "errors": 0,
+                 "read-bytes": 8388608, "write-bytes": 0, "sq-depth": 0,
+                 "sq-max-depth": 32, "completions": 2048, "inflight": 0,
+                 "max-inflight": 32, "cq-full": 0 }
+            ],
+            "latency": [
+               { "admin": true, "opcode": 6, "name": "identify",
+                 "count": 3, "total-ns": 21000, "max-ns": 9000,
+                 "histogram": [0, 0, 0, 2, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                               0, 0, 0, 0, 0, 0, 0, 0, 0, 0] },
+               { "admin": false, "opcode": 2, "name": "read",
+                 "count": 2048, "total-ns": 61440000, "max-ns": 95000,
+                 "histogram": [0, 0, 0, 0, 0, 1500, 500, 48, 0, 0, 0, 0,
+                               0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0] }
+            ]
+         }
+      ]
+   }
+
+EQMP
+
 SQMP
 query-status
 ------------